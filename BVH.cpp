@@ -1,5 +1,6 @@
 #include <algorithm>
 #include "Triangle.h"
+#include "MeshObject.h"
 #include "SSE.h"
 #include "BVH.h"
 #include "Ray.h"
@@ -11,7 +12,12 @@
 
 using namespace std;
 
-void getCornerPoints(Corner (&outCorners)[2], Objects * objs)
+const float BVH::REBUILD_OVERLAP_GROWTH = 1.25f;
+const float BVH::SPATIAL_SPLIT_BUDGET = 0.3f;
+const float BVH::SPATIAL_SPLIT_ALPHA = 1e-5f;
+const float BVH::TRAVERSAL_COST = 1.2f;
+
+void getCornerPoints(Corner (&outCorners)[2], PrimitiveList * objs, const std::vector<PrimitiveBounds> & bounds)
 {
     for (int i = 0; i < 3; i++)
     {
@@ -21,11 +27,8 @@ void getCornerPoints(Corner (&outCorners)[2], Objects * objs)
 
     for (size_t i = 0; i < objs->size(); ++i)
     {
-        //Ignore infinitely spanning objects like planes
-        if (!(*objs)[i]->isBounded()) continue;
-
-        Vector3 objMax = (*objs)[i]->coordsMax(),
-                objMin = (*objs)[i]->coordsMin();
+        const Vector3 &objMax = bounds[(*objs)[i]].max,
+                      &objMin = bounds[(*objs)[i]].min;
     
         for (int j = 0; j < 3; j++)
         {
@@ -50,120 +53,394 @@ float getArea(const Corner (&corners)[2])
     return 2*area;
 }
 
-inline float getCost(const Corner (&corners)[2], Objects &objects)
+inline float getCost(const Corner (&corners)[2], PrimitiveList &objects)
     {
         //If the number of objects is 0, corners might have funny values.
         if (objects.size() == 0) return 0;
         return ((float)objects.size()) * getArea(corners);
     }
 
+//Fills in the bounds of all primitives and returns the list of all of them
+PrimitiveList * getPrimitiveBounds(BVHBuildData & data)
+{
+    const Primitives &primitives = data.primitives;
+    std::vector<PrimitiveBounds> &bounds = data.bounds;
+    bounds.resize(primitives.size());
+    PrimitiveList * prims = new PrimitiveList(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++)
+    {
+        //Infinitely spanning objects like planes get empty bounds, so that they are ignored for the boxes
+        bounds[i].min = primitives[i].isBounded() ? primitives[i].coordsMin() : Vector3(infinity);
+        bounds[i].max = primitives[i].isBounded() ? primitives[i].coordsMax() : Vector3(-infinity);
+        bounds[i].center = primitives[i].center();
+        bounds[i].primitive = i;
+        (*prims)[i] = i;
+    }
+
+    return prims;
+}
+
 void
-BVH::build(Objects * objs, int depth)
+BVH::build(Objects * objs)
 {
-#ifdef STATS
-    Stats::BVH_Nodes += 1;
-#endif
+    //A static scene is loaded from the cache instead of being built again
+    unsigned long long hash = 0;
+    if (m_cacheFile)
+    {
+        hash = geometryHash(*objs);
+        if (loadCache(m_cacheFile->c_str(), hash, objs))
+            return;
+    }
 
-    // construct the bounding volume hierarchy
-    //Find the bounds of this node 
-    if (m_corners[0][0] == infinity)
+    //Meshes are split into their triangles here, so that the leaves can
+    //index them directly instead of needing an Object for every face.
+    BVHBuildData data;
+    Primitives &primitives = data.primitives;
+    for (size_t i = 0; i < objs->size(); i++)
     {
-        getCornerPoints(m_corners, objs); 
+        BVHPrimitive p = {(*objs)[i], 0, 0};
+        if (MeshObject *m = dynamic_cast<MeshObject*>(p.object))
+        {
+            p.mesh = m->getMesh();
+            for (p.index = 0; p.index < (unsigned int)p.mesh->numTris(); p.index++)
+                primitives.push_back(p);
+            continue;
+        }
+        if (Triangle *t = dynamic_cast<Triangle*>(p.object))
+        {
+            p.mesh = t->getMesh();
+            p.index = t->getIndex();
+        }
+        primitives.push_back(p);
     }
 
-    //Expand the box by a small epsilon in case it's bounding a flat triangle or similar.
+    //The leaves put their triangles into one packet array, in the order they are built
+    m_packets = new std::vector<TrianglePacket>;
+    data.packets = m_packets;
+
+    PrimitiveList * prims = getPrimitiveBounds(data);
+    if (m_builder != SAH_BUILDER)
+    {
+        buildLinear(data);
+        if (m_builder == LINEAR_TREELET_BUILDER)
+        {
+            std::map<const BVH*, float> costs;
+            restructureTreelets(costs, *m_packets);
+            //The leaves are in a new order, so are their packets
+            compactPackets();
+        }
+    }
+    else if (m_spatialSplits)
+    {
+        data.maxReferences = (size_t)(primitives.size()*(1+SPATIAL_SPLIT_BUDGET));
+        getCornerPoints(m_corners, prims, data.bounds);
+        data.rootArea = getArea(m_corners);
+        build(prims, data, 0);
+    }
+    else
+        build(prims, data, 0);
+
+    if (m_spatialSplits && m_builder == SAH_BUILDER)
+        debug("Spatial splits: %d references to %d primitives\n", (int)data.bounds.size(), (int)primitives.size());
+
+    delete prims;
+
+    if (m_cacheFile && !saveCache(m_cacheFile->c_str(), hash, objs))
+        debug("Could not write the BVH cache %s\n", m_cacheFile->c_str());
+}
+
+//Grows the box to contain the box from min to max
+inline void growCorners(Corner (&corners)[2], const Vector3 &min, const Vector3 &max)
+{
     for (int i = 0; i < 3; i++)
     {
-        m_corners[0][i] -= epsilon;
-        m_corners[1][i] += epsilon;
+        if (min[i] < corners[0][i]) corners[0][i] = min[i];
+        if (max[i] > corners[1][i]) corners[1][i] = max[i];
     }
+}
 
-    //Check if we're done
-    if (objs->size() <= OBJECTS_PER_LEAF || depth >= MAX_TREE_DEPTH)
+//Grows the box from min to max to contain p
+inline void growBounds(Vector3 &min, Vector3 &max, const Vector3 &p)
+{
+    for (int i = 0; i < 3; i++)
     {
-        m_objects = objs;
-        m_isLeaf = true;
+        if (p[i] < min[i]) min[i] = p[i];
+        if (p[i] > max[i]) max[i] = p[i];
+    }
+}
 
-#ifdef STATS
-		Stats::BVH_LeafNodes++;
-#endif 
+//Area of the intersection of two boxes, 0 if they don't overlap
+float getOverlapArea(const Vector3 (&a)[2], const Vector3 (&b)[2])
+{
+    Corner overlap[2];
+    for (int i = 0; i < 3; i++)
+    {
+        overlap[0][i] = std::max(a[0][i], b[0][i]);
+        overlap[1][i] = std::min(a[1][i], b[1][i]);
+        if (overlap[0][i] > overlap[1][i]) return 0;
+    }
+    return getArea(overlap);
+}
 
-        #ifdef __SSE4_1__
-        //Build the triangle cache for SSE
-        int nTriangles = 0;
-        for (int i = 0; i < objs->size(); i++)
+//Bounds of the part of reference ref between the planes lo and hi in
+//dimension dim. Triangles are clipped, so the box is tight around the part
+//of the triangle, other objects just get their box cut. Returns false if no
+//part of the reference is between the planes.
+bool clipReference(const BVHBuildData & data, unsigned int ref, int dim, float lo, float hi, Vector3 &outMin, Vector3 &outMax)
+{
+    const PrimitiveBounds &b = data.bounds[ref];
+    const BVHPrimitive &p = data.primitives[b.primitive];
+    if (p.mesh == 0)
+    {
+        outMin = b.min;
+        outMax = b.max;
+        outMin[dim] = std::max(outMin[dim], lo);
+        outMax[dim] = std::min(outMax[dim], hi);
+        return outMin[dim] <= outMax[dim];
+    }
+
+    TriangleMesh::TupleI3 vInd = p.mesh->vIndices()[p.index];
+    const Vector3 v[3] = {p.mesh->vertices()[vInd.v[0]],
+                          p.mesh->vertices()[vInd.v[1]],
+                          p.mesh->vertices()[vInd.v[2]]};
+    const float planes[2] = {lo, hi};
+    outMin = Vector3(infinity);
+    outMax = Vector3(-infinity);
+
+    //The part between the planes is bounded by the vertices between them
+    //and the points where the edges cross them
+    for (int i = 0; i < 3; i++)
+    {
+        const Vector3 &a = v[i], &c = v[(i+1)%3];
+        if (a[dim] >= lo && a[dim] <= hi)
+            growBounds(outMin, outMax, a);
+
+        for (int j = 0; j < 2; j++)
         {
-            if (dynamic_cast<Triangle*>((*objs)[i]) != 0) nTriangles++;
+            if ((a[dim] < planes[j]) == (c[dim] < planes[j])) continue;
+            Vector3 q = a + (c-a)*((planes[j]-a[dim])/(c[dim]-a[dim]));
+            q[dim] = planes[j];
+            growBounds(outMin, outMax, q);
         }
+    }
+
+    //The reference may already be a clipped part of the triangle
+    for (int i = 0; i < 3; i++)
+    {
+        outMin[i] = std::max(outMin[i], b.min[i]);
+        outMax[i] = std::min(outMax[i], b.max[i]);
+        if (outMin[i] > outMax[i]) return false;
+    }
+    return true;
+}
+
+//Finds the cheapest plane that splits the node in space, from the borders of
+//SPATIAL_SPLIT_BINS bins in every dimension. References that straddle the
+//plane go into both children, clipped to their side. Returns the cost, and
+//the plane in the out parameters.
+float findSpatialSplit(const Corner (&nodeCorners)[2], PrimitiveList * objs, const BVHBuildData & data,
+                       int nBins, int &outDim, float &outPosition)
+{
+    float bestCost = infinity;
+    std::vector<int> entries(nBins), exits(nBins);
+    Corner (*binCorners)[2] = new Corner[nBins][2];
+    Corner (*rightCorners)[2] = new Corner[nBins][2];
+
+    for (int dim = 0; dim < 3; dim++)
+    {
+        float lo = nodeCorners[0][dim], binSize = (nodeCorners[1][dim]-lo)/nBins;
+        if (!(binSize > 0)) continue;
 
-        m_triangleCache = new std::vector<SSETriangleCache>;
-        int tr = 0;
-        for (int i = 0; i < objs->size(); i++)
+        for (int i = 0; i < nBins; i++)
         {
-            Triangle *t = dynamic_cast<Triangle*>((*objs)[i]);
-            if (t == 0) continue;
-            else
-            {
-                objs->erase(objs->begin() + i);
-                i--;
-            }
-            if (tr/4 >= m_triangleCache->size())
+            entries[i] = exits[i] = 0;
+            for (int j = 0; j < 3; j++)
             {
-                m_triangleCache->push_back(SSETriangleCache());
+                binCorners[i][0][j] = infinity;
+                binCorners[i][1][j] = -infinity;
             }
-            (*m_triangleCache)[tr/4].triangles[tr%4] = t;
-            (*m_triangleCache)[tr/4].nTriangles++;
-            tr ++;
         }
 
-        // Put the vertices and normals into SSE vectors
-        for (int i = 0; i < m_triangleCache->size(); i++)
+        //Count where the references start and end, and bound their parts in every bin
+        for (size_t i = 0; i < objs->size(); i++)
         {
-            SSETriangleCache & c = (*m_triangleCache)[i];
-
-            //3 dimensions, up to 4*3 floats (3 components per vertex). For each dimension, store (A1x, A2x, A3x, A4x, B1x, B2x, B3x...)
-            float verts[3][12];       
-            float normals[3][12]; 
+            unsigned int ref = (*objs)[i];
+            const PrimitiveBounds &b = data.bounds[ref];
+            if (b.min[dim] > b.max[dim])
+            {
+                //Unbounded objects go to the left, like in splitReferences
+                entries[0]++;
+                exits[0]++;
+                continue;
+            }
+            int first = (int)std::min(nBins-1.0f, std::max(0.0f, (b.min[dim]-lo)/binSize)),
+                last = (int)std::min(nBins-1.0f, std::max((float)first, (b.max[dim]-lo)/binSize));
+            entries[first]++;
+            exits[last]++;
 
-#pragma unroll(4)
-            for (int t = 0; t < c.nTriangles; t++)
+            if (first == last)
             {
-                TriangleMesh* m = c.triangles[t]->getMesh();
-                TriangleMesh::TupleI3 vInd = m->vIndices()[c.triangles[t]->getIndex()];
-                TriangleMesh::TupleI3 nInd = m->nIndices()[c.triangles[t]->getIndex()];
+                growCorners(binCorners[first], b.min, b.max);
+                continue;
+            }
+            for (int bin = first; bin <= last; bin++)
+            {
+                Vector3 partMin, partMax;
+                if (clipReference(data, ref, dim, lo + bin*binSize, lo + (bin+1)*binSize, partMin, partMax))
+                    growCorners(binCorners[bin], partMin, partMax);
+            }
+        }
 
-                //for each vertex (A, B, C)
-#pragma unroll(3)
-                for (int k = 0; k < 3; k++)
-                {
-                    //for each dimension
-#pragma unroll(3)
-                    for (int i = 0; i < 3; i++)
-                    {
-                        {
-                            verts[i][k*4+t] = m->vertices()[vInd.v[k]][i];
-                            normals[i][k*4+t] = m->normals()[nInd.v[k]][i];
-                        }
-                    }
-                }
+        //Sweep from the right to get the boxes right of each plane
+        for (int j = 0; j < 3; j++)
+        {
+            rightCorners[nBins-1][0][j] = binCorners[nBins-1][0][j];
+            rightCorners[nBins-1][1][j] = binCorners[nBins-1][1][j];
+        }
+        for (int i = nBins-2; i > 0; i--)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                rightCorners[i][0][j] = std::min(rightCorners[i+1][0][j], binCorners[i][0][j]);
+                rightCorners[i][1][j] = std::max(rightCorners[i+1][1][j], binCorners[i][1][j]);
             }
+        }
 
-            //For each dimension, load the A and calculate B-A and C-A.
-#pragma unroll(3)
-            for (int i = 0; i < 3; i++)
+        //Then from the left, for the plane at the start of every bin
+        Corner leftCorners[2] = {{infinity, infinity, infinity, 0}, {-infinity, -infinity, -infinity, 0}};
+        int nLeft = 0, nRight = objs->size();
+        for (int i = 1; i < nBins; i++)
+        {
+            growCorners(leftCorners, Vector3(binCorners[i-1][0][0], binCorners[i-1][0][1], binCorners[i-1][0][2]),
+                                     Vector3(binCorners[i-1][1][0], binCorners[i-1][1][1], binCorners[i-1][1][2]));
+            nLeft += entries[i-1];
+            nRight -= exits[i-1];
+            if (nLeft == 0 || nRight == 0) continue;
+
+            float cost = nLeft*getArea(leftCorners) + nRight*getArea(rightCorners[i]);
+            if (cost < bestCost)
             {
-                c.A.v[i] = _mm_loadu_ps(&verts[i][0]);
-                c.nA.v[i] = _mm_loadu_ps(&normals[i][0]);
-                c.nB.v[i] = _mm_loadu_ps(&normals[i][4]);
-                c.nC.v[i] = _mm_loadu_ps(&normals[i][8]);
-                c.BmA.v[i] = _mm_sub_ps(_mm_loadu_ps(&verts[i][4]), c.A.v[i]);
-                c.CmA.v[i] = _mm_sub_ps(_mm_loadu_ps(&verts[i][8]), c.A.v[i]);
+                bestCost = cost;
+                outDim = dim;
+                outPosition = lo + i*binSize;
             }
+        }
+    }
+
+    delete [] binCorners;
+    delete [] rightCorners;
+    return bestCost;
+}
 
-            //Do the cross product
-            c.normal = SSEmultiCross(c.BmA, c.CmA);
+//Splits the references of a node at the plane found by findSpatialSplit.
+//A reference on both sides is clipped to the left side, and a new one for
+//the right side is added to the bounds.
+void splitReferences(PrimitiveList * objs, BVHBuildData & data, int dim, float position,
+                     PrimitiveList * left, PrimitiveList * right)
+{
+    for (size_t i = 0; i < objs->size(); i++)
+    {
+        unsigned int ref = (*objs)[i];
+        if (data.bounds[ref].max[dim] <= position)
+        {
+            left->push_back(ref);
+            continue;
+        }
+        if (data.bounds[ref].min[dim] >= position)
+        {
+            right->push_back(ref);
+            continue;
+        }
+
+        Vector3 leftMin, leftMax, rightMin, rightMax;
+        bool inLeft = clipReference(data, ref, dim, -infinity, position, leftMin, leftMax),
+             inRight = clipReference(data, ref, dim, position, infinity, rightMin, rightMax);
+        if (inLeft && inRight)
+        {
+            PrimitiveBounds &b = data.bounds[ref];
+            b.min = leftMin;
+            b.max = leftMax;
+            b.center = (leftMin + leftMax)/2;
+            left->push_back(ref);
+
+            PrimitiveBounds rightPart = {rightMin, rightMax, (rightMin + rightMax)/2, b.primitive};
+            right->push_back(data.bounds.size());
+            data.bounds.push_back(rightPart);
+        }
+        else
+            (inLeft ? left : right)->push_back(ref);
+    }
+}
+
+//Copy the vertices of the triangle in slot t from its mesh, and compute its normal
+void setPacketVertices(TrianglePacket &packet, int t)
+{
+    TriangleMesh *mesh = packet.meshes[t];
+    TriangleMesh::TupleI3 vInd = mesh->vIndices()[packet.indices[t]];
+    const Vector3 &A = mesh->vertices()[vInd.v[0]],
+                  &B = mesh->vertices()[vInd.v[1]],
+                  &C = mesh->vertices()[vInd.v[2]];
+    const Vector3 N = cross(B-A, C-A).normalize();
+
+    //The first triangle also fills the unused slots, so the SSE code never
+    //computes with uninitialized values (denormals are very slow)
+    for (int slot = 0; slot < 4; slot++)
+    {
+        if (slot != t && (t != 0 || slot < packet.nTriangles)) continue;
+        for (int i = 0; i < 3; i++)
+        {
+            packet.A[i][slot] = A[i];
+            packet.B[i][slot] = B[i];
+            packet.C[i][slot] = C[i];
+            packet.N[i][slot] = N[i];
         }
+    }
+}
+
+//Put triangle p into the next free slot of a packet
+void addToPacket(TrianglePacket &packet, const BVHPrimitive &p)
+{
+    int t = packet.nTriangles++;
+    packet.objects[t] = p.object;
+    packet.meshes[t] = p.mesh;
+    packet.indices[t] = p.index;
+    setPacketVertices(packet, t);
+}
+
+void
+BVH::build(PrimitiveList * objs, BVHBuildData & data, int depth)
+{
+    const Primitives &primitives = data.primitives;
+    const std::vector<PrimitiveBounds> &bounds = data.bounds;
+
+#ifdef STATS
+    Stats::BVH_Nodes += 1;
 #endif
+
+    // construct the bounding volume hierarchy
+    //Find the bounds of this node 
+    if (m_corners[0][0] == infinity)
+    {
+        getCornerPoints(m_corners, objs, bounds); 
+    }
+
+    //Expand the box by a small epsilon in case it's bounding a flat triangle or similar.
+    for (int i = 0; i < 3; i++)
+    {
+        m_corners[0][i] -= epsilon;
+        m_corners[1][i] += epsilon;
+    }
+
+    //Objects other than triangles, like instances with a BVH of their own,
+    //are expensive to test, so they are split down to one per leaf
+    int nObjects = 0;
+    for (size_t i = 0; i < objs->size(); i++)
+        if (primitives[bounds[(*objs)[i]].primitive].mesh == 0) nObjects++;
+
+    //Check if we're done
+    if ((objs->size() <= OBJECTS_PER_LEAF && nObjects <= 1) || depth >= MAX_TREE_DEPTH)
+    {
+        makeLeaf(objs, data);
     }
     else
     {
@@ -180,20 +457,20 @@ BVH::build(Objects * objs, int depth)
             float current = (m_corners[1][dim] + m_corners[0][dim])/2.0f, beg = m_corners[0][dim], end = m_corners[1][dim];
             bool done = false;
             int nocheckBoundary[2] = {0, 0};
-            Objects children[2];
+            PrimitiveList children[2];
             Corner corners[2][2];
 
             //Put objects into the "left" and "right" node respectively, based on their position in the current dimension
-            for (int i = 0; i < objs->size(); i++)
+            for (size_t i = 0; i < objs->size(); i++)
             {
-                if ((*objs)[i]->center()[dim] < current)
+                if (bounds[(*objs)[i]].center[dim] < current)
                     children[0].push_back((*objs)[i]);
                 else
                     children[1].push_back((*objs)[i]);
             }
 
-            getCornerPoints(corners[0], &children[0]);
-            getCornerPoints(corners[1], &children[1]);
+            getCornerPoints(corners[0], &children[0], bounds);
+            getCornerPoints(corners[1], &children[1], bounds);
 
             for (int searchDepth = 0; searchDepth < maxSearchDepth; searchDepth++)
             {
@@ -242,13 +519,13 @@ BVH::build(Objects * objs, int depth)
                     //Need two conditions here because if the more costly child is the "left" side,
                     //we want to check if the object's center is larger than the current boundary.
                     //Otherwise we want to check if it's smaller.
-                    if ((largest == 0 && children[largest][i]->center()[dim] > current) || 
-                            (largest == 1 && children[largest][i]->center()[dim] < current)) 
+                    if ((largest == 0 && bounds[children[largest][i]].center[dim] > current) || 
+                            (largest == 1 && bounds[children[largest][i]].center[dim] < current)) 
                     {
                         moveCount++;
                         //Get the bounds of the object being moved
-                        Vector3 cmax = children[largest][i]->coordsMax();
-                        Vector3 cmin = children[largest][i]->coordsMin();
+                        const Vector3 &cmax = bounds[children[largest][i]].max;
+                        const Vector3 &cmin = bounds[children[largest][i]].min;
 
                         //Check if we need to increase the bounds of the right side after inserting the object
                         for (int j = 0; j < 3; j++)
@@ -281,7 +558,7 @@ BVH::build(Objects * objs, int depth)
                 //The large side must be rechecked for boundaries because it might have shrunk
                 if (canShrink)
                 {
-                    getCornerPoints(corners[largest], &children[largest]);
+                    getCornerPoints(corners[largest], &children[largest], bounds);
                 }
             }
 
@@ -303,136 +580,514 @@ BVH::build(Objects * objs, int depth)
 
         }    
 
-        //Add child nodes
-        m_children = new vector<BVH*>;
-        Objects* left, * right;
-        left = new Objects; right = new Objects;
+        //Try a spatial split if the children of the object split overlap,
+        //while the budget for references lasts
+        bool spatialSplit = false;
+        if (data.bounds.size() < data.maxReferences &&
+            getOverlapArea(bestCorners[0], bestCorners[1]) > SPATIAL_SPLIT_ALPHA*data.rootArea)
+        {
+            int dim; float position;
+            float cost = findSpatialSplit(m_corners, objs, data, SPATIAL_SPLIT_BINS, dim, position);
+            if (cost < bestCost)
+            {
+                spatialSplit = true;
+                bestCost = cost;
+                bestDim = dim;
+                bestPosition = position;
+            }
+        }
+
+        PrimitiveList* left, * right;
+        left = new PrimitiveList; right = new PrimitiveList;
 
 
 		//Split the object array according to the best splitting plane we found
-        for (int i = 0; i < objs->size(); i++)
+        if (spatialSplit)
         {
-            if ((*objs)[i]->center()[bestDim] < bestPosition)
-                left->push_back((*objs)[i]);
-            else
-                right->push_back((*objs)[i]);
+#ifdef STATS
+            Stats::BVH_SpatialSplits++;
+#endif
+            splitReferences(objs, data, bestDim, bestPosition, left, right);
+
+            //Bound the clipped references of the children
+            Corner corners[2];
+            for (int i = 0; i < 2; i++)
+            {
+                getCornerPoints(corners, i == 0 ? left : right, bounds);
+                bestCorners[i][0] = Vector3(corners[0][0], corners[0][1], corners[0][2]);
+                bestCorners[i][1] = Vector3(corners[1][0], corners[1][1], corners[1][2]);
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < objs->size(); i++)
+            {
+                if (bounds[(*objs)[i]].center[bestDim] < bestPosition)
+                    left->push_back((*objs)[i]);
+                else
+                    right->push_back((*objs)[i]);
+            }
+        }
+
+        //Objects with the same center can't be separated, splitting further would
+        //only add empty nodes down to MAX_TREE_DEPTH
+        if (left->empty() || right->empty() ||
+            (left->size() == objs->size() && right->size() == objs->size()))
+        {
+            delete left;
+            delete right;
+            makeLeaf(objs, data);
+            return;
         }
 
+        //Add child nodes
+        m_children = new vector<BVH*>;
+
         for (int i = 0; i < 2; i++)
         {
-            Objects* current = (i == 0 ? left : right);
+            PrimitiveList* current = (i == 0 ? left : right);
             m_children->push_back(new BVH);
             for (int j = 0; j < 3; j++)
             {
                 m_children->back()->m_corners[0][j] = bestCorners[i][0][j];
                 m_children->back()->m_corners[1][j] = bestCorners[i][1][j];
             }
-            (*m_children)[i]->build(current, depth+1);
+            (*m_children)[i]->build(current, data, depth+1);
 
-            // If the new node is an internal one, free the object list since it wasn't used.
-            if (!(*m_children)[i]->m_isLeaf) 
+            // The leaves copy their primitives, so the list is not needed anymore.
+            delete current;
+        }
+
+        m_buildOverlap = getOverlap();
+    }
+}
+
+//Makes the node a leaf with the references objs
+void
+BVH::makeLeaf(PrimitiveList * objs, BVHBuildData & data)
+{
+    const Primitives &primitives = data.primitives;
+    const std::vector<PrimitiveBounds> &bounds = data.bounds;
+    m_isLeaf = true;
+
+#ifdef STATS
+    Stats::BVH_LeafNodes++;
+    Stats::BVH_References += objs->size();
+#endif 
+
+    //Put the triangles into packets at the end of the packet array,
+    //only the other objects are kept in the primitive list.
+    std::vector<TrianglePacket> &packets = *data.packets;
+    m_primitives = 0;
+    m_firstPacket = packets.size();
+    m_nPackets = 0;
+    for (size_t i = 0; i < objs->size(); i++)
+    {
+        const BVHPrimitive &p = primitives[bounds[(*objs)[i]].primitive];
+        if (p.mesh == 0)
+        {
+            if (m_primitives == 0) m_primitives = new Primitives;
+            m_primitives->push_back(p);
+            continue;
+        }
+
+        if (m_nPackets == 0 || packets.back().nTriangles == 4)
+        {
+            packets.push_back(TrianglePacket());
+            m_nPackets++;
+        }
+        addToPacket(packets.back(), p);
+    }
+}
+
+//Area of the box, 0 for the empty box of a leaf without primitives
+float
+BVH::getBoxArea() const
+{
+    if (m_corners[0][0] > m_corners[1][0]) return 0;
+    return getArea(m_corners);
+}
+
+//Sum of the areas of the children relative to the area of the node. It grows
+//when the children overlap more, which is how refitted trees degrade.
+float
+BVH::getOverlap() const
+{
+    float area = getBoxArea();
+    if (area == 0) return 0;
+    return ((*m_children)[0]->getBoxArea() + (*m_children)[1]->getBoxArea()) / area;
+}
+
+int
+BVH::refit()
+{
+    std::vector<TrianglePacket> &packets = *m_packets;
+    refitBounds(packets);
+    int rebuilt = rebuildDegraded(packets, 0);
+
+    //Rebuilt subtrees put their packets at the end of the array, and the old
+    //ones are left unused. Compact the array when they are the majority.
+    if (rebuilt > 0 && packets.size() > 2*(size_t)countPackets())
+        compactPackets();
+
+    return rebuilt;
+}
+
+void
+BVH::refitBounds(std::vector<TrianglePacket> & packets)
+{
+    if (!m_isLeaf)
+    {
+        //The children are already expanded by epsilon, so their union is the box
+        BVH *children[2] = {(*m_children)[0], (*m_children)[1]};
+        children[0]->refitBounds(packets);
+        children[1]->refitBounds(packets);
+        for (int i = 0; i < 3; i++)
+        {
+            m_corners[0][i] = std::min(children[0]->m_corners[0][i], children[1]->m_corners[0][i]);
+            m_corners[1][i] = std::max(children[0]->m_corners[1][i], children[1]->m_corners[1][i]);
+        }
+        return;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        m_corners[0][i] = infinity;
+        m_corners[1][i] = -infinity;
+    }
+
+    //Copy the moved vertices into the packets and bound them
+    for (int p = m_firstPacket; p < m_firstPacket+m_nPackets; p++)
+    {
+        TrianglePacket &packet = packets[p];
+        for (int t = 0; t < packet.nTriangles; t++)
+        {
+            setPacketVertices(packet, t);
+            for (int i = 0; i < 3; i++)
+            {
+                m_corners[0][i] = std::min(m_corners[0][i], std::min(packet.A[i][t], std::min(packet.B[i][t], packet.C[i][t])));
+                m_corners[1][i] = std::max(m_corners[1][i], std::max(packet.A[i][t], std::max(packet.B[i][t], packet.C[i][t])));
+            }
+        }
+    }
+
+    if (m_primitives != 0)
+    {
+        for (size_t p = 0; p < m_primitives->size(); p++)
+        {
+            const BVHPrimitive &prim = (*m_primitives)[p];
+            if (!prim.isBounded()) continue;
+            Vector3 objMin = prim.coordsMin(), objMax = prim.coordsMax();
+            for (int i = 0; i < 3; i++)
             {
-                delete current;
-           }
+                m_corners[0][i] = std::min(m_corners[0][i], objMin[i]);
+                m_corners[1][i] = std::max(m_corners[1][i], objMax[i]);
+            }
         }
     }
+
+    //Expanded like in build
+    for (int i = 0; i < 3; i++)
+    {
+        m_corners[0][i] -= epsilon;
+        m_corners[1][i] += epsilon;
+    }
+}
+
+inline bool lessPrimitive(const BVHPrimitive &a, const BVHPrimitive &b)
+{
+    if (a.object != b.object) return a.object < b.object;
+    if (a.mesh != b.mesh) return a.mesh < b.mesh;
+    return a.index < b.index;
+}
+
+inline bool equalPrimitive(const BVHPrimitive &a, const BVHPrimitive &b)
+{
+    return a.object == b.object && a.mesh == b.mesh && a.index == b.index;
+}
+
+int
+BVH::rebuildDegraded(std::vector<TrianglePacket> & packets, int depth)
+{
+    if (m_isLeaf) return 0;
+
+    if (getOverlap() <= m_buildOverlap*REBUILD_OVERLAP_GROWTH)
+        return (*m_children)[0]->rebuildDegraded(packets, depth+1) +
+               (*m_children)[1]->rebuildDegraded(packets, depth+1);
+
+    //Build this subtree again from the primitives in its leaves. After
+    //spatial splits a primitive can be in several leaves, and the new
+    //subtree only uses object splits, so it needs each of them just once.
+    BVHBuildData data;
+    getPrimitives(data.primitives, packets);
+    std::sort(data.primitives.begin(), data.primitives.end(), lessPrimitive);
+    data.primitives.erase(std::unique(data.primitives.begin(), data.primitives.end(), equalPrimitive), data.primitives.end());
+    data.packets = &packets;
+    PrimitiveList * prims = getPrimitiveBounds(data);
+
+    clear();
+    m_corners[0][0] = infinity;
+    build(prims, data, depth);
+
+    delete prims;
+    return 1;
+}
+
+void
+BVH::getPrimitives(Primitives & out, const std::vector<TrianglePacket> & packets) const
+{
+    if (!m_isLeaf)
+    {
+        (*m_children)[0]->getPrimitives(out, packets);
+        (*m_children)[1]->getPrimitives(out, packets);
+        return;
+    }
+
+    for (int p = m_firstPacket; p < m_firstPacket+m_nPackets; p++)
+    {
+        const TrianglePacket &packet = packets[p];
+        for (int t = 0; t < packet.nTriangles; t++)
+        {
+            BVHPrimitive prim = {packet.objects[t], packet.meshes[t], packet.indices[t]};
+            out.push_back(prim);
+        }
+    }
+
+    if (m_primitives != 0)
+        out.insert(out.end(), m_primitives->begin(), m_primitives->end());
+}
+
+//Deletes the children or the primitives of the node
+void
+BVH::clear()
+{
+    if (m_isLeaf)
+    {
+        delete m_primitives;
+    }
+    else
+    {
+        for (size_t i = 0; i < m_children->size(); i++)
+        {
+            (*m_children)[i]->clear();
+            delete (*m_children)[i];
+        }
+        delete m_children;
+    }
+    m_primitives = 0;
+}
+
+int
+BVH::countPackets() const
+{
+    if (m_isLeaf) return m_nPackets;
+    return (*m_children)[0]->countPackets() + (*m_children)[1]->countPackets();
+}
+
+//Replaces the packet array by the packets of the leaves in leaf order
+void
+BVH::compactPackets()
+{
+    std::vector<TrianglePacket> *compacted = new std::vector<TrianglePacket>;
+    compacted->reserve(countPackets());
+    compactPackets(*compacted, *m_packets);
+    delete m_packets;
+    m_packets = compacted;
+}
+
+//Copies the packets of the leaves to out in leaf order
+void
+BVH::compactPackets(std::vector<TrianglePacket> & out, const std::vector<TrianglePacket> & packets)
+{
+    if (!m_isLeaf)
+    {
+        (*m_children)[0]->compactPackets(out, packets);
+        (*m_children)[1]->compactPackets(out, packets);
+        return;
+    }
+
+    int first = out.size();
+    out.insert(out.end(), packets.begin()+m_firstPacket, packets.begin()+m_firstPacket+m_nPackets);
+    m_firstPacket = first;
+}
+
+BVHTraversal::BVHTraversal(const Ray& ray, const TrianglePacket * packets) : packets(packets)
+{
+    //z is the axis the ray direction is largest along
+    kz = 0;
+    for (int i = 1; i < 3; i++)
+        if (fabs(ray.d[i]) > fabs(ray.d[kz])) kz = i;
+    kx = (kz+1)%3;
+    ky = (kx+1)%3;
+
+    //Swap x and y for negative directions, which keeps the winding of the triangles
+    if (ray.d[kz] < 0) std::swap(kx, ky);
+
+    Sx = ray.d[kx]/ray.d[kz];
+    Sy = ray.d[ky]/ray.d[kz];
+    Sz = 1.0f/ray.d[kz];
+    o[0] = ray.o[kx];
+    o[1] = ray.o[ky];
+    o[2] = ray.o[kz];
+
+#ifdef __SSE4_1__
+    Sx_SSE = _mm_set1_ps(Sx);
+    Sy_SSE = _mm_set1_ps(Sy);
+    Sz_SSE = _mm_set1_ps(Sz);
+    for (int i = 0; i < 3; i++)
+        o_SSE[i] = _mm_set1_ps(o[i]);
+#endif
 }
 
 #ifdef __SSE4_1__
-    int SSEintersectTriangles(SSETriangleCache &cache, HitInfo& hitInfo, const Ray &ray, float tMin, float tMax)
+    //Finds the closest triangle of a packet that the ray hits between tMin and tMax.
+    //Returns its index in the packet, or -1 if none is hit.
+    //The test is watertight: a ray through an edge (or vertex) shared by two
+    //triangles of the same mesh always hits at least one of them.
+    int SSEintersectTriangles(const TrianglePacket &packet, const BVHTraversal &r, float tMin, float tMax, float &outT, float &outBeta, float &outGamma)
     {
-        //Define some constants that are used throughout.
-        static const __m128 _one = _mm_set1_ps(1.0f);
         static const __m128 _zero = _mm_setzero_ps();
-        static const __m128 _minus_epsilon = _mm_set1_ps(-epsilon);
-        static const __m128 _one_plus_epsilon = _mm_set1_ps(1.0f+epsilon);
-        float outT[4], outP[3][4], outN[3][4];
+        float ts[4], betas[4], gammas[4];
 
-        //Each __m128 contains the coordinates for 4 triangles and there is 3 dimensions.
-        //const SSEVectorTuple3 &rayD = ray.d_SSE, &rayO = ray.o_SSE;
-        SSEVectorTuple3 RomA;
-        const __m128 &rayD = ray.d_SSE, &rayO = ray.o_SSE;
+        //Vertices relative to the ray origin, in the permuted axes
+        SSEVectorTuple3 A, B, C;
+        const int axes[3] = {r.kx, r.ky, r.kz};
 
-        //Calculate ray.o - A, as this is used to calculate both t, beta and gamma.
         #pragma unroll(3)
         for (int i = 0; i < 3; i++)
         {
-            RomA.v[i] = _mm_sub_ps(_mm_shuffle_ps(rayO, rayO, _MM_SHUFFLE(i,i,i,i)), cache.A.v[i]);
+            A.v[i] = _mm_sub_ps(_mm_loadu_ps(packet.A[axes[i]]), r.o_SSE[i]);
+            B.v[i] = _mm_sub_ps(_mm_loadu_ps(packet.B[axes[i]]), r.o_SSE[i]);
+            C.v[i] = _mm_sub_ps(_mm_loadu_ps(packet.C[axes[i]]), r.o_SSE[i]);
         }
 
-        __m128 ddotn, t, beta, gamma, alpha;
-        
-        //Only going to use the reciprocal
-        ddotn = _mm_rcp_ps(SSEmultiDot13(rayD, cache.normal));
+        //Shear x and y, so that the ray is the z axis
+        __m128 Ax = _mm_sub_ps(A.v[0], _mm_mul_ps(r.Sx_SSE, A.v[2])),
+               Ay = _mm_sub_ps(A.v[1], _mm_mul_ps(r.Sy_SSE, A.v[2])),
+               Bx = _mm_sub_ps(B.v[0], _mm_mul_ps(r.Sx_SSE, B.v[2])),
+               By = _mm_sub_ps(B.v[1], _mm_mul_ps(r.Sy_SSE, B.v[2])),
+               Cx = _mm_sub_ps(C.v[0], _mm_mul_ps(r.Sx_SSE, C.v[2])),
+               Cy = _mm_sub_ps(C.v[1], _mm_mul_ps(r.Sy_SSE, C.v[2]));
+
+        //Scaled barycentric coordinates from the 2D edge functions
+        __m128 U = _mm_sub_ps(_mm_mul_ps(Cx, By), _mm_mul_ps(Cy, Bx)),
+               V = _mm_sub_ps(_mm_mul_ps(Ax, Cy), _mm_mul_ps(Ay, Cx)),
+               W = _mm_sub_ps(_mm_mul_ps(Bx, Ay), _mm_mul_ps(By, Ax));
 
-        //Calculate t, beta and gamma
-        t = _mm_mul_ps(SSEmultiDot33(RomA, cache.normal), ddotn); 
-        beta = _mm_mul_ps(SSEmultiDot13(rayD, SSEmultiCross(RomA, cache.CmA)), ddotn); 
-        gamma = _mm_mul_ps(SSEmultiDot13(rayD, SSEmultiCross(cache.BmA, RomA)), ddotn); 
+        //The ray is inside if all three have the same sign. Zero counts as
+        //both, so a ray through an edge is inside both triangles of the edge.
+        __m128 inside = _mm_or_ps(_mm_and_ps(_mm_cmpge_ps(U, _zero), _mm_and_ps(_mm_cmpge_ps(V, _zero), _mm_cmpge_ps(W, _zero))),
+                                  _mm_and_ps(_mm_cmple_ps(U, _zero), _mm_and_ps(_mm_cmple_ps(V, _zero), _mm_cmple_ps(W, _zero))));
 
-        //Test t, beta and gamma
-        int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(beta, _minus_epsilon),
-                              _mm_and_ps(_mm_cmpgt_ps(gamma, _minus_epsilon),
-                                         _mm_and_ps(_mm_cmplt_ps(_mm_add_ps(gamma, beta), _one_plus_epsilon),
-                                                    _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(tMin)), _mm_cmplt_ps(t, _mm_set1_ps(tMax)))))));
+        __m128 det = _mm_add_ps(U, _mm_add_ps(V, W));
+        inside = _mm_and_ps(inside, _mm_cmpneq_ps(det, _zero));
+        if (_mm_movemask_ps(inside) == 0) return -1;
+
+        //Hit distance, from the interpolated z of the sheared vertices
+        __m128 T = _mm_mul_ps(r.Sz_SSE, _mm_add_ps(_mm_mul_ps(U, A.v[2]), _mm_add_ps(_mm_mul_ps(V, B.v[2]), _mm_mul_ps(W, C.v[2]))));
+        __m128 rcpDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        __m128 t = _mm_mul_ps(T, rcpDet);
+
+        int mask = _mm_movemask_ps(_mm_and_ps(inside, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(tMin)), _mm_cmplt_ps(t, _mm_set1_ps(tMax)))));
 
         if (mask == 0) return -1;
         
-        _mm_storeu_ps(outT, t);
+        _mm_storeu_ps(ts, t);
 
         //Find the lowest t > tMin
         int best = -1;
-        for (int i = 0; i < cache.nTriangles; i++)
+        for (int i = 0; i < packet.nTriangles; i++)
         {
             if ((mask & (1 << i)) == 0)
                 continue;
 
-            if (best == -1 || outT[i] < outT[best]) best = i;
+            if (best == -1 || ts[i] < ts[best]) best = i;
         }
 
         if (best == -1) return -1;
 
+        _mm_storeu_ps(betas, _mm_mul_ps(V, rcpDet));
+        _mm_storeu_ps(gammas, _mm_mul_ps(W, rcpDet));
 
-        alpha = _mm_sub_ps(_mm_sub_ps(_one, beta), gamma);
+        outT = ts[best];
+        outBeta = betas[best];
+        outGamma = gammas[best];
 
-        #pragma unroll(3)
-        for (int i = 0; i < 3; i++)
+        return best;
+    }
+#else
+    //Finds the closest triangle of a packet that the ray hits between tMin and tMax.
+    //Returns its index in the packet, or -1 if none is hit.
+    //Same watertight test as the SSE version, one triangle at a time.
+    int intersectTriangles(const TrianglePacket &packet, const BVHTraversal &r, float tMin, float tMax, float &outT, float &outBeta, float &outGamma)
+    {
+        int best = -1;
+        for (int i = 0; i < packet.nTriangles; i++)
         {
-            //Any way to improve this, as we only need 1/3rd of the values?
-            _mm_storeu_ps(outP[i], _mm_add_ps(cache.A.v[i], _mm_add_ps(_mm_mul_ps(beta, cache.BmA.v[i]), _mm_mul_ps(gamma, cache.CmA.v[i]))));
-            _mm_storeu_ps(outN[i], _mm_add_ps(_mm_mul_ps(alpha, cache.nA.v[i]), _mm_add_ps(_mm_mul_ps(beta, cache.nB.v[i]), _mm_mul_ps(gamma, cache.nC.v[i]))));
+            //Vertices relative to the ray origin, in the permuted axes
+            float Az = packet.A[r.kz][i] - r.o[2],
+                  Bz = packet.B[r.kz][i] - r.o[2],
+                  Cz = packet.C[r.kz][i] - r.o[2];
+
+            //Shear x and y, so that the ray is the z axis
+            float Ax = packet.A[r.kx][i] - r.o[0] - r.Sx*Az,
+                  Ay = packet.A[r.ky][i] - r.o[1] - r.Sy*Az,
+                  Bx = packet.B[r.kx][i] - r.o[0] - r.Sx*Bz,
+                  By = packet.B[r.ky][i] - r.o[1] - r.Sy*Bz,
+                  Cx = packet.C[r.kx][i] - r.o[0] - r.Sx*Cz,
+                  Cy = packet.C[r.ky][i] - r.o[1] - r.Sy*Cz;
+
+            //Scaled barycentric coordinates from the 2D edge functions
+            float U = Cx*By - Cy*Bx,
+                  V = Ax*Cy - Ay*Cx,
+                  W = Bx*Ay - By*Ax;
+            if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) continue;
+
+            float det = U + V + W;
+            if (det == 0) continue;
+
+            float t = r.Sz*(U*Az + V*Bz + W*Cz) / det;
+            if (!(t > tMin && t < tMax)) continue;
+
+            best = i;
+            tMax = outT = t;
+            outBeta = V / det;
+            outGamma = W / det;
         }
 
-        hitInfo.t = outT[best];
-
-        hitInfo.P = Vector3(outP[0][best], outP[1][best], outP[2][best]);
-        hitInfo.N = Vector3(outN[0][best], outN[1][best], outN[2][best]);
-
         return best;
     }
+#endif
 
-    inline bool intersectTriangleList(SSETriangleCache &cache, HitInfo& minHit, const Ray& ray, float tMin)
+    //Intersects the triangles of a packet, and updates minHit if one of them is closer
+    inline bool intersectPacket(const TrianglePacket &packet, HitInfo& minHit, const BVHTraversal& traversal, float tMin)
     {
-        HitInfo tempMinHit;
-
-        int best = SSEintersectTriangles(cache, tempMinHit, ray, tMin, minHit.t);
-        if (best != -1)
-        {       
-            if (tempMinHit.t < minHit.t)
-            {
-                minHit = tempMinHit;
-
-                //Just call intersect to get the material
-                cache.triangles[best]->intersect(minHit, ray, tMin, minHit.t);
-                 
-                //Update object reference
-                minHit.object = cache.triangles[best];
-            }
-            return true;
-        }
-        return false;
-    }
+        float t, beta, gamma;
+#ifdef __SSE4_1__
+        int best = SSEintersectTriangles(packet, traversal, tMin, minHit.t, t, beta, gamma);
+#else
+        int best = intersectTriangles(packet, traversal, tMin, minHit.t, t, beta, gamma);
+#endif
+#ifdef STATS
+        Stats::Ray_Tri_Intersect += packet.nTriangles;
 #endif
+        if (best == -1) return false;
+
+        float alpha = 1.0f - beta - gamma;
+        minHit.t = t;
+        minHit.P = Vector3(alpha*packet.A[0][best] + beta*packet.B[0][best] + gamma*packet.C[0][best],
+                           alpha*packet.A[1][best] + beta*packet.B[1][best] + gamma*packet.C[1][best],
+                           alpha*packet.A[2][best] + beta*packet.B[2][best] + gamma*packet.C[2][best]);
+        minHit.N = packet.meshes[best]->triangleNormal(packet.indices[best], beta, gamma);
+        minHit.Ng = Vector3(packet.N[0][best], packet.N[1][best], packet.N[2][best]);
+
+        //Update object reference
+        minHit.object = packet.objects[best];
+        minHit.material = minHit.object->getMaterial();
+        minHit.primitive = packet.indices[best];
+
+        return true;
+    }
 
 //Intersect the root node
 bool
@@ -465,11 +1120,12 @@ BVH::intersect(HitInfo& minHit, const Ray& ray, float tMin, float tMax) const
     if (minOverlap > maxOverlap || minOverlap > tMax || maxOverlap < tMin)
         return false;
 
-    return intersectChildren(minHit, ray, tMin, tMax);
+    BVHTraversal traversal(ray, m_packets->empty() ? 0 : &(*m_packets)[0]);
+    return intersectChildren(minHit, ray, tMin, tMax, traversal);
 }
 
 bool
-BVH::intersectChildren(HitInfo& minHit, const Ray& ray, float tMin, float tMax) const
+BVH::intersectChildren(HitInfo& minHit, const Ray& ray, float tMin, float tMax, const BVHTraversal & traversal) const
 {
     // Traverse the BVH to perform ray-intersection acceleration.
     bool hit = false;
@@ -477,25 +1133,19 @@ BVH::intersectChildren(HitInfo& minHit, const Ray& ray, float tMin, float tMax)
     minHit.t = tMax;
     if (m_isLeaf)
     {
-        //For SSE, we have already put a lot of stuff in our cache datastructure, so just call the triangle list intersection        
-#ifdef __SSE4_1__
-        for (int i = 0; i < m_triangleCache->size(); i++)
+        //The triangles are already in packets, so just test those
+        for (int i = 0; i < m_nPackets; i++)
         {
-            if (intersectTriangleList((*m_triangleCache)[i], minHit, ray, tMin))
+            if (intersectPacket(traversal.packets[m_firstPacket+i], minHit, traversal, tMin))
                 hit = true;
-#ifdef STATS
-            Stats::Ray_Tri_Intersect += m_triangleCache->at(i).nTriangles;
-#endif
-
         }
-#endif
 
-        for (size_t i = 0; i < m_objects->size(); ++i)
+        if (m_primitives == 0) return hit;
+
+        for (size_t i = 0; i < m_primitives->size(); ++i)
         {
-#ifdef STATS
-            if (dynamic_cast<Triangle*>((*m_objects)[i]) != 0) Stats::Ray_Tri_Intersect++;
-#endif
-            if ((*m_objects)[i]->intersect(tempMinHit, ray, tMin, minHit.t))
+            Object *object = (*m_primitives)[i].object;
+            if (object->intersect(tempMinHit, ray, tMin, minHit.t))
             {
                 if (tempMinHit.t < minHit.t)
                 {
@@ -503,7 +1153,7 @@ BVH::intersectChildren(HitInfo& minHit, const Ray& ray, float tMin, float tMax)
                     minHit = tempMinHit;
 
                     //Update object reference
-                    minHit.object = (*m_objects)[i];
+                    minHit.object = object;
                 }
             }
         }
@@ -513,6 +1163,10 @@ BVH::intersectChildren(HitInfo& minHit, const Ray& ray, float tMin, float tMax)
 #ifdef __SSE4_1__
     BVH* children[2] = {m_children->at(0), m_children->at(1)};
 
+#ifdef STATS
+    Stats::Ray_Box_Intersect += 2;
+#endif
+
     //Calculate all the intersection times
     __m128 t[4] = {_mm_mul_ps(_mm_sub_ps(children[0]->m_corners_SSE[0], ray.o_SSE), ray.d_SSE_rcp),
                    _mm_mul_ps(_mm_sub_ps(children[0]->m_corners_SSE[1], ray.o_SSE), ray.d_SSE_rcp),
@@ -565,7 +1219,7 @@ BVH::intersectChildren(HitInfo& minHit, const Ray& ray, float tMin, float tMax)
     if (!(out[ind+1] > out[ind] || out[ind+1] > minHit.t || out[ind] < tMin))
     {
         //Intersect with child.
-        if (children[1 - (ind >> 1)]->intersectChildren(tempMinHit, ray, tMin, minHit.t))
+        if (children[1 - (ind >> 1)]->intersectChildren(tempMinHit, ray, tMin, minHit.t, traversal))
         {
             minHit = tempMinHit;
             hit = true;
@@ -576,7 +1230,7 @@ BVH::intersectChildren(HitInfo& minHit, const Ray& ray, float tMin, float tMax)
     ind = (ind + 2) & 3;
     if (!(out[ind+1] > out[ind] || out[ind+1] > minHit.t || out[ind] < tMin))
     {
-        if (children[1 - (ind >> 1)]->intersectChildren(tempMinHit, ray, tMin, minHit.t))
+        if (children[1 - (ind >> 1)]->intersectChildren(tempMinHit, ray, tMin, minHit.t, traversal))
         {
             minHit = tempMinHit;
             hit = true;
@@ -631,7 +1285,7 @@ BVH::intersectChildren(HitInfo& minHit, const Ray& ray, float tMin, float tMax)
 #ifdef STATS
     Stats::Ray_Box_Intersect += 1;
 #endif
-    if (m_children->at(minIndex)->intersectChildren(tempMinHit, ray, tMin, minHit.t))
+    if (m_children->at(minIndex)->intersectChildren(tempMinHit, ray, tMin, minHit.t, traversal))
     {
         minHit = tempMinHit;
         hit = true;
@@ -642,8 +1296,8 @@ BVH::intersectChildren(HitInfo& minHit, const Ray& ray, float tMin, float tMax)
 #ifdef STATS
         Stats::Ray_Box_Intersect += 1;
 #endif
-        //if (m_children->at(minIndex^1)->intersectChildren(tempMinHit, ray, tMin, minHit.t))
-        if (m_children->at(minIndex^1)->intersectChildren(tempMinHit, ray, tMin, minHit.t))
+        //if (m_children->at(minIndex^1)->intersectChildren(tempMinHit, ray, tMin, minHit.t, traversal))
+        if (m_children->at(minIndex^1)->intersectChildren(tempMinHit, ray, tMin, minHit.t, traversal))
         {
             minHit = tempMinHit;
             hit = true;
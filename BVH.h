@@ -2,45 +2,172 @@
 #define CSE168_BVH_H_INCLUDED
 
 #include <vector>
+#include <map>
+#include <string>
 #include <limits>
 #include "SSE.h"
 #include "Miro.h"
 #include "Object.h"
+#include "TriangleMesh.h"
 
 struct Component
 {
 	float Bounds[2];
 };
 
-#ifdef __SSE4_1__
-struct SSETriangleCache
+//A primitive indexed by the BVH. Triangles of meshes are referenced by
+//(mesh, triangle index) and are hit as the object they belong to,
+//everything else is a whole object intersected through its interface.
+struct BVHPrimitive
 {
-    SSETriangleCache() { nTriangles = 0; }
-    Triangle *triangles[4];
+    Object* object;
+    TriangleMesh* mesh;  //0 if the primitive is the object itself
+    unsigned int index;  //Triangle index in the mesh
+
+    Vector3 coordsMin() const { return mesh ? mesh->triangleMin(index) : object->coordsMin(); }
+    Vector3 coordsMax() const { return mesh ? mesh->triangleMax(index) : object->coordsMax(); }
+    Vector3 center() const { return mesh ? mesh->triangleCenter(index) : object->center(); }
+    bool isBounded() const { return mesh != 0 || object->isBounded(); }
+};
+
+typedef std::vector<BVHPrimitive> Primitives;
+
+//Bounds of a reference to a primitive, cached while the BVH is built so
+//that the split search does not have to look up the vertices of a triangle
+//every time. Spatial splits reference a primitive from several nodes, each
+//reference then only bounds the part of it inside its node.
+struct PrimitiveBounds
+{
+    Vector3 min, max, center;
+    unsigned int primitive;  //Index in the primitive array
+};
+
+//References of a node during the build, as indices into the bounds array
+typedef std::vector<unsigned int> PrimitiveList;
+
+//Vertices of up to four triangles of a leaf.
+//Every coordinate is stored for the four triangles next to each other
+//(A.x of all four, then A.y ...), so the SSE code can load them directly
+//and test all four at once. The scalar code loops over them.
+//The vertices are stored as they are and not as edges, so that triangles
+//sharing an edge compute exactly the same edge test for it.
+//The watertight test shears the triangles for each ray, so the vertices are
+//kept as they are. The geometric normals do not depend on the ray and are
+//computed once, for the ray origins that leave the hits.
+struct TrianglePacket
+{
+    TrianglePacket() { nTriangles = 0; }
+    float A[3][4], B[3][4], C[3][4];
+    float N[3][4];          //Unit geometric normals
+    Object *objects[4];     //Object, mesh and triangle index of each triangle
+    TriangleMesh *meshes[4];
+    unsigned int indices[4];
     int nTriangles;
-    SSEVectorTuple3 A, BmA, CmA, normal, nA, nB, nC;
 };
+
+//Data shared by all nodes while the BVH is built
+struct BVHBuildData
+{
+    BVHBuildData() { maxReferences = 0; rootArea = 0; }
+    Primitives primitives;
+    std::vector<PrimitiveBounds> bounds;
+    std::vector<TrianglePacket> * packets;
+    size_t maxReferences;    //Spatial splits stop when there are this many references, 0 without them
+    float rootArea;
+};
+
+//Per ray data of the watertight triangle test (Woop et al. 2013), set up
+//once at the root. The coordinates are permuted so that the ray direction is
+//largest along z, and the triangles are sheared so that the ray becomes the
+//+z axis through the origin. The edge tests are then 2D and exact in sign.
+struct BVHTraversal
+{
+    BVHTraversal(const Ray& ray, const TrianglePacket * packets);
+
+    const TrianglePacket * packets;
+    int kx, ky, kz;        //Permuted axes
+    float Sx, Sy, Sz;      //Shear constants
+    float o[3];            //Ray origin in the permuted axes
+#ifdef __SSE4_1__
+    __m128 Sx_SSE, Sy_SSE, Sz_SSE, o_SSE[3];
 #endif
+};
 
 typedef float Corner[4];
 
 
+struct BVHFileNode;
+struct MortonPrimitive;
+
 //Represents a node in the bounding volume hierarchy
 class BVH
 {
 public:
-    BVH() { m_corners[0][0] = infinity; } 
-    void build(Objects * objs, int depth = 0);
+    BVH() { m_corners[0][0] = infinity; m_packets = 0; m_spatialSplits = false; m_cacheFile = 0; m_builder = SAH_BUILDER; } 
+    void build(Objects * objs);
+
+    //How build() makes the tree
+    enum Builder
+    {
+        SAH_BUILDER,            //Searches the split with the lowest cost in every node
+        LINEAR_BUILDER,         //LBVH: sorts the primitives along a Morton curve and splits
+                                //where the codes differ (Karras 2012). Much faster, worse trees.
+        LINEAR_TREELET_BUILDER  //LBVH, then every treelet of up to TREELET_SIZE leaves gets the
+                                //topology with the lowest cost (Karras and Aila 2013)
+    };
+    void setBuilder(Builder builder) { m_builder = builder; }
+    Builder builder() const { return m_builder; }
+
+    //Lets build() also split nodes in space like the SBVH (Stich et al. 2009),
+    //which puts a triangle that straddles the split into both children.
+    //It pays off for big triangles that overlap many others, like the walls
+    //of a room. Only for the root, and only with the SAH builder.
+    void setSpatialSplits(bool enable) { m_spatialSplits = enable; }
+    bool spatialSplits() const { return m_spatialSplits; }
+
+    //build() loads the tree from this file if it was saved there for the
+    //same geometry, and saves it there otherwise. For static scenes that
+    //are loaded again on every run. Only for the root.
+    void setCacheFile(const std::string& file);
 
     bool intersect(HitInfo& result, const Ray& ray,
                    float tMin = 0.0f, float tMax = MIRO_TMAX) const;
-    bool intersectChildren(HitInfo& result, const Ray& ray,
-                   float tMin, float tMax) const;
+
+    //Updates the boxes bottom-up after objects or mesh vertices moved, and
+    //builds the subtrees again whose children overlap too much more than
+    //when they were built. The objects must have been precalced again, and
+    //none may have been added or removed. Only for the root.
+    //Refitted leaves bound their whole triangles, so subtrees with spatial
+    //splits usually get rebuilt, without them, on the first refit.
+    //Returns the number of subtrees that were rebuilt.
+    int refit();
 protected:
+    void build(PrimitiveList * prims, BVHBuildData & data, int depth);
+    void buildLinear(BVHBuildData & data);
+    void buildLinear(const MortonPrimitive * sorted, int begin, int end, int bit, BVHBuildData & data, int depth);
+    float restructureTreelets(std::map<const BVH*, float> & costs, const std::vector<TrianglePacket> & packets);
+    void makeLeaf(PrimitiveList * objs, BVHBuildData & data);
+    void compactPackets();
+    void refitBounds(std::vector<TrianglePacket> & packets);
+    int rebuildDegraded(std::vector<TrianglePacket> & packets, int depth);
+    void getPrimitives(Primitives & out, const std::vector<TrianglePacket> & packets) const;
+    void compactPackets(std::vector<TrianglePacket> & out, const std::vector<TrianglePacket> & packets);
+    int countPackets() const;
+    void clear();
+    float getBoxArea() const;
+    float getOverlap() const;
+    unsigned long long geometryHash(const Objects & objs) const;
+    bool loadCache(const char* file, unsigned long long hash, Objects * objs);
+    bool saveCache(const char* file, unsigned long long hash, Objects * objs) const;
+    void flatten(std::vector<BVHFileNode> & nodes, std::vector<int> & primitives, const std::map<Object*, int> & objectIndices) const;
+    void unflatten(const BVHFileNode * nodes, int index, const int * primitives, Objects * objs);
+    bool intersectChildren(HitInfo& result, const Ray& ray,
+                   float tMin, float tMax, const BVHTraversal & traversal) const;
+
     union
     {
         std::vector<BVH*> * m_children; //Child nodes of this BVH, which are also BVHs. Only applicable for inner nodes.
-        Objects * m_objects;          //Objects contained in the BVH. Only applicable for child nodes. 
+        Primitives * m_primitives;    //Primitives other than triangles contained in the BVH, 0 if there are none. Only applicable for child nodes. 
     };
 
     union
@@ -52,9 +179,34 @@ protected:
     };
 
     bool m_isLeaf;
+
+    //The triangles of a leaf are the m_nPackets packets starting at m_firstPacket
+    //in the packet array of the tree. Only the root has the array.
+    int m_firstPacket, m_nPackets;
+    std::vector<TrianglePacket> * m_packets;
+
+    //getOverlap() when the node was built. A refit node whose overlap grew
+    //by more than REBUILD_OVERLAP_GROWTH is built again.
+    float m_buildOverlap;
+    static const float REBUILD_OVERLAP_GROWTH;
+
+    bool m_spatialSplits;
+    //At most this fraction of the primitives is referenced a second time
+    static const float SPATIAL_SPLIT_BUDGET;
+    //Spatial splits are only tried in nodes whose best object split has
+    //children overlapping by more than this fraction of the root area
+    static const float SPATIAL_SPLIT_ALPHA;
+    static const int SPATIAL_SPLIT_BINS = 16;
+
+    std::string * m_cacheFile;
+
+    Builder m_builder;
+    static const int TREELET_SIZE = 7;
+    //Cost of a ray-box test relative to a ray-triangle test, for the treelets
+    static const float TRAVERSAL_COST;
+
     static const int MAX_TREE_DEPTH = 32;
     #ifdef __SSE4_1__
-    std::vector<SSETriangleCache> * m_triangleCache;
     //For SSE, it is beneficial to have more objects in each leaf. There's a sweet spot between having too many leaf objects, and having enough leaf objects so that we don't have too many half-empty vectors.
     static const int OBJECTS_PER_LEAF = 8;     
     #else
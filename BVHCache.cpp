@@ -0,0 +1,444 @@
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include "Triangle.h"
+#include "MeshObject.h"
+#include "BVH.h"
+#include "Console.h"
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+//************************************************************************
+// BVH cache files
+//
+// A cache file holds a built BVH flattened into an array of nodes, the
+// packet array, and the objects of the packets and leaves as indices into
+// the object list, since pointers don't survive the run. It is keyed by a
+// hash of everything the build depends on: the source file of each loaded
+// mesh (or the vertices of meshes that have none), the bounds of the other
+// objects, and the builder and its options. The indices in the file are
+// checked before they are used, a damaged file is built again.
+//************************************************************************
+
+//A node of the flattened tree. Nodes are stored depth first.
+struct BVHFileNode
+{
+    float min[3], max[3];
+    int isLeaf;
+    int children[2];
+    int firstPacket, nPackets;
+    int firstPrimitive, nPrimitives;
+    float buildOverlap;
+};
+
+namespace
+{
+
+struct BVHFileHeader
+{
+    char magic[8];                    // "MIROBVH"
+    unsigned int version;
+    unsigned int sse;
+    unsigned int node_size;           // sizeof(BVHFileNode)
+    unsigned int packet_size;         // sizeof(TrianglePacket)
+    unsigned int num_nodes;
+    unsigned int num_packets;
+    unsigned int num_primitives;
+    unsigned int pad;
+    unsigned long long geometry_hash;
+    unsigned long long file_size;
+};
+
+const char bvh_magic[8] = "MIROBVH";
+const unsigned int bvh_version = 3;
+const size_t bvh_alignment = 64;
+
+#ifdef __SSE4_1__
+const unsigned int bvh_sse = 1;
+#else
+const unsigned int bvh_sse = 0;
+#endif
+
+enum BVHSection { SecNodes, SecPackets, SecPacketObjects, SecPrimitives, NumSections };
+
+inline size_t alignSection(size_t offset)
+{
+    return (offset+bvh_alignment-1) & ~(bvh_alignment-1);
+}
+
+//Offsets and sizes of the sections, returns the file size
+size_t bvhLayout(const BVHFileHeader& h, size_t offsets[NumSections], size_t sizes[NumSections])
+{
+    sizes[SecNodes] = (size_t)h.num_nodes*h.node_size;
+    sizes[SecPackets] = (size_t)h.num_packets*h.packet_size;
+    sizes[SecPacketObjects] = (size_t)h.num_packets*4*sizeof(int);
+    sizes[SecPrimitives] = (size_t)h.num_primitives*sizeof(int);
+
+    size_t offset = sizeof(BVHFileHeader);
+    for (int i = 0; i < NumSections; i++)
+    {
+        offset = alignSection(offset);
+        offsets[i] = offset;
+        offset += sizes[i];
+    }
+    return offset;
+}
+
+inline void hashBytes(unsigned long long &hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+}
+
+inline void hashVector(unsigned long long &hash, const Vector3& v)
+{
+    const float f[3] = { v.x, v.y, v.z };
+    hashBytes(hash, f, sizeof(f));
+}
+
+//The mesh of a triangle object, 0 for other objects
+TriangleMesh* getObjectMesh(Object* object)
+{
+    if (MeshObject *m = dynamic_cast<MeshObject*>(object))
+        return m->getMesh();
+    if (Triangle *t = dynamic_cast<Triangle*>(object))
+        return t->getMesh();
+    return 0;
+}
+
+//Checks that the indices of the file stay inside its sections and the
+//object list, and that the nodes form one tree
+bool validCache(const BVHFileHeader& h, const BVHFileNode* nodes, const TrianglePacket* packets,
+                const int (*packetObjects)[4], const int* primitives, const Objects& objs)
+{
+    const long long nObjects = objs.size();
+    std::vector<unsigned char> parents(h.num_nodes, 0);
+    for (unsigned int i = 0; i < h.num_nodes; i++)
+    {
+        const BVHFileNode &node = nodes[i];
+        if (node.isLeaf)
+        {
+            if (node.firstPacket < 0 || node.nPackets < 0 ||
+                (long long)node.firstPacket + node.nPackets > h.num_packets ||
+                node.firstPrimitive < 0 || node.nPrimitives < 0 ||
+                (long long)node.firstPrimitive + node.nPrimitives > h.num_primitives)
+                return false;
+            continue;
+        }
+        //Children come after their parent, so following them ends
+        for (int k = 0; k < 2; k++)
+        {
+            const int child = node.children[k];
+            if (child <= (int)i || child >= (long long)h.num_nodes || parents[child]++ != 0)
+                return false;
+        }
+    }
+    for (unsigned int i = 1; i < h.num_nodes; i++)
+        if (parents[i] != 1)
+            return false;
+
+    for (unsigned int p = 0; p < h.num_packets; p++)
+    {
+        const TrianglePacket &packet = packets[p];
+        if (packet.nTriangles < 1 || packet.nTriangles > 4)
+            return false;
+        for (int t = 0; t < packet.nTriangles; t++)
+        {
+            const int object = packetObjects[p][t];
+            if (object < 0 || object >= nObjects)
+                return false;
+            TriangleMesh *mesh = getObjectMesh(objs[object]);
+            if (!mesh || packet.indices[t] >= (unsigned int)mesh->numTris())
+                return false;
+        }
+    }
+
+    for (unsigned int i = 0; i < h.num_primitives; i++)
+        if (primitives[i] < 0 || primitives[i] >= nObjects)
+            return false;
+    return true;
+}
+
+}
+
+void
+BVH::setCacheFile(const std::string& file)
+{
+    delete m_cacheFile;
+    m_cacheFile = new std::string(file);
+}
+
+unsigned long long
+BVH::geometryHash(const Objects & objs) const
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    const unsigned int options[4] = { bvh_sse, m_spatialSplits, (unsigned int)m_builder, (unsigned int)objs.size() };
+    hashBytes(hash, options, sizeof(options));
+
+    for (size_t i = 0; i < objs.size(); i++)
+    {
+        const unsigned int object = i;
+        hashBytes(hash, &object, sizeof(object));
+
+        //A mesh loaded from a file is hashed by its source, which is
+        //cheap, the vertices are only read for meshes that have none
+        int first = 0, count = 0;
+        TriangleMesh *mesh = 0;
+        if (MeshObject *m = dynamic_cast<MeshObject*>(objs[i]))
+        {
+            mesh = m->getMesh();
+            count = mesh->numTris();
+        }
+        else if (Triangle *t = dynamic_cast<Triangle*>(objs[i]))
+        {
+            mesh = t->getMesh();
+            first = t->getIndex();
+            count = 1;
+        }
+
+        if (mesh)
+        {
+            const unsigned long long source[3] = { mesh->sourceHash(), (unsigned long long)first, (unsigned long long)count };
+            hashBytes(hash, source, sizeof(source));
+            if (source[0] != 0)
+                continue;
+            for (int t = first; t < first+count; t++)
+            {
+                TriangleMesh::TupleI3 vInd = mesh->vIndices()[t];
+                for (int k = 0; k < 3; k++)
+                    hashVector(hash, mesh->vertices()[vInd.v[k]]);
+            }
+            continue;
+        }
+
+        const int bounded = objs[i]->isBounded();
+        hashBytes(hash, &bounded, sizeof(bounded));
+        hashVector(hash, objs[i]->coordsMin());
+        hashVector(hash, objs[i]->coordsMax());
+        hashVector(hash, objs[i]->center());
+    }
+    return hash;
+}
+
+void
+BVH::flatten(std::vector<BVHFileNode> & nodes, std::vector<int> & primitives, const std::map<Object*, int> & objectIndices) const
+{
+    const int index = nodes.size();
+    nodes.push_back(BVHFileNode());
+    BVHFileNode node;
+    memset(&node, 0, sizeof(node));
+    for (int i = 0; i < 3; i++)
+    {
+        node.min[i] = m_corners[0][i];
+        node.max[i] = m_corners[1][i];
+    }
+    node.isLeaf = m_isLeaf;
+
+    if (m_isLeaf)
+    {
+        node.firstPacket = m_firstPacket;
+        node.nPackets = m_nPackets;
+        node.firstPrimitive = primitives.size();
+        node.nPrimitives = m_primitives ? m_primitives->size() : 0;
+        for (int i = 0; i < node.nPrimitives; i++)
+            primitives.push_back(objectIndices.find((*m_primitives)[i].object)->second);
+    }
+    else
+    {
+        node.buildOverlap = m_buildOverlap;
+        for (int i = 0; i < 2; i++)
+        {
+            node.children[i] = nodes.size();
+            (*m_children)[i]->flatten(nodes, primitives, objectIndices);
+        }
+    }
+    nodes[index] = node;
+}
+
+void
+BVH::unflatten(const BVHFileNode * nodes, int index, const int * primitives, Objects * objs)
+{
+    const BVHFileNode &node = nodes[index];
+    for (int i = 0; i < 3; i++)
+    {
+        m_corners[0][i] = node.min[i];
+        m_corners[1][i] = node.max[i];
+    }
+    m_corners[0][3] = m_corners[1][3] = 0;
+    m_isLeaf = node.isLeaf != 0;
+
+    if (m_isLeaf)
+    {
+        m_firstPacket = node.firstPacket;
+        m_nPackets = node.nPackets;
+        m_primitives = 0;
+        if (node.nPrimitives > 0)
+        {
+            m_primitives = new Primitives;
+            for (int i = 0; i < node.nPrimitives; i++)
+            {
+                BVHPrimitive p = {(*objs)[primitives[node.firstPrimitive+i]], 0, 0};
+                m_primitives->push_back(p);
+            }
+        }
+        return;
+    }
+
+    m_buildOverlap = node.buildOverlap;
+    m_children = new vector<BVH*>;
+    for (int i = 0; i < 2; i++)
+    {
+        m_children->push_back(new BVH);
+        (*m_children)[i]->unflatten(nodes, node.children[i], primitives, objs);
+    }
+}
+
+bool
+BVH::loadCache(const char* file, unsigned long long hash, Objects * objs)
+{
+#ifndef WIN32
+    const int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    BVHFileHeader header;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header) ||
+        read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t offsets[NumSections], sizes[NumSections];
+    const bool valid =
+        memcmp(header.magic, bvh_magic, sizeof(header.magic)) == 0 &&
+        header.version == bvh_version &&
+        header.sse == bvh_sse &&
+        header.node_size == sizeof(BVHFileNode) &&
+        header.packet_size == sizeof(TrianglePacket) &&
+        header.num_nodes > 0 &&
+        header.geometry_hash == hash &&
+        header.file_size == (unsigned long long)st.st_size &&
+        bvhLayout(header, offsets, sizes) == header.file_size;
+    if (!valid)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(0, header.file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    const char* const base = (const char*)data;
+    const BVHFileNode* nodes = (const BVHFileNode*)(base + offsets[SecNodes]);
+    const TrianglePacket* packets = (const TrianglePacket*)(base + offsets[SecPackets]);
+    const int (*packetObjects)[4] = (const int (*)[4])(base + offsets[SecPacketObjects]);
+    const int* primitives = (const int*)(base + offsets[SecPrimitives]);
+    if (!validCache(header, nodes, packets, packetObjects, primitives, *objs))
+    {
+        munmap(data, header.file_size);
+        debug("The BVH cache %s is damaged, building the BVH again\n", file);
+        return false;
+    }
+
+    //The packets are copied out of the mapping to point to this run's objects
+    m_packets = new std::vector<TrianglePacket>(packets, packets + header.num_packets);
+    for (unsigned int p = 0; p < header.num_packets; p++)
+    {
+        TrianglePacket &packet = (*m_packets)[p];
+        for (int t = 0; t < 4; t++)
+        {
+            packet.objects[t] = t < packet.nTriangles ? (*objs)[packetObjects[p][t]] : 0;
+            packet.meshes[t] = t < packet.nTriangles ? getObjectMesh(packet.objects[t]) : 0;
+        }
+    }
+    unflatten(nodes, 0, primitives, objs);
+
+    munmap(data, header.file_size);
+    debug("Loaded the BVH from %s\n", file);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool
+BVH::saveCache(const char* file, unsigned long long hash, Objects * objs) const
+{
+#ifndef WIN32
+    std::map<Object*, int> objectIndices;
+    for (size_t i = 0; i < objs->size(); i++)
+        objectIndices[(*objs)[i]] = i;
+
+    std::vector<BVHFileNode> nodes;
+    std::vector<int> primitives;
+    flatten(nodes, primitives, objectIndices);
+
+    const std::vector<TrianglePacket> &packets = *m_packets;
+    std::vector<int> packetObjects(packets.size()*4, -1);
+    for (size_t p = 0; p < packets.size(); p++)
+        for (int t = 0; t < packets[p].nTriangles; t++)
+            packetObjects[p*4+t] = objectIndices.find(packets[p].objects[t])->second;
+
+    BVHFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, bvh_magic, sizeof(header.magic));
+    header.version = bvh_version;
+    header.sse = bvh_sse;
+    header.node_size = sizeof(BVHFileNode);
+    header.packet_size = sizeof(TrianglePacket);
+    header.num_nodes = nodes.size();
+    header.num_packets = packets.size();
+    header.num_primitives = primitives.size();
+    header.geometry_hash = hash;
+
+    size_t offsets[NumSections], sizes[NumSections];
+    header.file_size = bvhLayout(header, offsets, sizes);
+
+    const void* sections[NumSections] = { &nodes[0], packets.empty() ? 0 : &packets[0],
+                                          packetObjects.empty() ? 0 : &packetObjects[0],
+                                          primitives.empty() ? 0 : &primitives[0] };
+
+    //Written under another name and renamed, so a run that reads the
+    //cache never sees a partly written file
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+    FILE* f = fopen(tmp, "wb");
+    if (!f)
+        return false;
+
+    static const char zeros[bvh_alignment] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    size_t offset = sizeof(header);
+    for (int i = 0; i < NumSections && ok; i++)
+    {
+        const size_t padding = offsets[i] - offset;
+        ok = fwrite(zeros, 1, padding, f) == padding;
+        if (ok && sizes[i] > 0)
+            ok = fwrite(sections[i], 1, sizes[i], f) == sizes[i];
+        offset = offsets[i] + sizes[i];
+    }
+    ok = (fclose(f) == 0) && ok;
+
+    if (ok)
+        ok = rename(tmp, file) == 0;
+    if (!ok)
+        remove(tmp);
+    return ok;
+#else
+    return false;
+#endif
+}
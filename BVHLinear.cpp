@@ -0,0 +1,361 @@
+#include <algorithm>
+#include "BVH.h"
+#include "Console.h"
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+#ifdef STATS
+#include "Stats.h"
+#endif
+
+using namespace std;
+
+//In BVH.cpp
+void getCornerPoints(Corner (&outCorners)[2], PrimitiveList * objs, const std::vector<PrimitiveBounds> & bounds);
+float getArea(const Corner (&corners)[2]);
+
+//************************************************************************
+// Linear BVH
+//
+// The centers of the primitives are quantized to a 1024^3 grid and sorted
+// by their Morton codes, which puts primitives close in space next to each
+// other. Every node splits its range where the highest bit that differs
+// changes, so the tree follows an octree of the grid.
+//************************************************************************
+
+struct MortonPrimitive
+{
+    unsigned int code;
+    unsigned int index;  //In the bounds array
+};
+
+namespace
+{
+
+const int morton_bits = 10;  //Per dimension
+const int radix_bits = 8;
+const int radix_buckets = 1 << radix_bits;
+const int radix_passes = (3*morton_bits + radix_bits - 1)/radix_bits;
+const size_t radix_chunk = 16384;
+
+//Spreads the lower 10 bits of v out to every third bit
+inline unsigned int expandBits(unsigned int v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+//Sorts by code with a least significant digit radix sort. Every pass counts
+//the digits of chunks of the array in parallel, and then moves every chunk
+//to the place its counts give it, also in parallel.
+void radixSort(std::vector<MortonPrimitive> & v)
+{
+    std::vector<MortonPrimitive> temp(v.size());
+    const int nChunks = (int)((v.size() + radix_chunk - 1)/radix_chunk);
+    std::vector<size_t> offsets((size_t)nChunks*radix_buckets);
+
+    for (int pass = 0; pass < radix_passes; pass++)
+    {
+        const int shift = pass*radix_bits;
+        const std::vector<MortonPrimitive> &in = (pass & 1) ? temp : v;
+        std::vector<MortonPrimitive> &out = (pass & 1) ? v : temp;
+
+        #ifdef OPENMP
+        #pragma omp parallel for schedule(static)
+        #endif
+        for (int c = 0; c < nChunks; c++)
+        {
+            size_t *counts = &offsets[(size_t)c*radix_buckets];
+            std::fill(counts, counts + radix_buckets, 0);
+            const size_t end = std::min(in.size(), (c+1)*radix_chunk);
+            for (size_t i = c*radix_chunk; i < end; i++)
+                counts[(in[i].code >> shift) & (radix_buckets-1)]++;
+        }
+
+        //Turn the counts into the first index of every chunk in every bucket
+        size_t offset = 0;
+        for (int b = 0; b < radix_buckets; b++)
+        {
+            for (int c = 0; c < nChunks; c++)
+            {
+                size_t count = offsets[(size_t)c*radix_buckets + b];
+                offsets[(size_t)c*radix_buckets + b] = offset;
+                offset += count;
+            }
+        }
+
+        #ifdef OPENMP
+        #pragma omp parallel for schedule(static)
+        #endif
+        for (int c = 0; c < nChunks; c++)
+        {
+            size_t *next = &offsets[(size_t)c*radix_buckets];
+            const size_t end = std::min(in.size(), (c+1)*radix_chunk);
+            for (size_t i = c*radix_chunk; i < end; i++)
+                out[next[(in[i].code >> shift) & (radix_buckets-1)]++] = in[i];
+        }
+    }
+
+    if (radix_passes & 1)
+        v.swap(temp);
+}
+
+}
+
+void
+BVH::buildLinear(BVHBuildData & data)
+{
+    const std::vector<PrimitiveBounds> &bounds = data.bounds;
+    const int n = bounds.size();
+
+    //The grid spans the centers of the primitives
+    Vector3 centerMin(infinity), centerMax(-infinity);
+    for (int i = 0; i < n; i++)
+    {
+        const Vector3 &c = bounds[i].center;
+        for (int j = 0; j < 3; j++)
+        {
+            if (c[j] < centerMin[j]) centerMin[j] = c[j];
+            if (c[j] > centerMax[j]) centerMax[j] = c[j];
+        }
+    }
+
+    Vector3 scale;
+    for (int j = 0; j < 3; j++)
+        scale[j] = centerMax[j] > centerMin[j] ? (1 << morton_bits)/(centerMax[j] - centerMin[j]) : 0;
+
+    std::vector<MortonPrimitive> sorted(n);
+    #ifdef OPENMP
+    #pragma omp parallel for schedule(static)
+    #endif
+    for (int i = 0; i < n; i++)
+    {
+        unsigned int code = 0;
+        for (int j = 0; j < 3; j++)
+        {
+            //Centers that are not finite, like those of planes, go to 0
+            float x = (bounds[i].center[j] - centerMin[j])*scale[j];
+            if (!(x >= 0)) x = 0;
+            code |= expandBits((unsigned int)std::min(x, (float)((1 << morton_bits) - 1))) << (2-j);
+        }
+        sorted[i].code = code;
+        sorted[i].index = i;
+    }
+
+    radixSort(sorted);
+    if (n > 0)
+        buildLinear(&sorted[0], 0, n, 3*morton_bits-1, data, 0);
+    else
+    {
+        //An empty scene is an empty leaf
+        PrimitiveList empty;
+        getCornerPoints(m_corners, &empty, bounds);
+        makeLeaf(&empty, data);
+    }
+}
+
+void
+BVH::buildLinear(const MortonPrimitive * sorted, int begin, int end, int bit, BVHBuildData & data, int depth)
+{
+#ifdef STATS
+    Stats::BVH_Nodes += 1;
+#endif
+
+    //Objects other than triangles are split down to one per leaf, like in build
+    int nObjects = 0;
+    for (int i = begin; i < end; i++)
+        if (data.primitives[data.bounds[sorted[i].index].primitive].mesh == 0) nObjects++;
+
+    if ((end - begin <= OBJECTS_PER_LEAF && nObjects <= 1) || depth >= MAX_TREE_DEPTH)
+    {
+        PrimitiveList objs(end - begin);
+        for (int i = begin; i < end; i++)
+            objs[i - begin] = sorted[i].index;
+
+        getCornerPoints(m_corners, &objs, data.bounds);
+        for (int i = 0; i < 3; i++)
+        {
+            m_corners[0][i] -= epsilon;
+            m_corners[1][i] += epsilon;
+        }
+        makeLeaf(&objs, data);
+        return;
+    }
+
+    //Split where the highest bit that differs in the range changes from 0
+    //to 1. If all codes are the same, split in the middle.
+    int split = (begin + end)/2;
+    for (; bit >= 0; bit--)
+    {
+        const unsigned int mask = 1u << bit;
+        if ((sorted[begin].code & mask) == (sorted[end-1].code & mask))
+            continue;
+
+        //The first one with the bit set
+        int lo = begin, hi = end - 1;
+        while (hi - lo > 1)
+        {
+            int mid = (lo + hi)/2;
+            if (sorted[mid].code & mask)
+                hi = mid;
+            else
+                lo = mid;
+        }
+        split = hi;
+        break;
+    }
+
+    m_isLeaf = false;
+    m_children = new vector<BVH*>;
+    m_children->push_back(new BVH);
+    m_children->push_back(new BVH);
+    (*m_children)[0]->buildLinear(sorted, begin, split, bit-1, data, depth+1);
+    (*m_children)[1]->buildLinear(sorted, split, end, bit-1, data, depth+1);
+
+    //The children are already expanded by epsilon, so their union is the box
+    for (int i = 0; i < 3; i++)
+    {
+        m_corners[0][i] = std::min((*m_children)[0]->m_corners[0][i], (*m_children)[1]->m_corners[0][i]);
+        m_corners[1][i] = std::max((*m_children)[0]->m_corners[1][i], (*m_children)[1]->m_corners[1][i]);
+    }
+    m_buildOverlap = getOverlap();
+}
+
+//************************************************************************
+// Treelet restructuring
+//
+// Bottom-up, every node and the nodes below it form a treelet: the node
+// is expanded into its children, and the biggest of them is expanded
+// again, until there are TREELET_SIZE of them. The treelet then gets the
+// topology over these leaves with the lowest SAH cost, found by trying
+// every partition of every subset of them, reusing its inner nodes.
+//************************************************************************
+
+//Returns the SAH cost of the subtree, and stores the cost of every node in costs
+float
+BVH::restructureTreelets(std::map<const BVH*, float> & costs, const std::vector<TrianglePacket> & packets)
+{
+    if (m_isLeaf)
+    {
+        int count = m_primitives ? m_primitives->size() : 0;
+        for (int p = m_firstPacket; p < m_firstPacket+m_nPackets; p++)
+            count += packets[p].nTriangles;
+        return costs[this] = getBoxArea()*count;
+    }
+
+    (*m_children)[0]->restructureTreelets(costs, packets);
+    (*m_children)[1]->restructureTreelets(costs, packets);
+
+    //Expand the treelet at its biggest inner leaf
+    BVH* leaves[TREELET_SIZE] = {(*m_children)[0], (*m_children)[1]};
+    BVH* inner[TREELET_SIZE] = {this};
+    int nLeaves = 2, nInner = 1;
+    while (nLeaves < TREELET_SIZE)
+    {
+        int biggest = -1;
+        float biggestArea = -1;
+        for (int i = 0; i < nLeaves; i++)
+        {
+            if (!leaves[i]->m_isLeaf && leaves[i]->getBoxArea() > biggestArea)
+            {
+                biggest = i;
+                biggestArea = leaves[i]->getBoxArea();
+            }
+        }
+        if (biggest == -1) break;
+
+        BVH* node = leaves[biggest];
+        inner[nInner++] = node;
+        leaves[biggest] = (*node->m_children)[0];
+        leaves[nLeaves++] = (*node->m_children)[1];
+    }
+
+    const float oldCost = TRAVERSAL_COST*getBoxArea() + costs[(*m_children)[0]] + costs[(*m_children)[1]];
+    if (nLeaves < 3)
+        return costs[this] = oldCost;
+
+    //Cost of every subset of the leaves, from the smaller ones up, and the
+    //partition of the subset that gives it
+    float cost[1 << TREELET_SIZE];
+    int partition[1 << TREELET_SIZE];
+    const int n = nLeaves, all = (1 << n) - 1;
+    for (int s = 1; s <= all; s++)
+    {
+        if ((s & (s-1)) == 0)
+        {
+            for (int i = 0; i < n; i++)
+                if (s == (1 << i)) cost[s] = costs[leaves[i]];
+            continue;
+        }
+
+        Corner box[2] = {{infinity, infinity, infinity, 0}, {-infinity, -infinity, -infinity, 0}};
+        for (int i = 0; i < n; i++)
+        {
+            if (!(s & (1 << i))) continue;
+            for (int j = 0; j < 3; j++)
+            {
+                box[0][j] = std::min(box[0][j], leaves[i]->m_corners[0][j]);
+                box[1][j] = std::max(box[1][j], leaves[i]->m_corners[1][j]);
+            }
+        }
+
+        //Every partition once, with the lowest leaf on the left
+        const int lowest = s & -s;
+        float best = infinity;
+        for (int p = (s-1) & s; p > 0; p = (p-1) & s)
+        {
+            if (!(p & lowest)) continue;
+            float split = cost[p] + cost[s ^ p];
+            if (split < best)
+            {
+                best = split;
+                partition[s] = p;
+            }
+        }
+        cost[s] = TRAVERSAL_COST*getArea(box) + best;
+    }
+
+    if (!(cost[all] < oldCost*0.999f))
+        return costs[this] = oldCost;
+
+    //Rebuild the treelet with the best partitions, top-down from this node.
+    //The inner nodes are reused in any order, their boxes are set bottom-up.
+    int sets[TREELET_SIZE] = {all}, nextInner = 1;
+    std::vector<BVH*> order(1, this);
+    for (int k = 0; k < (int)order.size(); k++)
+    {
+        BVH* node = order[k];
+        int s = sets[k];
+        int sides[2] = {partition[s], s ^ partition[s]};
+        for (int c = 0; c < 2; c++)
+        {
+            if ((sides[c] & (sides[c]-1)) == 0)
+            {
+                for (int i = 0; i < n; i++)
+                    if (sides[c] == (1 << i)) (*node->m_children)[c] = leaves[i];
+                continue;
+            }
+            BVH* child = inner[nextInner];
+            sets[nextInner++] = sides[c];
+            order.push_back(child);
+            (*node->m_children)[c] = child;
+        }
+    }
+    for (int k = order.size() - 1; k >= 0; k--)
+    {
+        BVH* node = order[k];
+        for (int i = 0; i < 3; i++)
+        {
+            node->m_corners[0][i] = std::min((*node->m_children)[0]->m_corners[0][i], (*node->m_children)[1]->m_corners[0][i]);
+            node->m_corners[1][i] = std::max((*node->m_children)[0]->m_corners[1][i], (*node->m_children)[1]->m_corners[1][i]);
+        }
+        node->m_buildOverlap = node->getOverlap();
+        costs[node] = cost[sets[k]];
+    }
+
+    return costs[this];
+}
@@ -0,0 +1,436 @@
+#include "Bidirectional.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include "includes.h"
+#include "ErrorTracker.h"
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+BidirectionalTracer::BidirectionalTracer(SquareLight* light, int maxDepth, int power)
+{
+    m_light = light;
+    m_lightNormal = light->getNormal();
+    m_lightArea = light->area();
+    m_Le = light->radiance(Vector3(0), Vector3(0));
+    m_maxDepth = std::min(maxDepth, MaxVertices-2);
+    m_power = power;
+}
+
+//Extend a subpath whose first vertex is path[0] by following ray. The material
+//lobes are chosen like in the path tracer, the diffuse lobe with probability
+//(average diffuse reflectance). Returns the number of vertices.
+int BidirectionalTracer::traceSubpath(Ray ray, Vector3 beta, double pdfDir, Vertex* path, int maxVertices, bool fromLight)
+{
+    int n = 1;
+    HitInfo hitInfo;
+    while (n < maxVertices)
+    {
+        if (!g_scene->trace(hitInfo, ray, 0, MIRO_TMAX))
+            break;
+
+        Vertex &v = path[n], &prev = path[n-1];
+        v.x = hitInfo.P;
+        v.beta = beta;
+        v.material = hitInfo.material;
+        v.delta = false;
+        v.pdfRev = 0;
+
+        //Did we hit the light? Light paths bail out, eye paths end there
+        if (dynamic_cast<PointLight*>(hitInfo.object) != NULL)
+        {
+            if (fromLight)
+                break;
+            v.type = LightVertex;
+            v.N = v.Ng = m_lightNormal;
+            v.pdfFwd = convertDensity(pdfDir, prev, v);
+            n++;
+            break;
+        }
+
+        v.type = SurfaceVertex;
+        v.N = hitInfo.N;
+        v.Ng = hitInfo.Ng;
+        v.pdfFwd = convertDensity(pdfDir, prev, v);
+        if (++n >= maxVertices)
+            break;
+
+        const Material* m = hitInfo.material;
+        double prob[3];
+        prob[0] = m->getDiffuse().average();
+        prob[1] = prob[0] + m->getReflection().average();
+        prob[2] = prob[1] + m->getRefraction().average();
+
+        double pdfRev;
+        double rnd = frand();
+        //Diffuse reflection
+        if (rnd < prob[0])
+        {
+            Vector3 wi = -ray.d;
+            //Hit on wrong side of the geometry, so terminate ray
+            if (dot(wi, hitInfo.N) <= 0)
+                break;
+
+            ray = ray.diffuse(hitInfo, frand(), frand());
+            pdfDir = prob[0] * dot(ray.d, hitInfo.N) / PI;
+            pdfRev = prob[0] * dot(wi, hitInfo.N) / PI;
+            beta = beta * m->getDiffuse() / prob[0];
+        }
+        //Mirror reflection
+        else if (rnd < prob[1])
+        {
+            ray = ray.reflect(hitInfo);
+            beta = beta * m->getReflection() / (prob[1] - prob[0]);
+            v.delta = true;
+            pdfDir = pdfRev = 0;
+        }
+        //Refraction, or Fresnel reflection
+        else if (rnd < prob[2])
+        {
+            float Rs = ray.getReflectionCoefficient(hitInfo);
+            if (frand() < Rs)
+                ray = ray.reflect(hitInfo);
+            else
+                ray = ray.refract(hitInfo);
+            beta = beta * m->getRefraction() / (prob[2] - prob[1]);
+            v.delta = true;
+            pdfDir = pdfRev = 0;
+        }
+        //Absorbed
+        else
+        {
+            break;
+        }
+
+        prev.pdfRev = convertDensity(pdfRev, v, prev);
+    }
+    return n;
+}
+
+int BidirectionalTracer::lightSubpath(Vertex* path, int maxVertices)
+{
+    //Point on the light with density 1/area and a cosine weighted direction
+    Vertex &y0 = path[0];
+    y0.type = LightVertex;
+    y0.x = m_light->getPhotonOrigin(frand(), frand());
+    y0.N = y0.Ng = m_lightNormal;
+    y0.beta = Vector3(m_Le*m_lightArea);
+    y0.material = 0;
+    y0.delta = false;
+    y0.pdfFwd = 1./m_lightArea;
+    y0.pdfRev = 0;
+
+    double u1 = frand(), u2 = frand();
+    Ray ray(y0.x, m_light->samplePhotonDirection(u1, u2));
+    double pdfDir = dot(ray.d, m_lightNormal) / PI;
+
+    //Le cos / (pdf_A pdf_dir)
+    return traceSubpath(ray, Vector3(m_Le*m_lightArea*PI), pdfDir, path, maxVertices, true);
+}
+
+int BidirectionalTracer::eyeSubpath(int x, int y, int width, int height, Vertex* path, int maxVertices)
+{
+    Vertex &z0 = path[0];
+    z0.type = CameraVertex;
+    z0.x = g_camera->eye();
+    z0.N = z0.Ng = g_camera->viewDir();
+    z0.beta = Vector3(1);
+    z0.material = 0;
+    z0.delta = false;
+    z0.pdfFwd = 1;
+    z0.pdfRev = 0;
+
+    Ray ray = g_camera->eyeRay(x, y, width, height, false);
+    return traceSubpath(ray, Vector3(1), 1., path, maxVertices, false);
+}
+
+Vector3 BidirectionalTracer::samplePixel(int x, int y, int width, int height)
+{
+    Vertex light[MaxVertices], eye[MaxVertices];
+    int nLight = lightSubpath(light, m_maxDepth+1);
+    int nEye = eyeSubpath(x, y, width, height, eye, m_maxDepth+2);
+
+    //s light vertices and t eye vertices make a path with s+t-2 bounces
+    Vector3 L(0);
+    for (int t = 2; t <= nEye; t++)
+    {
+        for (int s = 0; s <= nLight && s+t-2 <= m_maxDepth; s++)
+        {
+            L += connect(light, s, eye, t);
+        }
+    }
+    return L;
+}
+
+//Contribution of the path made of the first s light vertices and the first
+//t eye vertices, weighted for the other strategies that give the same path
+Vector3 BidirectionalTracer::connect(Vertex* light, int s, Vertex* eye, int t)
+{
+    Vertex &pt = eye[t-1];
+    Vector3 L;
+
+    if (s == 0)
+    {
+        //The eye path hit the light (the light is one sided)
+        if (pt.type != LightVertex || dot(eye[t-2].x - pt.x, pt.N) <= 0)
+            return Vector3(0);
+        L = pt.beta * m_Le;
+    }
+    else
+    {
+        Vertex &qs = light[s-1];
+        if (pt.type != SurfaceVertex || !connectible(qs) || !connectible(pt))
+            return Vector3(0);
+
+        Vector3 d = pt.x - qs.x;
+        double d2 = d.length2();
+        double length = sqrt(d2);
+        d /= length;
+
+        double cq = dot(d, qs.N), cp = -dot(d, pt.N);
+        if (cq <= 0 || cp <= 0)
+            return Vector3(0);
+
+        L = qs.beta * pt.beta * f(pt, eye[t-2], qs) * (cq * cp / d2);
+        if (s > 1)
+            L = L * f(qs, light[s-2], pt);
+        if (L.x == 0 && L.y == 0 && L.z == 0)
+            return Vector3(0);
+
+        HitInfo hitTmp;
+        Ray shadow(offsetRayOrigin(qs.x, qs.Ng, d), d);
+        if (g_scene->trace(hitTmp, shadow, 0, length - 2*epsilon))
+            return Vector3(0);
+    }
+
+    return L * misWeight(light, s, eye, t);
+}
+
+//Weight of strategy (s, t) from the ratios of the densities of the other
+//strategies (Veach 10.2). The densities at the connection vertices and their
+//neighbours are replaced by the ones for the connected path while the
+//weight is computed.
+double BidirectionalTracer::misWeight(Vertex* light, int s, Vertex* eye, int t)
+{
+    if (s + t == 2)
+        return 1;
+
+    Vertex *qs = s > 0 ? &light[s-1] : 0,
+           *qsMinus = s > 1 ? &light[s-2] : 0,
+           *pt = &eye[t-1],
+           *ptMinus = &eye[t-2];
+
+    double ptRev = pt->pdfRev, ptMinusRev = ptMinus->pdfRev;
+    double qsRev = qs ? qs->pdfRev : 0, qsMinusRev = qsMinus ? qsMinus->pdfRev : 0;
+    bool ptDelta = pt->delta, qsDelta = qs ? qs->delta : false;
+
+    pt->delta = false;
+    if (qs)
+    {
+        qs->delta = false;
+        pt->pdfRev = pdf(*qs, qsMinus, *pt);
+        ptMinus->pdfRev = pdf(*pt, qs, *ptMinus);
+        qs->pdfRev = pdf(*pt, ptMinus, *qs);
+        if (qsMinus)
+            qsMinus->pdfRev = pdf(*qs, pt, *qsMinus);
+    }
+    else
+    {
+        pt->pdfRev = 1./m_lightArea;
+        ptMinus->pdfRev = pdfLight(*pt, *ptMinus);
+    }
+
+    double sum = 0, r = 1;
+    //Move the connection towards the eye. One eye vertex is not a strategy.
+    for (int i = t-1; i >= 2; i--)
+    {
+        r *= ratio(eye[i].pdfRev, eye[i].pdfFwd);
+        if (!eye[i].delta && !eye[i-1].delta)
+            sum += r;
+    }
+
+    //Move the connection towards the light
+    r = 1;
+    for (int i = s-1; i >= 0; i--)
+    {
+        r *= ratio(light[i].pdfRev, light[i].pdfFwd);
+        if (!light[i].delta && !(i > 0 && light[i-1].delta))
+            sum += r;
+    }
+
+    pt->pdfRev = ptRev;
+    ptMinus->pdfRev = ptMinusRev;
+    pt->delta = ptDelta;
+    if (qs)
+    {
+        qs->pdfRev = qsRev;
+        qs->delta = qsDelta;
+    }
+    if (qsMinus)
+        qsMinus->pdfRev = qsMinusRev;
+
+    return 1. / (1. + sum);
+}
+
+bool BidirectionalTracer::connectible(const Vertex& v) const
+{
+    if (v.type == LightVertex)
+        return true;
+    if (v.type == SurfaceVertex)
+        return v.material->getDiffuse().average() > 0;
+    return false;
+}
+
+//Diffuse BRDF at v between the directions to prev and next
+Vector3 BidirectionalTracer::f(const Vertex& v, const Vertex& prev, const Vertex& next) const
+{
+    if (dot(prev.x - v.x, v.N) <= 0 || dot(next.x - v.x, v.N) <= 0)
+        return Vector3(0);
+    return v.material->getDiffuse() / PI;
+}
+
+//Area density at next of sampling it from v, which was reached from prev
+//(prev is 0 if v is the start of the light path)
+double BidirectionalTracer::pdf(const Vertex& v, const Vertex* prev, const Vertex& next) const
+{
+    if (v.type == LightVertex)
+        return pdfLight(v, next);
+    if (v.type != SurfaceVertex)
+        return 0;
+
+    Vector3 wn = next.x - v.x;
+    double length = wn.length();
+    if (length == 0 || dot(prev->x - v.x, v.N) <= 0)
+        return 0;
+
+    double c = dot(wn, v.N) / length;
+    if (c <= 0)
+        return 0;
+
+    return convertDensity(v.material->getDiffuse().average() * c / PI, v, next);
+}
+
+double BidirectionalTracer::pdfLight(const Vertex& v, const Vertex& next) const
+{
+    Vector3 w = next.x - v.x;
+    double length = w.length();
+    if (length == 0)
+        return 0;
+
+    double c = dot(w, m_lightNormal) / length;
+    if (c <= 0)
+        return 0;
+
+    return convertDensity(c / PI, v, next);
+}
+
+//Solid angle density at from to area density at to
+double BidirectionalTracer::convertDensity(double pdf, const Vertex& from, const Vertex& to) const
+{
+    Vector3 w = to.x - from.x;
+    double d2 = w.length2();
+    if (d2 == 0)
+        return 0;
+    if (to.type != CameraVertex)
+        pdf *= fabs(dot(w, to.N)) / sqrt(d2);
+    return pdf / d2;
+}
+
+//Density ratio of two neighbouring strategies for the heuristic. Specular
+//vertices have density 0, those strategies are skipped by the caller.
+double BidirectionalTracer::ratio(double pdfRev, double pdfFwd) const
+{
+    double r = (pdfRev == 0 ? 1 : pdfRev) / (pdfFwd == 0 ? 1 : pdfFwd);
+    return m_power == 1 ? r : pow(r, m_power);
+}
+
+void BidirectionalTracer::renderProgressive(const Vector3* reference, int width, int height, int passes, long seed, const char* name)
+{
+    Vector3* sum = new Vector3[width*height];
+    for (int i = 0; i < width*height; i++)
+        sum[i] = Vector3(0);
+
+    ErrorTracker* error = 0;
+    if (reference)
+    {
+        error = new ErrorTracker(width, height);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                error->setReference(x, y, reference[x + y*width]);
+    }
+
+    stringstream msq_out;
+    double msq = 0;
+    double t0 = -getTime();
+    int nextImage = 1;
+
+    for (int pass = 1; pass <= passes; pass++)
+    {
+        #ifdef OPENMP
+        #pragma omp parallel for schedule(dynamic, 2)
+        #endif
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                //Seeded by pixel and pass so the image does not depend on the scheduling
+                seedThreadRandom(seed + ((long)pass*height + y)*width + x);
+                sum[x + y*width] += samplePixel(x, y, width, height);
+            }
+        }
+
+        if (error)
+        {
+            msq = error->compute(sum, 1./(double)pass);
+            msq_out << msq << endl;
+        }
+
+        printf("\rPass %d of %d [%.2fs] MSQ: %lf", pass, passes, t0 + getTime(), msq);
+        fflush(stdout);
+
+        if (pass == nextImage || pass == passes)
+        {
+            if (pass == nextImage)
+                nextImage *= 10;
+
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    Vector3 result = sum[x + y*width] / (float)pass;
+
+                    //Gamma correct
+                    for (int i = 0; i < 3; i++)
+                    {
+                        result[i] = pow(abs(result[i]), 1.f/2.2f);
+                    }
+                    g_image->setPixel(x, y, result);
+                }
+            }
+
+            char filename[100];
+            sprintf(filename, "bdpt_%s_%d.ppm", name, pass);
+            cout << "\nWriting " << filename << "..." << endl;
+            g_image->writePPM(filename);
+        }
+    }
+    printf("\n");
+
+    if (error)
+    {
+        ofstream msq_outfile;
+        char filename[100];
+        sprintf(filename, "bdpt_%s_msq.dat", name);
+        msq_outfile.open(filename);
+        msq_outfile << msq_out.str().c_str();
+        delete error;
+    }
+
+    delete [] sum;
+}
@@ -0,0 +1,75 @@
+#ifndef __BIDIRECTIONAL_H__
+#define __BIDIRECTIONAL_H__
+
+#include "Vector3.h"
+#include "Ray.h"
+#include "Miro.h"
+
+class SquareLight;
+class Material;
+
+//Bidirectional path tracer (Veach 1997, ch. 10).
+//
+//For every pixel an eye subpath and a light subpath are traced, and every
+//eye vertex is connected to every light vertex. Each connection is one of
+//the strategies that can generate a path of that length, and the strategies
+//are combined with the balance (power = 1) or power (power = 2) heuristic.
+//
+//The camera shoots one ray through the pixel center, so the pixel is a
+//point measurement and paths cannot be connected to the camera itself.
+//Strategies with one eye vertex are left out of both the estimate and the
+//weights.
+class BidirectionalTracer
+{
+public:
+    BidirectionalTracer(SquareLight* light, int maxDepth = TRACE_DEPTH, int power = 2);
+
+    //One estimate of the radiance through pixel (x, y)
+    Vector3 samplePixel(int x, int y, int width, int height);
+
+    //Progressive rendering with one sample per pixel and pass, the pixels of a
+    //pass are traced in parallel. The error against reference (x + y*width,
+    //may be 0) is recorded after every pass and images are written after
+    //1, 10, 100... passes and at the end.
+    void renderProgressive(const Vector3* reference, int width, int height, int passes, long seed, const char* name);
+
+    static const int MaxVertices = 32;
+
+private:
+    enum VertexType { CameraVertex, LightVertex, SurfaceVertex };
+
+    struct Vertex
+    {
+        int type;
+        Vector3 x;
+        Vector3 N;
+        Vector3 Ng;                //geometric normal, for offsetting shadow rays
+        Vector3 beta;              //path throughput up to this vertex
+        const Material* material;
+        bool delta;                //scattered by a specular lobe
+        double pdfFwd, pdfRev;     //area densities of sampling this vertex from either side
+    };
+
+    int traceSubpath(Ray ray, Vector3 beta, double pdf, Vertex* path, int maxVertices, bool fromLight);
+    int lightSubpath(Vertex* path, int maxVertices);
+    int eyeSubpath(int x, int y, int width, int height, Vertex* path, int maxVertices);
+
+    Vector3 connect(Vertex* light, int s, Vertex* eye, int t);
+    double misWeight(Vertex* light, int s, Vertex* eye, int t);
+
+    bool connectible(const Vertex& v) const;
+    Vector3 f(const Vertex& v, const Vertex& prev, const Vertex& next) const;
+    double pdf(const Vertex& v, const Vertex* prev, const Vertex& next) const;
+    double pdfLight(const Vertex& v, const Vertex& next) const;
+    double convertDensity(double pdf, const Vertex& from, const Vertex& to) const;
+    double ratio(double pdfRev, double pdfFwd) const;
+
+    SquareLight* m_light;
+    Vector3 m_lightNormal;
+    float m_lightArea;
+    float m_Le;
+    int m_maxDepth;
+    int m_power;
+};
+
+#endif
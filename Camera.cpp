@@ -7,11 +7,7 @@
 #include "Console.h"
 #include "OpenGL.h"
 
-#ifdef PHOTON_MAPPING
-#include "PScene.h"
-#else
-#include "Scene.h"
-#endif
+#include "Scene.h"
 
 Camera * g_camera = 0;
 
@@ -0,0 +1,115 @@
+#include "ErrorTracker.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+ErrorTracker::ErrorTracker(int width, int height)
+{
+    m_width = width;
+    m_height = height;
+    m_ref = new double[width*height];
+    m_value = new double[width*height];
+    memset(m_ref, 0, width*height*sizeof(double));
+    memset(m_value, 0, width*height*sizeof(double));
+    m_rr = m_ra = m_aa = 0;
+}
+
+ErrorTracker::~ErrorTracker()
+{
+    delete [] m_ref;
+    delete [] m_value;
+}
+
+void ErrorTracker::setReference(int x, int y, const Vector3& ref)
+{
+    int i = x + y*m_width;
+    double r = ref.average();
+    m_rr += r*r - m_ref[i]*m_ref[i];
+    m_ra += (r - m_ref[i])*m_value[i];
+    m_ref[i] = r;
+}
+
+double ErrorTracker::error(double scale) const
+{
+    long double e = m_rr - 2.*scale*m_ra + scale*scale*m_aa;
+    if (e < 0) e = 0; //rounding when the error is close to 0
+    return (double)(e / (long double)(m_width*m_height));
+}
+
+double ErrorTracker::compute(const Vector3* image, double scale)
+{
+    //Sum rows separately and add them in order so the
+    //result does not depend on the number of threads
+    double* row_ra = new double[m_height];
+    double* row_aa = new double[m_height];
+
+    #ifdef OPENMP
+    #pragma omp parallel for schedule(static)
+    #endif
+    for (int y = 0; y < m_height; y++)
+    {
+        double ra = 0, aa = 0;
+        const double* ref = m_ref + y*m_width;
+        double* value = m_value + y*m_width;
+        const Vector3* pixel = image + y*m_width;
+        for (int x = 0; x < m_width; x++)
+        {
+            double a = pixel[x].average();
+            value[x] = a;
+            ra += ref[x]*a;
+            aa += a*a;
+        }
+        row_ra[y] = ra;
+        row_aa[y] = aa;
+    }
+
+    m_ra = m_aa = 0;
+    for (int y = 0; y < m_height; y++)
+    {
+        m_ra += row_ra[y];
+        m_aa += row_aa[y];
+    }
+
+    delete [] row_ra;
+    delete [] row_aa;
+    return error(scale);
+}
+
+bool loadReferenceImage(const char* filename, int width, int height, Vector3* image)
+{
+    for (int i = 0; i < width*height; i++)
+        image[i] = Vector3(0);
+
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open())
+    {
+        std::cout << "No path tracing results in " << filename << std::endl;
+        return false;
+    }
+
+    int w, h;
+    in.read((char*)&w, 4);
+    in.read((char*)&h, 4);
+    std::cout << "Loading path tracing results [width=" << w << ", height " << h << "]" << std::endl;
+    if (!in || w != width || h != height)
+    {
+        std::cout << "The path tracing results do not match the " << width << "x" << height << " image." << std::endl;
+        return false;
+    }
+
+    long double b = 0;
+    for (int i = 0; i < width*height; i++)
+    {
+        Vector3& pix = image[i];
+        in.read((char*)&pix.x, sizeof(float));
+        in.read((char*)&pix.y, sizeof(float));
+        in.read((char*)&pix.z, sizeof(float));
+        b += pix.average();
+    }
+    std::cout << "Done reading path tracing results. b = " << b/(long double)(width*height) << std::endl;
+    return true;
+}
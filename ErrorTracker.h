@@ -0,0 +1,58 @@
+#ifndef __ERROR_TRACKER_H__
+#define __ERROR_TRACKER_H__
+
+#include "Vector3.h"
+
+//Mean squared error of an image against a reference image, where the
+//error is taken on the average of the color channels.
+//
+//The image is kept as an accumulation buffer that is shown scaled by a
+//factor, like the Metropolis splat buffers. With r the reference and a
+//the accumulated value of a pixel, the error at scale s is
+//  sum (r - s*a)^2 = sum r^2 - 2s sum r*a + s^2 sum a^2
+//so it can be updated in constant time when a pixel changes, and read
+//for any scale without touching the pixels.
+class ErrorTracker
+{
+public:
+    ErrorTracker(int width, int height);
+    ~ErrorTracker();
+
+    void setReference(int x, int y, const Vector3& ref);
+
+    //Add to the accumulated value of a pixel
+    void add(int x, int y, const Vector3& value)
+    {
+        int i = x + y*m_width;
+        double a = m_value[i], d = value.average();
+        m_value[i] = a + d;
+        m_ra += m_ref[i]*d;
+        m_aa += d*(2.*a + d);
+    }
+
+    //Mean squared error of the accumulated image times scale
+    double error(double scale) const;
+
+    //Replace the accumulated image with a new one (x + y*width) in one
+    //parallel pass and return its error
+    double compute(const Vector3* image, double scale = 1.);
+
+private:
+    //Owns its buffers, so it can't be copied
+    ErrorTracker(const ErrorTracker&);
+    ErrorTracker& operator=(const ErrorTracker&);
+
+    int m_width;
+    int m_height;
+    double* m_ref;   //channel average of the reference
+    double* m_value; //channel average of the accumulated image
+    long double m_rr, m_ra, m_aa;
+};
+
+//Read a reference image written by the path tracer (width and height as
+//ints, then rgb floats row by row) into image (x + y*width). If the file
+//is missing or has another resolution, image is left black and false is
+//returned.
+bool loadReferenceImage(const char* filename, int width, int height, Vector3* image);
+
+#endif
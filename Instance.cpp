@@ -0,0 +1,121 @@
+#include "Instance.h"
+#include "Ray.h"
+#include "Utility.h"
+
+//Transforms a direction, that is, without the translation of the matrix
+inline Vector3 transformDirection(const Matrix4x4& m, const Vector3& d)
+{
+    return Vector3(m.m11*d.x + m.m12*d.y + m.m13*d.z,
+                   m.m21*d.x + m.m22*d.y + m.m23*d.z,
+                   m.m31*d.x + m.m32*d.y + m.m33*d.z);
+}
+
+SharedMesh::SharedMesh(TriangleMesh * m) :
+    m_object(m), m_built(false)
+{
+    //The instances set the material of the hits
+    m_object.setMaterial(0);
+    m_objects.push_back(&m_object);
+}
+
+void SharedMesh::preCalc()
+{
+    if (m_built) return;
+
+    m_object.preCalc();
+    m_bvh.build(&m_objects);
+    m_built = true;
+}
+
+void SharedMesh::refit()
+{
+    m_object.preCalc();
+    m_bvh.refit();
+}
+
+
+Instance::Instance(SharedMesh * mesh, const Matrix4x4& transform) :
+    m_mesh(mesh)
+{
+    setTransform(transform);
+}
+
+void Instance::setTransform(const Matrix4x4& transform)
+{
+    m_transform = transform;
+    m_inverse = transform;
+    m_inverse.invert();
+    m_normalTransform = m_inverse;
+    m_normalTransform.transpose();
+}
+
+void Instance::preCalc()
+{
+    m_mesh->preCalc();
+
+    //Bounds of the 8 transformed corners of the bounding box in object space
+    const MeshObject* obj = m_mesh->getObject();
+    Vector3 objMin = obj->coordsMin(), objMax = obj->coordsMax();
+    m_cachedMin = Vector3(infinity);
+    m_cachedMax = Vector3(-infinity);
+    for (int i = 0; i < 8; i++)
+    {
+        Vector3 corner = m_transform * Vector3((i & 1) ? objMax.x : objMin.x,
+                                               (i & 2) ? objMax.y : objMin.y,
+                                               (i & 4) ? objMax.z : objMin.z);
+        for (int j = 0; j < 3; j++)
+        {
+            if (corner[j] < m_cachedMin[j]) m_cachedMin[j] = corner[j];
+            if (corner[j] > m_cachedMax[j]) m_cachedMax[j] = corner[j];
+        }
+    }
+}
+
+float Instance::getArea(const Vector3& lightPos)
+{
+    return getProjectedBoxArea(m_cachedMin, m_cachedMax, lightPos);
+}
+
+Vector3 Instance::samplePosition() const
+{
+    return m_transform * m_mesh->getObject()->samplePosition();
+}
+
+void
+Instance::renderGL()
+{
+#ifndef NO_GFX
+    //OpenGL wants the matrix by columns
+    const Matrix4x4 &m = m_transform;
+    float columns[16] = {m.m11, m.m21, m.m31, m.m41,
+                         m.m12, m.m22, m.m32, m.m42,
+                         m.m13, m.m23, m.m33, m.m43,
+                         m.m14, m.m24, m.m34, m.m44};
+    glPushMatrix();
+    glMultMatrixf(columns);
+    m_mesh->getObject()->renderGL();
+    glPopMatrix();
+#endif
+}
+
+bool
+Instance::intersect(HitInfo& result, const Ray& r, float tMin, float tMax)
+{
+    //The direction is not normalized again, so t is the same in both spaces
+    Ray local(m_inverse * r.o, transformDirection(m_inverse, r.d));
+    if (!m_mesh->intersect(result, local, tMin, tMax))
+        return false;
+
+    result.P = m_transform * result.P;
+    result.N = transformDirection(m_normalTransform, result.N).normalize();
+    result.Ng = transformDirection(m_normalTransform, result.Ng).normalize();
+    result.object = this;
+    result.material = m_material;
+
+    return true;
+}
+
+tex_coord2d_t Instance::primitiveUVCoordinates(unsigned int primitive, const Vector3 & xyz) const
+{
+    return m_mesh->getObject()->primitiveUVCoordinates(primitive, m_inverse * xyz);
+}
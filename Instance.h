@@ -0,0 +1,84 @@
+#ifndef CSE168_INSTANCE_H_INCLUDED
+#define CSE168_INSTANCE_H_INCLUDED
+
+#include "Object.h"
+#include "MeshObject.h"
+#include "BVH.h"
+#include "Matrix4x4.h"
+
+/*
+    A mesh in its own (object) space together with the bottom level BVH
+    over its triangles. Every Instance of the mesh references the same
+    SharedMesh, so the triangles and the BVH exist only once no matter how
+    many copies of the model are in the scene.
+*/
+class SharedMesh
+{
+public:
+    SharedMesh(TriangleMesh * m);
+
+    //Builds the BVH, only the first call does anything
+    void preCalc();
+
+    //Updates the BVH after vertices of the mesh moved (see BVH::refit).
+    //Call it once before Scene::refit, not once per instance.
+    void refit();
+
+    //Spatial splits and builder of the BVH of the mesh, set before preCalc
+    void setSpatialSplits(bool enable) { m_bvh.setSpatialSplits(enable); }
+    void setBuilder(BVH::Builder builder) { m_bvh.setBuilder(builder); }
+    //File the BVH of the mesh is cached in (see BVH::setCacheFile)
+    void setCacheFile(const std::string& file) { m_bvh.setCacheFile(file); }
+
+    bool intersect(HitInfo& result, const Ray& ray, float tMin, float tMax) const
+        { return m_bvh.intersect(result, ray, tMin, tMax); }
+
+    MeshObject* getObject() { return &m_object; }
+
+protected:
+    MeshObject m_object;
+    Objects m_objects;
+    BVH m_bvh;
+    bool m_built;
+};
+
+/*
+    A copy of a SharedMesh placed in the scene with a transform. The scene
+    BVH is the top level over the instances and other objects, a ray that
+    reaches an instance is transformed into object space and traced through
+    the bottom level BVH of the mesh.
+*/
+class Instance : public Object
+{
+public:
+    Instance(SharedMesh * mesh, const Matrix4x4& transform);
+
+    //Moves the instance, followed by Scene::refit
+    void setTransform(const Matrix4x4& transform);
+    const Matrix4x4& getTransform() const { return m_transform; }
+    SharedMesh* getMesh() const { return m_mesh; }
+
+    //World space bounds of the transformed bounding box of the mesh
+    virtual Vector3 coordsMin() const { return m_cachedMin; }
+    virtual Vector3 coordsMax() const { return m_cachedMax; }
+    virtual Vector3 center() const { return (m_cachedMin + m_cachedMax) / 2; }
+
+    virtual float getArea(const Vector3& lightPos);
+    virtual Vector3 samplePosition() const;
+
+    virtual void preCalc();
+    virtual void renderGL();
+
+    virtual bool intersect(HitInfo& result, const Ray& ray,
+                           float tMin = 0.0f, float tMax = MIRO_TMAX);
+    virtual tex_coord2d_t primitiveUVCoordinates(unsigned int primitive, const Vector3 & xyz) const;
+
+protected:
+    SharedMesh* m_mesh;
+    Matrix4x4 m_transform;         //Object to world space
+    Matrix4x4 m_inverse;           //World to object space
+    Matrix4x4 m_normalTransform;   //Inverse transpose, for the normals
+    Vector3 m_cachedMin, m_cachedMax;
+};
+
+#endif // CSE168_INSTANCE_H_INCLUDED
@@ -0,0 +1,91 @@
+#include "Integrator.h"
+#include <cstring>
+#include "assignment3.h"
+#include "Camera.h"
+#include "Image.h"
+#include "Scene.h"
+#include "PScene.h"
+
+namespace
+{
+
+//Trace the scene with its own renderer, which is the path tracer of Scene
+//or progressive photon mapping of ProgressiveScene
+template <class SceneType>
+class SceneIntegrator : public Integrator
+{
+public:
+    Scene* createScene() { return new SceneType; }
+
+    void render()
+    {
+        g_camera->setRenderer(Camera::RENDER_RAYTRACE);
+        g_camera->click(g_scene, g_image);
+    }
+};
+
+//Trace the global and caustic photon maps first, then render with the
+//path tracer, which takes the light at diffuse hits from the maps
+class GlobalPhotonMapIntegrator : public Integrator
+{
+public:
+    void render()
+    {
+        g_scene->generatePhotonMap();
+        g_camera->setRenderer(Camera::RENDER_RAYTRACE);
+        g_camera->click(g_scene, g_image);
+    }
+};
+
+//The assignment 3 renderers are plain functions
+template <void (*Render)()>
+class FunctionIntegrator : public Integrator
+{
+public:
+    void render() { Render(); }
+};
+
+template <class T>
+Integrator* make() { return new T; }
+
+struct Entry
+{
+    const char* name;
+    const char* description;
+    Integrator* (*create)();
+};
+
+const Entry integrators[] =
+{
+    { "pathtrace", "path tracing", make<SceneIntegrator<Scene> > },
+    { "photonmap", "progressive photon mapping", make<SceneIntegrator<ProgressiveScene> > },
+    { "photonmap-global", "global and caustic photon maps, estimated at the first diffuse hit", make<GlobalPhotonMapIntegrator> },
+    { "metropolis", "Metropolis light transport, one chain per thread", make<FunctionIntegrator<a3task3> > },
+    { "bidirectional-metropolis", "Metropolis light transport on bidirectional paths", make<FunctionIntegrator<a3hacker1> > },
+    { "bdpt", "progressive bidirectional path tracing", make<FunctionIntegrator<a3bdpt> > },
+};
+
+const int nIntegrators = sizeof(integrators)/sizeof(integrators[0]);
+
+}
+
+Scene* Integrator::createScene()
+{
+    return new Scene;
+}
+
+Integrator* Integrator::create(const char* name)
+{
+    for (int i = 0; i < nIntegrators; i++)
+    {
+        if (strcmp(integrators[i].name, name) == 0)
+            return integrators[i].create();
+    }
+    return 0;
+}
+
+void Integrator::list(std::ostream& out)
+{
+    for (int i = 0; i < nIntegrators; i++)
+        out << "  " << integrators[i].name << ": " << integrators[i].description << std::endl;
+}
@@ -0,0 +1,31 @@
+#ifndef __INTEGRATOR_H__
+#define __INTEGRATOR_H__
+
+#include <iostream>
+
+class Scene;
+
+//A way of rendering the task 3 scene into g_image without a window.
+//
+//The integrators are kept in a table in Integrator.cpp and are picked by
+//name at run time (main: -integrator <name>), so one build can run all of
+//them.
+class Integrator
+{
+public:
+    virtual ~Integrator() {}
+
+    //The scene to build for this integrator, g_scene is set to it before
+    //the scene is made. Progressive photon mapping has its own.
+    virtual Scene* createScene();
+
+    virtual void render() = 0;
+
+    //The integrator with the given name, or 0. Delete when done.
+    static Integrator* create(const char* name);
+
+    //Print the names and descriptions of all integrators
+    static void list(std::ostream& out);
+};
+
+#endif
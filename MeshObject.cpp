@@ -0,0 +1,92 @@
+#include "MeshObject.h"
+#include "Ray.h"
+#include "Utility.h"
+
+MeshObject::MeshObject(TriangleMesh * m) :
+    m_mesh(m)
+{
+
+}
+
+MeshObject::~MeshObject()
+{
+
+}
+
+void MeshObject::preCalc()
+{
+    m_cachedMin = Vector3(infinity);
+    m_cachedMax = Vector3(-infinity);
+
+    for (int i = 0; i < m_mesh->numTris(); i++)
+    {
+        Vector3 tmin = m_mesh->triangleMin(i), tmax = m_mesh->triangleMax(i);
+        for (int j = 0; j < 3; j++)
+        {
+            if (tmin[j] < m_cachedMin[j]) m_cachedMin[j] = tmin[j];
+            if (tmax[j] > m_cachedMax[j]) m_cachedMax[j] = tmax[j];
+        }
+    }
+}
+
+float MeshObject::getArea(const Vector3& lightPos)
+{
+    return getProjectedBoxArea(m_cachedMin, m_cachedMax, lightPos);
+}
+
+Vector3 MeshObject::samplePosition() const
+{
+    int tri = std::min((int)(frand()*m_mesh->numTris()), m_mesh->numTris()-1);
+
+    float u1 = frand();
+    float beta = 1.0f - sqrt(u1);
+    float gamma = sqrt(frand()) * u1;
+
+    TriangleMesh::TupleI3 ti3 = m_mesh->vIndices()[tri];
+    Vector3 verts[3] = {m_mesh->vertices()[ti3.v[0]], m_mesh->vertices()[ti3.v[1]], m_mesh->vertices()[ti3.v[2]]};
+    Vector3 BmA = (verts[1]-verts[0]), CmA = (verts[2]-verts[0]);
+
+    return (verts[0] + beta * BmA + gamma * CmA);
+}
+
+void
+MeshObject::renderGL()
+{
+#ifndef NO_GFX
+    glBegin(GL_TRIANGLES);
+    for (int i = 0; i < m_mesh->numTris(); i++)
+    {
+        TriangleMesh::TupleI3 ti3 = m_mesh->vIndices()[i];
+        for (int k = 0; k < 3; k++)
+        {
+            const Vector3 & v = m_mesh->vertices()[ti3.v[k]];
+            glVertex3f(v.x, v.y, v.z);
+        }
+    }
+    glEnd();
+#endif
+}
+
+bool
+MeshObject::intersect(HitInfo& result, const Ray& r, float tMin, float tMax)
+{
+    bool hit = false;
+    for (int i = 0; i < m_mesh->numTris(); i++)
+    {
+        if (m_mesh->intersectTriangle(i, result, r, tMin, tMax))
+        {
+            hit = true;
+            tMax = result.t;
+            result.primitive = i;
+        }
+    }
+
+    if (hit) result.material = m_material;
+
+    return hit;
+}
+
+tex_coord2d_t MeshObject::primitiveUVCoordinates(unsigned int primitive, const Vector3 & xyz) const
+{
+    return m_mesh->triangleUVCoordinates(primitive, xyz);
+}
@@ -0,0 +1,46 @@
+#ifndef CSE168_MESH_OBJECT_H_INCLUDED
+#define CSE168_MESH_OBJECT_H_INCLUDED
+
+#include "TriangleMesh.h"
+#include "Object.h"
+
+/*
+    A MeshObject adds a whole triangle mesh to the scene with one
+    material. The BVH does not see it as a single object but indexes
+    its triangles directly by (mesh, triangle index), so a mesh with
+    millions of faces does not need a Triangle object for each of them.
+    HitInfo::primitive tells which triangle was hit.
+*/
+class MeshObject : public Object
+{
+public:
+    MeshObject(TriangleMesh * m = 0);
+    virtual ~MeshObject();
+
+    //Object boundaries used with bounding box creation
+    virtual Vector3 coordsMin() const { return m_cachedMin; }
+    virtual Vector3 coordsMax() const { return m_cachedMax; }
+    virtual Vector3 center() const { return (m_cachedMin + m_cachedMax) / 2; }
+
+    //Projected area of the bounding box and a position on a random triangle
+    virtual float getArea(const Vector3& lightPos);
+    virtual Vector3 samplePosition() const;
+
+    virtual void preCalc();
+
+    void setMesh(TriangleMesh* m) { m_mesh = m; }
+    TriangleMesh* getMesh() const { return m_mesh; }
+
+    virtual void renderGL();
+
+    //Tests all triangles. Only used when the mesh is not in a BVH.
+    virtual bool intersect(HitInfo& result, const Ray& ray,
+                           float tMin = 0.0f, float tMax = MIRO_TMAX);
+    virtual tex_coord2d_t primitiveUVCoordinates(unsigned int primitive, const Vector3 & xyz) const;
+
+protected:
+    TriangleMesh* m_mesh;
+    Vector3 m_cachedMin, m_cachedMax;
+};
+
+#endif // CSE168_MESH_OBJECT_H_INCLUDED
@@ -6,8 +6,9 @@
 #endif
 
 
-#define W 512
-#define H 512
+//Resolution used when none is given on the command line
+const int DEFAULT_WIDTH = 512;
+const int DEFAULT_HEIGHT = 512;
 
 const float MIRO_TMAX = 1e12f;
 const float epsilon   = 1e-4f;
@@ -36,6 +36,9 @@ public:
 	//Returns the (u,v) coordinates corresponding to a (x,y,z) coordinate.
 	virtual tex_coord2d_t toUVCoordinates(const Vector3 & xyz) const { return tex_coord2d_t(xyz.x, xyz.z); }
 
+	//Same as above for a hit on one primitive of the object, like a triangle of a mesh (see HitInfo::primitive).
+	virtual tex_coord2d_t primitiveUVCoordinates(unsigned int primitive, const Vector3 & xyz) const { return toUVCoordinates(xyz); }
+
 
     virtual bool intersect(HitInfo& result, const Ray& ray,
                            float tMin = 0.0f, float tMax = MIRO_TMAX) = 0;
@@ -1,5 +1,3 @@
-#ifdef PHOTON_MAPPING
-
 #include <fstream>
 #include <sstream>
 #include "Utility.h"
@@ -12,6 +10,7 @@
 #include "Console.h"
 #include "Sphere.h"
 #include "SquareLight.h"
+#include "ErrorTracker.h"
 
 #ifdef STATS
 #include "Stats.h"
@@ -37,59 +36,13 @@
 
 using namespace std;
 
-Scene * g_scene = 0;
-
-void
-Scene::openGL(Camera *cam)
-{
-#ifndef NO_GFX
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    cam->drawGL();
-
-    // draw objects
-    for (size_t i = 0; i < m_objects.size(); ++i)
-        m_objects[i]->renderGL();
-
-    glutSwapBuffers();
-#endif
-}
-
-void
-Scene::preCalc()
-{
-    debug("Precalcing objects\n");
-    double t1 = -getTime();
-    Objects::iterator it;
-    for (it = m_objects.begin(); it != m_objects.end(); it++)
-    {
-        Object* pObject = *it;
-        pObject->preCalc();
-    }
-    Lights::iterator lit;
-    for (lit = m_lights.begin(); lit != m_lights.end(); lit++)
-    {
-        PointLight* pLight = *lit;
-        pLight->preCalc();
-    }
-    t1 += getTime();
-    debug("Time spent preprocessing objects and lights: %lf\n", t1);
-    
-    debug("Building BVH...\n");
-    t1 = -getTime();
-    m_bvh.build(&m_objects);
-    t1 += getTime();
-    debug("Done building BVH. Time spent: %lf\n", t1);
-
-}
-
 inline float tonemapValue(float value)
 {
     return max(min(pow((double)value, 1./2.2), 1.), 0.);
 }
 
 void
-Scene::raytraceImage(Camera *cam, Image *img)
+ProgressiveScene::raytraceImage(Camera *cam, Image *img)
 {
 	int depth = TRACE_DEPTH;
 
@@ -100,6 +53,9 @@ Scene::raytraceImage(Camera *cam, Image *img)
     int width = img->width(), height = img->height();
     Vector3 *tempImage = new Vector3[height*width];
 
+    //One measurement point per pixel
+    m_pointMap.reserve(width*height);
+
     double t1 = -getTime();
 
     // loop over all pixels in the image
@@ -140,6 +96,7 @@ Scene::raytraceImage(Camera *cam, Image *img)
     t1 = -getTime();
 	AdaptivePhotonPasses();
     t1 += getTime();
+    debug("Stored %d measurement points. Peak memory after photon tracing: %.1f MB\n", m_pointMap.size(), getPeakMemory());
 
 	RenderPhotonStats(tempImage, width, height);
 
@@ -151,7 +108,6 @@ Scene::raytraceImage(Camera *cam, Image *img)
         {
             Vector3 finalColor = tempImage[i*width+j];
 
-            #pragma unroll(3)
             for (int k = 0; k < 3; k++)
             {
                 if (finalColor[k] != finalColor[k])
@@ -178,65 +134,7 @@ Scene::raytraceImage(Camera *cam, Image *img)
 #endif
 }
 
-bool
-Scene::trace(HitInfo& minHit, const Ray& ray, float tMin, float tMax) const
-{
-    bool result = m_bvh.intersect(minHit, ray, tMin, tMax);
-    
-    //Trace the unbounded objects (like planes)
-    for (int i = 0; i < m_unboundedObjects.size(); i++)
-    {
-        HitInfo tempMinHit;
-        bool ubresult = m_unboundedObjects[i]->intersect(tempMinHit, ray, tMin, tMax);
-        if (ubresult && (!result || tempMinHit.t < minHit.t))
-        {
-            result = true;
-            minHit = tempMinHit;
-            minHit.object = m_unboundedObjects[i];
-        }
-    }
-
-	minHit.P -= ray.d*epsilon;
-
-    if (result)
-    {
-        //Bump mapping
-        float delta = 0.0001;
-//        printf("object %p, material from %p\n", minHit.object, minHit.material);
-
-        if (minHit.material->GetLookupCoordinates() == UV)
-        {
-            //Take a few samples to calculate the derivative
-            tex_coord2d_t center = minHit.object->toUVCoordinates(minHit.P);
-            float u = center.u, v = center.v;
-            float u1 = minHit.material->bumpHeight2D(tex_coord2d_t(u-delta, v)), 
-                  u2 = minHit.material->bumpHeight2D(tex_coord2d_t(u+delta, v)),
-                  v1 = minHit.material->bumpHeight2D(tex_coord2d_t(u, v-delta)),
-                  v2 = minHit.material->bumpHeight2D(tex_coord2d_t(u, v+delta));
-                  
-            //Approximate derivatives using central finite differences
-            float dx = (u2-u1)/(2*delta),
-                  dy = (v2-v1)/(2*delta);
-            
-            //Find two tangents
-            float n[3] = { minHit.N.x, minHit.N.y, minHit.N.z };
-
-            int m = 0;
-            if (n[1] > n[0]) m = 1;
-            if (n[2] > n[m]) m = 2;
-            Vector3 randomVec(m == 2 ? -n[2] : 0, m == 0 ? -n[0] : 0, m == 1 ? -n[1] : 0);
-           
-            Vector3 t1 = cross(minHit.N, randomVec);
-            minHit.N += dx*(cross(minHit.N, t1))-dy*(cross(minHit.N, cross(minHit.N, t1)));
-            minHit.N.normalize();
-        }   
-        //Todo: implement for 3D
-        //bumpHeight = minHit.material->bumpHeight3D(tex_coord3d_t(minHit.P.x, minHit.P.y, minHit.P.z));
-    }
-    return result;
-}
-
-bool Scene::traceScene(const Ray& ray, Vector3 contribution, int depth, int x, int y)
+bool ProgressiveScene::traceScene(const Ray& ray, Vector3 contribution, int depth, int x, int y)
 {
     HitInfo hitInfo;
     bool hit = false;
@@ -252,7 +150,7 @@ bool Scene::traceScene(const Ray& ray, Vector3 contribution, int depth, int x, i
 			//if diffuse material, send trace with RandomRay generate by Monte Carlo
 			if (hitInfo.material->isDiffuse())
 			{
-				g_scene->addPoint(hitInfo.P, hitInfo.N, ray.d, contribution.average(), INITIAL_RADIUS, false, x, y);
+				addPoint(hitInfo.P, hitInfo.N, ray.d, contribution.average(), INITIAL_RADIUS, false, x, y);
 			}
 			
 			//if reflective material, send trace with ReflectRay
@@ -282,8 +180,8 @@ bool Scene::traceScene(const Ray& ray, Vector3 contribution, int depth, int x, i
 			if (l != NULL)
 			{
 				//this means we hit an emissive material (light), so create a default measurement point
-				g_scene->addPoint(Vector3(0.f), Vector3(0.f), Vector3(0.f), 0.f, 0.f, true, x, y);
-                g_scene->m_Points.back()->accFlux = l->radiance(hitInfo.P, ray.d)*contribution.average();
+				addPoint(Vector3(0.f), Vector3(0.f), Vector3(0.f), 0.f, 0.f, true, x, y);
+                m_Points.back()->accFlux = l->radiance(hitInfo.P, ray.d)*contribution.average();
 			}
 		}
 	}
@@ -335,10 +233,10 @@ Path MutatePath(const Path& goodPath, const float MutationSize)
 	return mutatedPath;
 }
 
-bool Scene::UpdateMeasurementPoints(const Vector3& pos, const Vector3& normal, const Vector3& power)
+bool ProgressiveScene::UpdateMeasurementPoints(const Vector3& pos, const Vector3& normal, const Vector3& power)
 {
 	bool hit = false;
-    const int npoints = W*H;
+    const int npoints = m_pointMap.size();
 
 	NearestPoints np;
 
@@ -389,10 +287,10 @@ bool Scene::UpdateMeasurementPoints(const Vector3& pos, const Vector3& normal, c
 	return hit;
 }
 
-void Scene::UpdatePhotonStats()
+void ProgressiveScene::UpdatePhotonStats()
 {
 	max_radius = 0.f;
-	for (int n = 0; n < m_Points.size(); ++n)
+	for (int n = 0; n < (int)m_Points.size(); ++n)
 	{
 		Point *hp = m_Points[n];
 		if (hp->bLight)
@@ -405,9 +303,8 @@ void Scene::UpdatePhotonStats()
 		if(hp->newPhotons == 0)
 			continue;
 
-        double f_alpha = (long double)hp->accPhotons*5e-6;
-
         float alpha = PHOTON_ALPHA;
+//        double f_alpha = (long double)hp->accPhotons*5e-6;
 //        float alpha = PHOTON_ALPHA + (1.-PHOTON_ALPHA)*(1.-exp(-f_alpha));
 
         // Set scaling factor for next photon pass
@@ -451,7 +348,7 @@ void Scene::UpdatePhotonStats()
 	}
 }
 
-void Scene::RenderPhotonStats(Vector3 *tempImage, const int width, const int height)
+void ProgressiveScene::RenderPhotonStats(Vector3 *tempImage, const int width, const int height)
 {
 	// initialize for now
     for (int i = 0; i < height; ++i)
@@ -463,14 +360,14 @@ void Scene::RenderPhotonStats(Vector3 *tempImage, const int width, const int hei
 	}
 
 	int n;
-	for (n = 0; n <  m_Points.size(); ++n)
+	for (n = 0; n < (int)m_Points.size(); ++n)
 	{
 		Point *hp = m_Points[n];
 
 		if (hp->bLight)
 		{
-            if (hp->i >= 0 && hp->j >= 0)
-    			tempImage[hp->i*width+hp->j] = hp->accFlux;
+			if (hp->i >= 0 && hp->j >= 0)
+				tempImage[hp->i*width+hp->j] = hp->accFlux;
 			continue;
 		}
 
@@ -502,10 +399,11 @@ void Scene::RenderPhotonStats(Vector3 *tempImage, const int width, const int hei
 	cout << "Average Radiance: " << sum/(double)(width*height) << endl;
 }
 
-void Scene::AdaptivePhotonPasses()
+void ProgressiveScene::AdaptivePhotonPasses()
 {
-    Vector3* ptracing_results = new Vector3[W*H];
-    Vector3* tempImage = new Vector3[W*H];
+    const int width = g_image->width(), height = g_image->height();
+    Vector3* ptracing_results = new Vector3[width*height];
+    Vector3* tempImage = new Vector3[width*height];
     stringstream msq_out;
 
     //Record the error after every this many samples
@@ -521,38 +419,18 @@ void Scene::AdaptivePhotonPasses()
 
     {
         //Load image from task 1
-        ifstream ptracing;
         char filename[100];
-        sprintf(filename, "pathtracing_%s.raw\0", version);
-        ptracing.open(filename, ios::binary);
-
-        int w_pt, h_pt;
-        long double b_pt = 0;
-        if (!ptracing.is_open())
-        {
-            w_pt = W; h_pt = H;
-        }
-        ptracing.read((char*)&w_pt, 4);
-        ptracing.read((char*)&h_pt, 4);
-        cout << "Loading path tracing results [width=" << w_pt << ", height " << h_pt << "]" << endl;
+        sprintf(filename, "pathtracing_%s.raw", version);
+        loadReferenceImage(filename, width, height, ptracing_results);
+    }
 
-        for (int i = 0; i < h_pt; i++)
+    ErrorTracker error(width, height);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
         {
-            for (int j = 0; j < w_pt; j++)
-            {
-                Vector3 pix(0);
-                if (ptracing.is_open())
-                {
-                    ptracing.read((char*)&pix.x, sizeof(float));
-                    ptracing.read((char*)&pix.y, sizeof(float));
-                    ptracing.read((char*)&pix.z, sizeof(float));
-                }
-                b_pt += pix.average();
-                ptracing_results[i*W+j] = pix;
-            }
+            error.setReference(x, y, ptracing_results[x+y*width]);
         }
-        b_pt /= (long double)(w_pt*h_pt);
-        cout << "Done reading path tracing results. b = " << b_pt << endl;
     }
 
 	PointLight *light = m_lights[0];
@@ -575,7 +453,7 @@ void Scene::AdaptivePhotonPasses()
         goodPath.Origin = light->samplePhotonOrigin();
         goodPath.Direction = light->samplePhotonDirection();
 //        cout << goodPath.Origin << " " << goodPath.Direction << endl;
-	} while (tracePhoton(goodPath, goodPath.Origin, goodPath.Direction, power, 0) == 0);
+	} while (tracePhoton(goodPath, goodPath.emissionRay(), power, 0) == 0);
 
     cout << "Found a good path." << endl;
 
@@ -608,22 +486,20 @@ void Scene::AdaptivePhotonPasses()
         {
             long i = m_photonsEmitted+1;
             printf("\n");
-            RenderPhotonStats(tempImage, W, H);
+            RenderPhotonStats(tempImage, width, height);
 
-            msq = 0;
-            bool writeImage = false;
-            if (i == 100000 || i == 1000000 || i % 10000000 == 0 || i == 100000000)
-                writeImage = true;
+            //Every pixel changes with the radii, so the error is computed in one pass
+            msq = error.compute(tempImage);
+            msq_out << msq << endl;
 
-            for (int y = 0; y < H; y++)
+            if (i == 100000 || i == 1000000 || i % 10000000 == 0 || i == 100000000)
             {
-                for (int x = 0; x < W; x++)
+                for (int y = 0; y < height; y++)
                 {
-                    Vector3 result = tempImage[x+y*W];
-                    msq += pow((ptracing_results[x+y*W] - result).average(), 2);
-
-                    if (writeImage)
+                    for (int x = 0; x < width; x++)
                     {
+                        Vector3 result = tempImage[x+y*width];
+
                         //Gamma correct
                         for (int i = 0; i < 3; i++)
                         {
@@ -632,16 +508,10 @@ void Scene::AdaptivePhotonPasses()
                         g_image->setPixel(x,y,result);
                     }
                 }
-            }
 
-            msq /= (double)(W*H);
-            msq_out << msq << endl;
-
-            if (writeImage)
-            {
                 char filename[100];
 
-                sprintf(filename, "adaptiveppm_%s_%ld.ppm\0", version, i);
+                sprintf(filename, "adaptiveppm_%s_%ld.ppm", version, i);
                 cout << "Writing " << filename << "..." << endl;
                 g_image->writePPM(filename);
             }
@@ -649,7 +519,7 @@ void Scene::AdaptivePhotonPasses()
     
         //Test random photon path
         Path uniformPath(light->samplePhotonOrigin(), light->samplePhotonDirection());
-		if (tracePhoton(uniformPath, uniformPath.Origin, uniformPath.Direction, power, 0) > 0)
+		if (tracePhoton(uniformPath, uniformPath.emissionRay(), power, 0) > 0)
 		{
 			goodPath = uniformPath;
 			++m_photonsUniform;
@@ -666,14 +536,14 @@ void Scene::AdaptivePhotonPasses()
 		prev_di = di;
 
 		// Test mutated photon path
-		if (tracePhoton(mutatedPath, mutatedPath.Origin, mutatedPath.Direction, power, 0) > 0)
+		if (tracePhoton(mutatedPath, mutatedPath.emissionRay(), power, 0) > 0)
 		{
 			goodPath = mutatedPath;
 			++accepted;
 			continue;
 		}
 		// Reuse good path
-		tracePhoton(goodPath, goodPath.Origin, goodPath.Direction, power, 0);
+		tracePhoton(goodPath, goodPath.emissionRay(), power, 0);
     }
 
 	UpdatePhotonStats();
@@ -682,7 +552,7 @@ void Scene::AdaptivePhotonPasses()
     {
         ofstream msq_outfile;
         char filename[100];
-        sprintf(filename, "adaptiveppm_%s_msq.dat\0", version);
+        sprintf(filename, "adaptiveppm_%s_msq.dat", version);
         msq_outfile.open(filename);
         msq_outfile << msq_out.str().c_str();
     }
@@ -692,13 +562,11 @@ void Scene::AdaptivePhotonPasses()
 }
 
 //Trace a single photon through the scene
-int Scene::tracePhoton(const Path& path, const Vector3& position, const Vector3& direction, const Vector3& power, int depth)
+int ProgressiveScene::tracePhoton(const Path& path, const Ray& ray, const Vector3& power, int depth)
 {
     if (depth >= TRACE_DEPTH_PHOTONS) return 0;
-    PHOTON_DEBUG(endl << "tracePhoton(): pos " << position << ", dir " << direction << ", pwr " << power << ", depth " << depth);
+    PHOTON_DEBUG(endl << "tracePhoton(): pos " << ray.o << ", dir " << ray.d << ", pwr " << power << ", depth " << depth);
 
-    //Create a ray to trace the scene with
-    Ray ray(position+epsilon*direction, direction);
     HitInfo hit;
 
 	++depth;
@@ -715,7 +583,7 @@ int Scene::tracePhoton(const Path& path, const Vector3& position, const Vector3&
         float prob[3], rnd = frand();
         Vector3 diffuseColor;
         if (hit.material->GetLookupCoordinates() == UV)
-            diffuseColor = hit.material->diffuse2D(hit.object->toUVCoordinates(hit.P));
+            diffuseColor = hit.material->diffuse2D(hit.object->primitiveUVCoordinates(hit.primitive, hit.P));
         else
             diffuseColor = hit.material->diffuse3D(tex_coord3d_t(hit.P.x, hit.P.y, hit.P.z));
 
@@ -753,7 +621,7 @@ int Scene::tracePhoton(const Path& path, const Vector3& position, const Vector3&
             r.isDiffuse = true;
             HitInfo diffHit;
             PHOTON_DEBUG("Tracing diffuse photon");
-            return nPhotons + tracePhoton(path, r.o, r.d, diffuseColor*power/prob[0], depth);
+            return nPhotons + tracePhoton(path, Ray(offsetRayOrigin(hit.P, hit.Ng, r.d), r.d), diffuseColor*power/prob[0], depth);
         }
         else if (rnd < prob[1])
         {
@@ -764,7 +632,7 @@ int Scene::tracePhoton(const Path& path, const Vector3& position, const Vector3&
             //Reflect.
             Ray refl = ray.reflect(hit);
             PHOTON_DEBUG("Tracing reflected photon");
-            return tracePhoton(path, hit.P, refl.d, power, depth);
+            return tracePhoton(path, refl, power, depth);
         }
         else if (rnd < prob[2])
         {
@@ -780,13 +648,13 @@ int Scene::tracePhoton(const Path& path, const Vector3& position, const Vector3&
 			{
                 Ray refl = ray.reflect(hit);
                 PHOTON_DEBUG("Tracing reflected photon (Fresnel reflection)");
-                return tracePhoton(path, hit.P, refl.d, power, depth);
+                return tracePhoton(path, refl, power, depth);
 			}
 			else
 			{
                 Ray refr = ray.refract(hit);
                 PHOTON_DEBUG("Tracing refracted photon");
-                return tracePhoton(path, hit.P, refr.d, power, depth);
+                return tracePhoton(path, refr, power, depth);
             }
         }
     }
@@ -795,37 +663,3 @@ int Scene::tracePhoton(const Path& path, const Vector3& position, const Vector3&
 #   endif
 	return 0;
 }
-
-Vector3
-Scene::getEnvironmentMap(const Ray & ray)
-{
-	Vector3 envResult;
-	//Environment mapping here
-	if (m_environment != 0)
-	{
-		tex_coord2d_t coords;
-		float phi = atan2(ray.d.x, ray.d.z) + m_environmentRotation.x + PI; //Phi is in [0, 2PI]
-		float theta = asin(ray.d.y) + m_environmentRotation.y;    //
-        if (theta > PI/2.0f) 
-        {
-            phi += PI;
-            theta -= 2.0f*(theta-PI/2.0f);
-        }
-		if (phi > 2.0f*PI) phi -= (2.0f*PI); // Force phi to be in [0, 2PI]
-	
-		//Calculate texture coordinates for where the ray hits the "sphere"
-		coords.u = phi / (2.0f * PI);
-		coords.v = theta / PI + 0.5;
-		//And just look up the shading value in the texture.
-        if (!ray.isDiffuse)
-    		envResult = m_environment->lookup2D(coords);
-        else
-            envResult = m_environment->lowresLookup2D(coords);
-	}
-	else
-	{
-		envResult = m_bgColor; 
-	}
-	return envResult;
-}
-#endif
@@ -1,11 +1,7 @@
 #include <iostream>
 #include "Phong.h"
 #include "Ray.h"
-#ifdef PHOTON_MAPPING
-#include "PScene.h"
-#else
 #include "Scene.h"
-#endif
 #include "DirectionalAreaLight.h"
 #ifdef STATS
 #include "Stats.h"
@@ -56,7 +52,7 @@ Phong::shade(const Ray &ray, const HitInfo &hit, const Scene &scene) const
 		//Look up the diffuse color
 	Vector3 diffuseColor;
 	if (GetLookupCoordinates() == UV)
-		diffuseColor = diffuse2D(hit.object->toUVCoordinates(hit.P));
+		diffuseColor = diffuse2D(hit.object->primitiveUVCoordinates(hit.primitive, hit.P));
 	else
 		diffuseColor = diffuse3D(tex_coord3d_t(hit.P.x, hit.P.y, hit.P.z));
 
@@ -94,7 +90,7 @@ Phong::shade(const Ray &ray, const HitInfo &hit, const Scene &scene) const
 
             // No light contribution if Ray hits an object 
 #if ! defined (DISABLE_SHADOWS) && ! defined (VISUALIZE_PHOTON_MAP)
-            Ray Shadow(hit.P+(l*epsilon), l);
+            Ray Shadow(offsetRayOrigin(hit.P, hit.Ng, l), l);
             HitInfo hitInfo;
 #ifdef STATS 
             Stats::Shadow_Rays++;
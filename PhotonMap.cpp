@@ -10,7 +10,23 @@
 #include <string.h>
 #include <math.h>
 #include "PhotonMap.h"
+#include "SSE.h"
+#ifdef __AVX__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef PHOTON_BENCHMARK
+#include "Utility.h"
+#endif
 #include <iostream>
+#include <algorithm>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -20,25 +36,36 @@ using namespace std;
 
 /* This is the constructor for the photon map.
  * To create the photon map it is necessary to specify the
- * maximum number of photons that will be stored
+ * maximum number of photons that will be stored. Memory is
+ * only allocated as photons are stored.
 */
 //************************************************
 Photon_map :: Photon_map( const int max_phot )
 //************************************************
 {
   stored_photons = 0;
+  half_stored_photons = 0;
   prev_scale = 1;
   max_photons = max_phot;
+  allocated_photons = 0;
 
-  photons = (Photon*)malloc( sizeof( Photon ) * ( max_photons+1 ) );
-
-  if (photons == NULL) {
-    fprintf(stderr,"Out of memory initializing photon map\n");
-    exit(-1);
-  }
+  photons = NULL;
+  info = NULL;
 
   bbox_min[0] = bbox_min[1] = bbox_min[2] = 1e8f;
   bbox_max[0] = bbox_max[1] = bbox_max[2] = -1e8f;
+
+  bucket_base = 1;
+  bucket_slots = 0;
+  bucket_offset = 0;
+  bucket_photon = 0;
+  bucket_pos[0] = bucket_pos[1] = bucket_pos[2] = 0;
+  bucket_data = 0;
+
+  mapping = 0;
+  mapping_size = 0;
+
+  irradiance_map = 0;
   
   //----------------------------------------
   // initialize direction conversion tables
@@ -51,6 +78,14 @@ Photon_map :: Photon_map( const int max_phot )
     cosphi[i]   = cos( 2.0*angle );
     sinphi[i]   = sin( 2.0*angle );
   }
+
+  //-------------------------------------
+  // initialize power conversion table
+  //-------------------------------------
+
+  rgbe_scale[0] = 0.0f;
+  for (int i=1; i<256; i++)
+    rgbe_scale[i] = (float)ldexp( 1.0, i-(128+8) );
 }
 
 
@@ -58,7 +93,16 @@ Photon_map :: Photon_map( const int max_phot )
 Photon_map :: ~Photon_map()
 //*************************
 {
-  free( photons );
+  free_buckets();
+  if (mapping) {
+#ifndef WIN32
+    munmap( mapping, mapping_size );
+#endif
+  } else {
+    free( photons );
+    free( info );
+  }
+  delete irradiance_map;
 }
 
 
@@ -68,9 +112,23 @@ Photon_map :: ~Photon_map()
 void Photon_map :: photon_dir( float *dir, const Photon *p ) const
 //*****************************************************************
 {
-  dir[0] = sintheta[p->theta]*cosphi[p->phi];
-  dir[1] = sintheta[p->theta]*sinphi[p->phi];
-  dir[2] = costheta[p->theta];
+  const Photon_info *i = &info[ p-photons ];
+  dir[0] = sintheta[i->theta]*cosphi[i->phi];
+  dir[1] = sintheta[i->theta]*sinphi[i->phi];
+  dir[2] = costheta[i->theta];
+}
+
+
+/* photon_power returns the power of a photon
+ */
+//*******************************************************************
+void Photon_map :: photon_power( float *power, const Photon *p ) const
+//*******************************************************************
+{
+  const float scale = rgbe_scale[ p->power[3] ];
+  power[0] = (p->power[0]+0.5f)*scale;
+  power[1] = (p->power[1]+0.5f)*scale;
+  power[2] = (p->power[2]+0.5f)*scale;
 }
 
 
@@ -100,7 +158,7 @@ int Photon_map :: irradiance_estimate(
   np.dist2[0] = max_dist*max_dist;
 
   // locate the nearest photons
-  locate_photons( &np, 1, normal);
+  locate_nearest_photons( &np, normal );
 
   // if less than 8 photons return
   /*if (np.found<8)
@@ -121,9 +179,11 @@ int Photon_map :: irradiance_estimate(
     cout << "dot " << pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2] << endl;}*/
     //TODO: Figure out what causes this check to fail when it shouldn't
     //if ( (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) < 0.0f ) {
-      irrad[0] += p->power[0];
-      irrad[1] += p->power[1];
-      irrad[2] += p->power[2];
+      float power[3];
+      photon_power( power, p );
+      irrad[0] += power[0];
+      irrad[1] += power[1];
+      irrad[2] += power[2];
     //}
    /* else
     {
@@ -147,8 +207,84 @@ int Photon_map :: irradiance_estimate(
 }
 
 
+/* insert_nearest adds a photon to the candidate list in np.
+ * Once the list is full it is kept as a max heap on the
+ * distance, and np->dist2[0] shrinks to the largest distance.
+*/
+//******************************************
+static void insert_nearest(
+  NearestPhotons *const np,
+  const float dist2,
+  const Photon *p )
+//******************************************
+{
+  if ( np->found < np->max ) {
+    // heap is not full; use array
+    np->found++;
+    np->dist2[np->found] = dist2;
+    np->index[np->found] = p;
+  } else {
+    int j,parent;
+
+    if (np->got_heap==0) { // Do we need to build the heap?
+      // Build heap
+      float dst2;
+      const Photon *phot;
+      int half_found = np->found>>1;
+      for ( int k=half_found; k>=1; k--) {
+        parent=k;
+        phot = np->index[k];
+        dst2 = np->dist2[k];
+        while ( parent <= half_found ) {
+          j = parent+parent;
+          if (j<np->found && np->dist2[j]<np->dist2[j+1])
+            j++;
+          if (dst2>=np->dist2[j])
+            break;
+          np->dist2[parent] = np->dist2[j];
+          np->index[parent] = np->index[j];
+          parent=j;
+        }
+        np->dist2[parent] = dst2;
+        np->index[parent] = phot;
+      }
+      np->got_heap = 1;
+
+      // dist2[0] was still the search radius, so the new photon
+      // may be further away than all photons in the heap
+      np->dist2[0] = np->dist2[1];
+      if ( dist2 >= np->dist2[0] )
+        return;
+    }
+
+    // insert new photon into max heap
+    // delete largest element, insert new and reorder the heap
+
+    parent=1;
+    j = 2;
+    while ( j <= np->found ) {
+      if ( j < np->found && np->dist2[j] < np->dist2[j+1] )
+        j++;
+      if ( dist2 > np->dist2[j] )
+        break;
+      np->dist2[parent] = np->dist2[j];
+      np->index[parent] = np->index[j];
+      parent = j;
+      j += j;
+    }
+    np->index[parent] = p;
+    np->dist2[parent] = dist2;
+
+    np->dist2[0] = np->dist2[1];
+  }
+}
+
+
 /* locate_photons finds the nearest photons in the
  * photon map given the parameters in np
+ *
+ * This is the original recursive search. irradiance_estimate
+ * uses locate_nearest_photons instead.
 */
 //******************************************
 void Photon_map :: locate_photons(
@@ -160,7 +296,8 @@ void Photon_map :: locate_photons(
   float dist1;
 
   if (index<half_stored_photons) {
-    dist1 = np->pos[ p->plane ] - p->pos[ p->plane ];
+    const int plane = info[index].plane;
+    dist1 = np->pos[ plane ] - p->pos[ plane ];
 
     if (dist1>0.0) { // if dist1 is positive search right plane
       locate_photons( np, 2*index+1, normal);
@@ -187,61 +324,675 @@ void Photon_map :: locate_photons(
   
   if ( dist2 < np->dist2[0] && (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) < 0.0f) {
     // we found a photon :) Insert it in the candidate list
+    insert_nearest( np, dist2, p );
+  }
+}
 
-    if ( np->found < np->max ) {
-      // heap is not full; use array
-      np->found++;
-      np->dist2[np->found] = dist2;
-      np->index[np->found] = p;
-    } else {
-      int j,parent;
-
-      if (np->got_heap==0) { // Do we need to build the heap?
-        // Build heap
-        float dst2;
-        const Photon *phot;
-        int half_found = np->found>>1;
-        for ( int k=half_found; k>=1; k--) {
-          parent=k;
-          phot = np->index[k];
-          dst2 = np->dist2[k];
-          while ( parent <= half_found ) {
-            j = parent+parent;
-            if (j<np->found && np->dist2[j]<np->dist2[j+1])
-              j++;
-            if (dst2>=np->dist2[j])
-              break;
-            np->dist2[parent] = np->dist2[j];
-            np->index[parent] = np->index[j];
-            parent=j;
-          }
-          np->dist2[parent] = dst2;
-          np->index[parent] = phot;
-        }
-        np->got_heap = 1;
-      }
 
-      // insert new photon into max heap
-      // delete largest element, insert new and reorder the heap
-
-      parent=1;
-      j = 2;
-      while ( j <= np->found ) {
-        if ( j < np->found && np->dist2[j] < np->dist2[j+1] )
-          j++;
-        if ( dist2 > np->dist2[j] )
-          break;
-        np->dist2[parent] = np->dist2[j];
-        np->index[parent] = np->index[j];
-        parent = j;
-        j += j;
+/* Nearest_gather keeps the nphotons closest photons that
+ * arrive at the front side of the surface (or all
+ * directions if there is no normal)
+*/
+//**********************
+struct Nearest_gather {
+//**********************
+  NearestPhotons *np;
+  const float *normal;             // 0 if all directions are accepted
+  const Photon_map *map;
+
+  float bound() const { return np->dist2[0]; }
+
+  void add( const float dist2, const Photon *p ) {
+    if ( dist2 >= np->dist2[0] )
+      return;
+    if ( normal ) {
+      // the direction is only decoded for photons inside the radius
+      float pdir[3];
+      map->photon_dir( pdir, p );
+      if ( (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) >= 0.0f )
+        return;
+    }
+    insert_nearest( np, dist2, p );
+  }
+};
+
+
+/* Radius_gather keeps every photon within a fixed radius
+*/
+//*********************
+struct Radius_gather {
+//*********************
+  float max_dist2;
+  const float *normal;             // 0 if all directions are accepted
+  const Photon_map *map;
+  std::vector<const Photon*> *found;
+
+  float bound() const { return max_dist2; }
+
+  void add( const float dist2, const Photon *p ) {
+    if ( dist2 >= max_dist2 )
+      return;
+    if ( normal ) {
+      float pdir[3];
+      map->photon_dir( pdir, p );
+      if ( (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) >= 0.0f )
+        return;
+    }
+    found->push_back( p );
+  }
+};
+
+
+/* traverse visits the kd-tree without recursion. Nodes above
+ * the buckets are tested one at a time while descending towards
+ * the query, and the far children are kept on an explicit stack
+ * with their distance to the splitting plane. Buckets are
+ * tested four photons at a time with SSE, or eight at a time
+ * with AVX and the last four with SSE.
+ *
+ * gather.bound() is the current squared search radius and
+ * gather.add() is called for each photon inside it.
+*/
+//******************************************
+template <class Gather>
+void Photon_map :: traverse(
+  const float pos[3],
+  Gather &gather ) const
+//******************************************
+{
+  if ( !bucket_offset )
+    return;
+
+  struct Stack_entry {
+    int node;
+    float dist2;                   // squared distance to the node's cell
+  } stack[64];
+  int sp = 0;
+
+  stack[sp].node = 1;
+  stack[sp].dist2 = 0.0f;
+  sp++;
+
+#ifdef __AVX__
+  const __m256 qx8 = _mm256_set1_ps( pos[0] );
+  const __m256 qy8 = _mm256_set1_ps( pos[1] );
+  const __m256 qz8 = _mm256_set1_ps( pos[2] );
+#endif
+#ifdef __SSE2__
+  const __m128 qx = _mm_set1_ps( pos[0] );
+  const __m128 qy = _mm_set1_ps( pos[1] );
+  const __m128 qz = _mm_set1_ps( pos[2] );
+#endif
+
+  while (sp>0) {
+    sp--;
+    if ( stack[sp].dist2 >= gather.bound() )
+      continue;
+    int node = stack[sp].node;
+
+    // descend to the bucket on the query side, pushing the far children
+    while (node < bucket_base) {
+      const Photon *p = &photons[node];
+      const int plane = info[node].plane;
+      const float dist1 = pos[ plane ] - p->pos[ plane ];
+      const int near_child = 2*node + (dist1>0.0f ? 1 : 0);
+
+      stack[sp].node = near_child^1;
+      stack[sp].dist2 = dist1*dist1;
+      sp++;
+
+      float d = p->pos[0] - pos[0];
+      float dist2 = d*d;
+      d = p->pos[1] - pos[1];
+      dist2 += d*d;
+      d = p->pos[2] - pos[2];
+      dist2 += d*d;
+      if ( dist2 < gather.bound() )
+        gather.add( dist2, p );
+
+      node = near_child;
+    }
+
+    // test all photons in the bucket
+    const int bucket = node-bucket_base;
+    const int end = bucket_offset[bucket+1];
+    int i = bucket_offset[bucket];
+#ifdef __AVX__
+    for (; i+8<=end; i+=8) {
+      const __m256 dx = _mm256_sub_ps( _mm256_loadu_ps( &bucket_pos[0][i] ), qx8 );
+      const __m256 dy = _mm256_sub_ps( _mm256_loadu_ps( &bucket_pos[1][i] ), qy8 );
+      const __m256 dz = _mm256_sub_ps( _mm256_loadu_ps( &bucket_pos[2][i] ), qz8 );
+      const __m256 d2 = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx, dx ), _mm256_mul_ps( dy, dy ) ),
+                        _mm256_mul_ps( dz, dz ) );
+      int mask = _mm256_movemask_ps( _mm256_cmp_ps( d2, _mm256_set1_ps( gather.bound() ), _CMP_LT_OQ ) );
+      if (mask) {
+        float dist2[8];
+        _mm256_storeu_ps( dist2, d2 );
+        for (int k=0; k<8; k++)
+          if ( mask & (1<<k) )
+            gather.add( dist2[k], &photons[ bucket_photon[i+k] ] );
       }
-      np->index[parent] = p;
-      np->dist2[parent] = dist2;
+    }
+#endif
+    for (; i<end; i+=4) {
+#ifdef __SSE2__
+      // buckets start on a multiple of 4 slots, so these loads are aligned
+      const __m128 dx = _mm_sub_ps( _mm_load_ps( &bucket_pos[0][i] ), qx );
+      const __m128 dy = _mm_sub_ps( _mm_load_ps( &bucket_pos[1][i] ), qy );
+      const __m128 dz = _mm_sub_ps( _mm_load_ps( &bucket_pos[2][i] ), qz );
+      // summed in the same order as the scalar code so the distances match
+      const __m128 d2 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) ),
+                        _mm_mul_ps( dz, dz ) );
+      int mask = _mm_movemask_ps( _mm_cmplt_ps( d2, _mm_set1_ps( gather.bound() ) ) );
+      if (mask) {
+        float dist2[4];
+        _mm_storeu_ps( dist2, d2 );
+        for (int k=0; k<4; k++)
+          if ( mask & (1<<k) )
+            gather.add( dist2[k], &photons[ bucket_photon[i+k] ] );
+      }
+#else
+      for (int k=i; k<i+4; k++) {
+        float d = bucket_pos[0][k] - pos[0];
+        float dist2 = d*d;
+        d = bucket_pos[1][k] - pos[1];
+        dist2 += d*d;
+        d = bucket_pos[2][k] - pos[2];
+        dist2 += d*d;
+        if ( dist2 < gather.bound() )
+          gather.add( dist2, &photons[ bucket_photon[k] ] );
+      }
+#endif
+    }
+  }
+}
 
-      np->dist2[0] = np->dist2[1];
+
+/* locate_nearest_photons finds the same photons as
+ * locate_photons( np, 1, normal ) without recursion
+*/
+//******************************************
+void Photon_map :: locate_nearest_photons(
+  NearestPhotons *const np,
+  const float normal[3] ) const
+//******************************************
+{
+  Nearest_gather gather;
+  gather.np = np;
+  gather.normal = normal;
+  gather.map = this;
+  traverse( np->pos, gather );
+}
+
+
+/* locate_photons_radius appends all photons within max_dist
+ * of pos to found, and returns how many were added
+*/
+//******************************************
+int Photon_map :: locate_photons_radius(
+  const float pos[3],
+  const float normal[3],
+  const float max_dist,
+  std::vector<const Photon*> &found ) const
+//******************************************
+{
+  const int old_size = (int)found.size();
+
+  Radius_gather gather;
+  gather.max_dist2 = max_dist*max_dist;
+  gather.normal = normal;
+  gather.map = this;
+  gather.found = &found;
+  traverse( pos, gather );
+
+  return (int)found.size()-old_size;
+}
+
+
+/* precompute_irradiance stores an irradiance estimate at every
+ * ratio'th photon of the balanced map, as suggested by Christensen
+ * in "Faster Photon Map Global Illumination" (JGT 1999). The
+ * estimate uses the photon's incoming direction as the normal.
+ * The estimates are computed as one batch, so nearby photons
+ * share their searches.
+ *
+ * Call this function after balance.
+*/
+//**********************************************
+void Photon_map :: precompute_irradiance(
+  const int ratio,
+  const int nphotons,
+  const float max_dist )
+//**********************************************
+{
+  delete irradiance_map;
+  irradiance_map = 0;
+
+  if (stored_photons<1 || ratio<1)
+    return;
+
+  const int nestimates = (stored_photons+ratio-1)/ratio;
+  std::vector<float> irrad( 3*nestimates ), pos( 3*nestimates ), normal( 3*nestimates );
+
+  for (int e=0; e<nestimates; e++) {
+    const Photon *p = &photons[ 1+e*ratio ];
+    photon_dir( &normal[3*e], p );
+    for (int i=0; i<3; i++) {
+      pos[3*e+i] = p->pos[i];
+      normal[3*e+i] = -normal[3*e+i];
     }
   }
+
+  irradiance_estimate_batch( nestimates, (float (*)[3])&irrad[0], (const float (*)[3])&pos[0],
+                             (const float (*)[3])&normal[0], max_dist, nphotons );
+
+  irradiance_map = new Photon_map( nestimates );
+  for (int e=0; e<nestimates; e++) {
+    const Photon *p = &photons[ 1+e*ratio ];
+    float dir[3];
+    photon_dir( dir, p );
+    irradiance_map->store( &irrad[3*e], p->pos, dir );
+  }
+  irradiance_map->balance();
+}
+
+
+/* irradiance_lookup returns the precomputed irradiance at the
+ * nearest photon that arrived at the front side of the surface.
+ * It returns 0 if there is no such photon within max_dist.
+*/
+//**********************************************
+int Photon_map :: irradiance_lookup(
+  float irrad[3],
+  const float pos[3],
+  const float normal[3],
+  const float max_dist ) const
+//**********************************************
+{
+  irrad[0] = irrad[1] = irrad[2] = 0.0f;
+  if (!irradiance_map)
+    return 0;
+
+  float dist2[2];
+  const Photon *index[2];
+
+  NearestPhotons np;
+  np.dist2 = dist2;
+  np.index = index;
+  np.pos[0] = pos[0]; np.pos[1] = pos[1]; np.pos[2] = pos[2];
+  np.max = 1;
+  np.found = 0;
+  np.got_heap = 0;
+  np.dist2[0] = max_dist*max_dist;
+
+  irradiance_map->locate_nearest_photons( &np, normal );
+  if (np.found == 0)
+    return 0;
+
+  irradiance_map->photon_power( irrad, np.index[1] );
+  return 1;
+}
+
+
+/* Irradiance_batch holds the queries of one
+ * irradiance_estimate_batch call and the buffers
+ * that are reused between its groups
+*/
+//*****************************************
+struct Photon_map :: Irradiance_batch {
+//*****************************************
+  float (*irrad)[3];
+  const float (*pos)[3];
+  const float (*normal)[3];
+  int *found;
+  float max_dist;
+  int nphotons;
+  bool bNormalize;
+
+  std::vector<float> dist2;        // NearestPhotons buffers
+  std::vector<const Photon*> index;
+  std::vector<const Photon*> gathered;  // photons around a group
+  std::vector<float> gathered_dir;
+  std::vector< std::pair<float,int> > candidates;
+};
+
+// Queries are processed in groups of this many points along the Morton curve
+static const int batch_group_size = 16;
+
+
+/* morton_code interleaves the bits of three coordinates
+ * in [0,1023]
+*/
+//******************************************
+static unsigned int morton_code( unsigned int x, unsigned int y, unsigned int z )
+//******************************************
+{
+  unsigned int code = 0;
+  for (int b=0; b<10; b++) {
+    code |= ((x>>b)&1) << (3*b);
+    code |= ((y>>b)&1) << (3*b+1);
+    code |= ((z>>b)&1) << (3*b+2);
+  }
+  return code;
+}
+
+
+/* irradiance_estimate_batch computes the same estimates as
+ * calling irradiance_estimate for each point.
+ *
+ * The points are sorted along a Morton curve and split into
+ * groups of nearby points. Each group locates the photons
+ * around its center once, and every point then selects its
+ * nearest photons from that shared set. The groups are
+ * estimated in parallel.
+*/
+//**********************************************
+void Photon_map :: irradiance_estimate_batch(
+  const int nqueries,
+  float irrad[][3],
+  const float pos[][3],
+  const float normal[][3],
+  const float max_dist,
+  const int nphotons,
+  const bool bNormalize,
+  int *found ) const
+//**********************************************
+{
+  if (nqueries<1)
+    return;
+
+  if (nphotons<1) {
+    for (int q=0; q<nqueries; q++) {
+      const int n = irradiance_estimate( irrad[q], pos[q], normal[q], max_dist, nphotons, bNormalize );
+      if (found)
+        found[q] = n;
+    }
+    return;
+  }
+
+  // sort the queries along a Morton curve inside the map bounds
+  float scale[3];
+  for (int i=0; i<3; i++)
+    scale[i] = bbox_max[i]>bbox_min[i] ? 1023.0f/(bbox_max[i]-bbox_min[i]) : 0.0f;
+
+  std::vector< std::pair<unsigned int,int> > order( nqueries );
+  for (int q=0; q<nqueries; q++) {
+    unsigned int cell[3];
+    for (int i=0; i<3; i++) {
+      float c = (pos[q][i]-bbox_min[i])*scale[i];
+      cell[i] = c<=0.0f ? 0 : c>=1023.0f ? 1023 : (unsigned int)c;
+    }
+    order[q].first = morton_code( cell[0], cell[1], cell[2] );
+    order[q].second = q;
+  }
+  std::sort( order.begin(), order.end() );
+
+  std::vector<int> queries( nqueries );
+  for (int q=0; q<nqueries; q++)
+    queries[q] = order[q].second;
+
+  const int ngroups = (nqueries+batch_group_size-1)/batch_group_size;
+
+#ifdef OPENMP
+  #pragma omp parallel
+#endif
+  {
+    Irradiance_batch batch;
+    batch.irrad = irrad;
+    batch.pos = pos;
+    batch.normal = normal;
+    batch.found = found;
+    batch.max_dist = max_dist;
+    batch.nphotons = nphotons;
+    batch.bNormalize = bNormalize;
+    batch.dist2.resize( nphotons+1 );
+    batch.index.resize( nphotons+1 );
+
+#ifdef OPENMP
+    #pragma omp for schedule(dynamic, 16)
+#endif
+    for (int g=0; g<ngroups; g++) {
+      const int first = g*batch_group_size;
+      estimate_group( batch, &queries[first], std::min( batch_group_size, nqueries-first ) );
+    }
+  }
+}
+
+
+/* estimate_group computes the estimates for a group of queries.
+ *
+ * The radius bound of each query is the distance from the group
+ * center to its nphotons nearest photons plus the group spread.
+ * A query with more than nphotons photons inside its bound has
+ * all of its nearest photons in the set gathered around the center,
+ * so its estimate is exact. Other queries fall back to
+ * irradiance_estimate, and groups that are spread wider than
+ * their radius are split in half.
+*/
+//**********************************************
+void Photon_map :: estimate_group(
+  Irradiance_batch &batch,
+  const int *queries,
+  const int count ) const
+//**********************************************
+{
+  if (count==1) {
+    const int q = queries[0];
+    const int n = irradiance_estimate( batch.irrad[q], batch.pos[q], batch.normal[q],
+                                       batch.max_dist, batch.nphotons, batch.bNormalize );
+    if (batch.found)
+      batch.found[q] = n;
+    return;
+  }
+
+  // center and spread of the group
+  float lo[3], hi[3], center[3];
+  for (int i=0; i<3; i++)
+    lo[i] = hi[i] = batch.pos[queries[0]][i];
+  for (int k=1; k<count; k++)
+    for (int i=0; i<3; i++) {
+      lo[i] = std::min( lo[i], batch.pos[queries[k]][i] );
+      hi[i] = std::max( hi[i], batch.pos[queries[k]][i] );
+    }
+  for (int i=0; i<3; i++)
+    center[i] = 0.5f*(lo[i]+hi[i]);
+  const float spread = 0.5f*sqrtf( (hi[0]-lo[0])*(hi[0]-lo[0]) +
+                                   (hi[1]-lo[1])*(hi[1]-lo[1]) +
+                                   (hi[2]-lo[2])*(hi[2]-lo[2]) );
+
+  // radius of the nearest photons around the center, in all directions
+  NearestPhotons np;
+  np.dist2 = &batch.dist2[0];
+  np.index = &batch.index[0];
+  np.pos[0] = center[0]; np.pos[1] = center[1]; np.pos[2] = center[2];
+  np.max = batch.nphotons;
+  np.found = 0;
+  np.got_heap = 0;
+  np.dist2[0] = batch.max_dist*batch.max_dist;
+  locate_nearest_photons( &np, 0 );
+
+  if (!np.got_heap) {
+    // too few photons around the group to share them
+    for (int k=0; k<count; k++)
+      estimate_group( batch, queries+k, 1 );
+    return;
+  }
+
+  const float radius = sqrtf( np.dist2[0] );
+  if (spread>radius) {
+    // the queries are too far apart, split the group
+    const int half = count/2;
+    estimate_group( batch, queries, half );
+    estimate_group( batch, queries+half, count-half );
+    return;
+  }
+
+  const float bound = std::min( radius+spread, batch.max_dist );
+  const float bound2 = bound*bound;
+
+  batch.gathered.clear();
+  locate_photons_radius( center, 0, bound+spread, batch.gathered );
+
+  const int ngathered = (int)batch.gathered.size();
+  batch.gathered_dir.resize( 3*ngathered );
+  for (int j=0; j<ngathered; j++)
+    photon_dir( &batch.gathered_dir[3*j], batch.gathered[j] );
+
+  for (int k=0; k<count; k++) {
+    const int q = queries[k];
+    const float *qpos = batch.pos[q];
+    const float *qnormal = batch.normal[q];
+
+    batch.candidates.clear();
+    for (int j=0; j<ngathered; j++) {
+      const Photon *p = batch.gathered[j];
+      float dist1 = p->pos[0] - qpos[0];
+      float dist2 = dist1*dist1;
+      dist1 = p->pos[1] - qpos[1];
+      dist2 += dist1*dist1;
+      dist1 = p->pos[2] - qpos[2];
+      dist2 += dist1*dist1;
+
+      const float *pdir = &batch.gathered_dir[3*j];
+      if ( dist2 < bound2 && (pdir[0]*qnormal[0]+pdir[1]*qnormal[1]+pdir[2]*qnormal[2]) < 0.0f )
+        batch.candidates.push_back( std::make_pair( dist2, j ) );
+    }
+
+    if ((int)batch.candidates.size() <= batch.nphotons) {
+      // the nearest photons may lie outside the shared set
+      const int n = irradiance_estimate( batch.irrad[q], qpos, qnormal,
+                                         batch.max_dist, batch.nphotons, batch.bNormalize );
+      if (batch.found)
+        batch.found[q] = n;
+      continue;
+    }
+
+    std::nth_element( batch.candidates.begin(), batch.candidates.begin()+(batch.nphotons-1),
+                      batch.candidates.end() );
+
+    float *irrad = batch.irrad[q];
+    irrad[0] = irrad[1] = irrad[2] = 0.0f;
+    for (int i=0; i<batch.nphotons; i++) {
+      float power[3];
+      photon_power( power, batch.gathered[ batch.candidates[i].second ] );
+      irrad[0] += power[0];
+      irrad[1] += power[1];
+      irrad[2] += power[2];
+    }
+
+    const float tmp = batch.bNormalize ? (1.0f/M_PI)/(batch.candidates[batch.nphotons-1].first) : 1.f;
+    irrad[0] *= tmp;
+    irrad[1] *= tmp;
+    irrad[2] *= tmp;
+
+    if (batch.found)
+      batch.found[q] = batch.nphotons;
+  }
+}
+
+
+/* encode_power converts a power to the shared exponent
+ * format of Ward's RGBE images
+*/
+//***************************
+static void encode_power(
+  unsigned char rgbe[4],
+  const float power[3] )
+//***************************
+{
+  float v = power[0];
+  if (power[1]>v) v = power[1];
+  if (power[2]>v) v = power[2];
+
+  if (!(v>=1e-32f)) {
+    rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+    return;
+  }
+
+  int e;
+  frexp( v, &e );
+  if (e > 127)
+    e = 127;
+
+  const float scale = (float)ldexp( 256.0, -e );
+  for (int i=0; i<3; i++) {
+    const float m = power[i]*scale;
+    rgbe[i] = m<=0.0f ? 0 : m>=255.0f ? 255 : (unsigned char)m;
+  }
+  rgbe[3] = (unsigned char)(e+128);
+}
+
+
+/* encode_photon fills in a photon record, compressing
+ * the power and the direction
+*/
+//***************************
+static void encode_photon(
+  Photon *const node,
+  Photon_info *const info,
+  const float power[3],
+  const float pos[3],
+  const float dir[3] )
+//***************************
+{
+  for (int i=0; i<3; i++)
+    node->pos[i] = pos[i];
+  encode_power( node->power, power );
+
+  int theta = int( acos(dir[2])*(256.0/M_PI) );
+  if (theta>255)
+    info->theta = 255;
+  else
+   info->theta = (unsigned char)theta;
+
+  int phi = int( atan2(dir[1],dir[0])*(256.0/(2.0*M_PI)) );
+  if (phi>255)
+    info->phi = 255;
+  else if (phi<0)
+    info->phi = (unsigned char)(phi+256);
+  else
+    info->phi = (unsigned char)phi;
+
+  info->plane = 0;
+  info->pad = 0;
+}
+
+
+/* reserve makes room for nphotons photons in total
+ * (at most the maximum given to the constructor)
+*/
+//***************************
+void Photon_map :: reserve( const int nphotons )
+//***************************
+{
+  release_mapping();
+
+  const int n = nphotons<max_photons ? nphotons : max_photons;
+  if (n <= allocated_photons)
+    return;
+
+  Photon *new_photons = (Photon*)realloc( photons, sizeof( Photon ) * ( n+1 ) );
+  Photon_info *new_info = (Photon_info*)realloc( info, sizeof( Photon_info ) * ( n+1 ) );
+
+  if (new_photons == NULL || new_info == NULL) {
+    fprintf(stderr,"Out of memory growing photon map\n");
+    exit(-1);
+  }
+
+  photons = new_photons;
+  info = new_info;
+  allocated_photons = n;
+}
+
+
+/* set_max_photons changes the maximum number of photons
+ * that will be stored. Photons already stored are kept.
+*/
+//***************************
+void Photon_map :: set_max_photons( const int max_phot )
+//***************************
+{
+  max_photons = max_phot;
 }
 
 
@@ -260,33 +1011,69 @@ void Photon_map :: store(
   if (stored_photons>=max_photons)
     return;
 
+  if (stored_photons>=allocated_photons)
+    reserve( allocated_photons<512 ? 1024 : 2*allocated_photons );
+
   stored_photons++;
   Photon *const node = &photons[stored_photons];
 
-  for (int i=0; i<3; i++) {
-    node->pos[i] = pos[i];
+  encode_photon( node, &info[stored_photons], power, pos, dir );
 
+  for (int i=0; i<3; i++) {
     if (node->pos[i] < bbox_min[i])
       bbox_min[i] = node->pos[i];
     if (node->pos[i] > bbox_max[i])
       bbox_max[i] = node->pos[i];
-
-    node->power[i] = power[i];
   }
+}
 
-  int theta = int( acos(dir[2])*(256.0/M_PI) );
-  if (theta>255)
-    node->theta = 255;
-  else
-   node->theta = (unsigned char)theta;
 
-  int phi = int( atan2(dir[1],dir[0])*(256.0/(2.0*M_PI)) );
-  if (phi>255)
-    node->phi = 255;
-  else if (phi<0)
-    node->phi = (unsigned char)(phi+256);
-  else
-    node->phi = (unsigned char)phi;
+/* store puts a photon into a thread's buffer. The buffer
+ * is later appended to a Photon_map with store_block.
+*/
+//***************************
+void Photon_buffer :: store(
+  const float power[3],
+  const float pos[3],
+  const float dir[3] )
+//***************************
+{
+  photons.push_back( Photon() );
+  info.push_back( Photon_info() );
+  encode_photon( &photons.back(), &info.back(), power, pos, dir );
+}
+
+
+/* store_block appends all photons in a buffer to the flat
+ * array and updates the bounds once for the whole block.
+ * Photons that do not fit in the map are dropped, like store.
+ * Call reserve first to avoid growing the arrays per block.
+*/
+//***************************
+void Photon_map :: store_block( const Photon_buffer &buffer )
+//***************************
+{
+  int n = buffer.size();
+  if (n > max_photons-stored_photons)
+    n = max_photons-stored_photons;
+  if (n <= 0)
+    return;
+
+  reserve( stored_photons+n );
+
+  Photon *const block = &photons[stored_photons+1];
+  memcpy( block, &buffer.photons[0], n*sizeof(Photon) );
+  memcpy( &info[stored_photons+1], &buffer.info[0], n*sizeof(Photon_info) );
+  stored_photons += n;
+
+  for (int j=0; j<n; j++) {
+    for (int i=0; i<3; i++) {
+      if (block[j].pos[i] < bbox_min[i])
+        bbox_min[i] = block[j].pos[i];
+      if (block[j].pos[i] > bbox_max[i])
+        bbox_max[i] = block[j].pos[i];
+    }
+  }
 }
 
 /* empty the  flat array 
@@ -303,6 +1090,12 @@ void Photon_map :: empty()
 
 	bbox_min[0] = bbox_min[1] = bbox_min[2] = 1e8f;
 	bbox_max[0] = bbox_max[1] = bbox_max[2] = -1e8f;
+
+	free_buckets();
+	release_mapping();
+
+	delete irradiance_map;
+	irradiance_map = 0;
 }
 
 
@@ -315,55 +1108,69 @@ void Photon_map :: empty()
 void Photon_map :: scale_photon_power( const float scale )
 //********************************************************
 {
+  release_mapping();
+
   for (int i=prev_scale; i<=stored_photons; i++) {
-    photons[i].power[0] *= scale;
-    photons[i].power[1] *= scale;
-    photons[i].power[2] *= scale;
+    float power[3];
+    photon_power( power, &photons[i] );
+    power[0] *= scale;
+    power[1] *= scale;
+    power[2] *= scale;
+    encode_power( photons[i].power, power );
   }
-  prev_scale = stored_photons;
+  prev_scale = stored_photons+1;
 }
 
 
 /* balance creates a left balanced kd-tree from the flat photon array.
  * This function should be called before the photon map
  * is used for rendering.
+ *
+ * The tree is built on photon indices instead of Photon pointers,
+ * and large subtrees are balanced as parallel tasks.
  */
 //******************************
 void Photon_map :: balance(void)
 //******************************
 {
-//  cout << "Balancing tree. Stored photons " << stored_photons << endl;
-  if (stored_photons>1) {
-    // allocate two temporary arrays for the balancing procedure
-    Photon **pa1 = (Photon**)malloc(sizeof(Photon*)*(stored_photons+1));
-    Photon **pa2 = (Photon**)malloc(sizeof(Photon*)*(stored_photons+1));
+  release_mapping();
 
+  if (stored_photons>1) {
+    // allocate two temporary index arrays for the balancing procedure
+    int *pa1 = (int*)malloc(sizeof(int)*(stored_photons+1));
+    int *pa2 = (int*)malloc(sizeof(int)*(stored_photons+1));
 
     for (int i=0; i<=stored_photons; i++)
-    {
-      pa2[i] = &photons[i];
-    }
+      pa2[i] = i;
 
-    balance_segment( pa1, pa2, 1, 1, stored_photons );
+#ifdef OPENMP
+    #pragma omp parallel
+    #pragma omp single nowait
+#endif
+    balance_segment( pa1, pa2, 1, 1, stored_photons, bbox_min, bbox_max );
     free(pa2);
 
     // reorganize balanced kd-tree (make a heap)
     int d, j=1, foo=1;
     Photon foo_photon = photons[j];
+    Photon_info foo_info = info[j];
 
     for (int i=1; i<=stored_photons; i++) {
-      d=pa1[j]-photons;
-      pa1[j] = NULL;
-      if (d != foo)
+      d=pa1[j];
+      pa1[j] = -1;
+      if (d != foo) {
         photons[j] = photons[d];
-      else {
+        info[j] = info[d];
+      } else {
         photons[j] = foo_photon;
+        info[j] = foo_info;
 
         if (i<stored_photons) {
           for (;foo<=stored_photons; foo++)
-            if (pa1[foo] != NULL)
+            if (pa1[foo] != -1)
               break;
           foo_photon = photons[foo];
+          foo_info = info[foo];
           j = foo;
         }
         continue;
@@ -374,61 +1181,38 @@ void Photon_map :: balance(void)
   }
 
   half_stored_photons = stored_photons/2-1;
+
+  build_buckets();
+
+  // the photons have moved, the estimates must be computed again
+  delete irradiance_map;
+  irradiance_map = 0;
 }
 
 
-#define swap(ph,a,b) { Photon *ph2=ph[a]; ph[a]=ph[b]; ph[b]=ph2; }
+// Orders photon indices by the photon position along one axis
+struct Photon_axis_less {
+  const Photon *photons;
+  int axis;
+  bool operator()( const int a, const int b ) const
+    { return photons[a].pos[axis] < photons[b].pos[axis]; }
+};
 
-// median_split splits the photon array into two separate
-// pieces around the median with all photons below the
-// the median in the lower half and all photons above
-// than the median in the upper half. The comparison
-// criteria is the axis (indicated by the axis parameter)
-// (inspired by routine in "Algorithms in C++" by Sedgewick)
-//*****************************************************************
-void Photon_map :: median_split(
-  Photon **p,
-  const int start,               // start of photon block in array
-  const int end,                 // end of photon block in array
-  const int median,              // desired median number
-  const int axis )               // axis to split along
-//*****************************************************************
-{
-  int left = start;
-  int right = end;
-
-  while ( right > left ) {
-    const float v = p[right]->pos[axis];
-    int i=left-1;
-    int j=right;
-    for (;;) {
-      while ( p[++i]->pos[axis] < v )
-        ;
-      while ( p[--j]->pos[axis] > v && j>left )
-        ;
-      if ( i >= j )
-        break;
-      swap(p,i,j);
-    }
+// Segments smaller than this are balanced by the task that reaches them
+static const int parallel_balance_size = 8192;
 
-    swap(p,i,right);
-    if ( i >= median )
-      right=i-1;
-    if ( i <= median )
-      left=i+1;
-  }
-}
 
-  
 // See "Realistic image synthesis using Photon Mapping" chapter 6
 // for an explanation of this function
 //****************************
 void Photon_map :: balance_segment(
-  Photon **pbal,
-  Photon **porg,
+  int *pbal,
+  int *porg,
   const int index,
   const int start,
-  const int end )
+  const int end,
+  const float seg_min[3],        // bounds of the segment
+  const float seg_max[3] )
 //****************************
 {
   //--------------------
@@ -450,20 +1234,24 @@ void Photon_map :: balance_segment(
   //--------------------------
 
   int axis=2;
-  if ((bbox_max[0]-bbox_min[0])>(bbox_max[1]-bbox_min[1]) &&
-      (bbox_max[0]-bbox_min[0])>(bbox_max[2]-bbox_min[2]))
+  if ((seg_max[0]-seg_min[0])>(seg_max[1]-seg_min[1]) &&
+      (seg_max[0]-seg_min[0])>(seg_max[2]-seg_min[2]))
     axis=0;
-  else if ((bbox_max[1]-bbox_min[1])>(bbox_max[2]-bbox_min[2]))
+  else if ((seg_max[1]-seg_min[1])>(seg_max[2]-seg_min[2]))
     axis=1;
 
   //------------------------------------------
   // partition photon block around the median
   //------------------------------------------
 
-  median_split( porg, start, end, median, axis );
+  Photon_axis_less less;
+  less.photons = photons;
+  less.axis = axis;
+  std::nth_element( porg+start, porg+median, porg+end+1, less );
 
   pbal[ index ] = porg[ median ];
-  pbal[ index ]->plane = axis;
+  info[ porg[median] ].plane = (unsigned char)axis;
+  const float split = photons[ porg[median] ].pos[axis];
 
   //----------------------------------------------
   // recursively balance the left and right block
@@ -472,10 +1260,15 @@ void Photon_map :: balance_segment(
   if ( median > start ) {
     // balance left segment
     if ( start < median-1 ) {
-      const float tmp=bbox_max[axis];
-      bbox_max[axis] = pbal[index]->pos[axis];
-      balance_segment( pbal, porg, 2*index, start, median-1 );
-      bbox_max[axis] = tmp;
+      float left_max[3] = { seg_max[0], seg_max[1], seg_max[2] };
+      left_max[axis] = split;
+#ifdef OPENMP
+      if ( median-start > parallel_balance_size ) {
+        #pragma omp task firstprivate(left_max)
+        balance_segment( pbal, porg, 2*index, start, median-1, seg_min, left_max );
+      } else
+#endif
+      balance_segment( pbal, porg, 2*index, start, median-1, seg_min, left_max );
     } else {
       pbal[ 2*index ] = porg[start];
     }
@@ -484,12 +1277,479 @@ void Photon_map :: balance_segment(
   if ( median < end ) {
     // balance right segment
     if ( median+1 < end ) {
-      const float tmp = bbox_min[axis];		
-      bbox_min[axis] = pbal[index]->pos[axis];
-      balance_segment( pbal, porg, 2*index+1, median+1, end );
-      bbox_min[axis] = tmp;
+      float right_min[3] = { seg_min[0], seg_min[1], seg_min[2] };
+      right_min[axis] = split;
+      balance_segment( pbal, porg, 2*index+1, median+1, end, right_min, seg_max );
     } else {
       pbal[ 2*index+1 ] = porg[end];
     }
   }	
+
+#ifdef OPENMP
+  // the left task reads seg_min, so it has to finish before we return
+  if ( median-start > parallel_balance_size ) {
+    #pragma omp taskwait
+  }
+#endif
 }
+
+
+/* bucket_layout returns the number of bytes needed for the
+ * bucket arrays and sets the offsets of the arrays in that
+ * block. Each array starts on a 16 byte boundary.
+*/
+//******************************
+static size_t bucket_layout(
+  const int nbuckets,
+  const int slots,
+  size_t offsets[5] )              // offset, photon, x, y, z
+//******************************
+{
+  size_t size = 0;
+  offsets[0] = size;
+  size += ((nbuckets+1)*sizeof(int) + 15) & ~(size_t)15;
+  offsets[1] = size;
+  size += (slots*sizeof(int) + 15) & ~(size_t)15;
+  for (int i=0; i<3; i++) {
+    offsets[2+i] = size;
+    size += slots*sizeof(float);
+  }
+  return size;
+}
+
+
+/* set_buckets points the bucket arrays into a block laid
+ * out by bucket_layout
+*/
+//******************************
+void Photon_map :: set_buckets( char *data, const int slots )
+//******************************
+{
+  size_t offsets[5];
+  bucket_layout( bucket_base, slots, offsets );
+  bucket_slots = slots;
+  bucket_offset = (int*)(data+offsets[0]);
+  bucket_photon = (int*)(data+offsets[1]);
+  for (int i=0; i<3; i++)
+    bucket_pos[i] = (float*)(data+offsets[2+i]);
+}
+
+
+/* free_buckets releases the bucket arrays
+*/
+//******************************
+void Photon_map :: free_buckets()
+//******************************
+{
+  free( bucket_data );
+  bucket_data = 0;
+  bucket_slots = 0;
+  bucket_offset = 0;
+  bucket_photon = 0;
+  bucket_pos[0] = bucket_pos[1] = bucket_pos[2] = 0;
+}
+
+
+/* bucket_shape returns the number of buckets that
+ * build_buckets cuts a map of nphotons into, and sets the
+ * number of slots of their padded arrays
+*/
+//******************************
+static int bucket_shape(
+  const int nphotons,
+  int *slots )
+//******************************
+{
+  // the heap is full on every level above its deepest one
+  int depth=0;
+  while ((2<<depth) <= nphotons)
+    depth++;
+  const int cut = depth>3 ? depth-3 : 0;
+  const int nbuckets = 1<<cut;
+
+  // count the slots, padding each bucket to a multiple of 4
+  *slots = 0;
+  for (int root=nbuckets; root<2*nbuckets; root++) {
+    int n = 0;
+    for (int first=root, last=root; first<=nphotons; first*=2, last=2*last+1)
+      n += (last<nphotons ? last : nphotons) - first + 1;
+    *slots += (n+3)&~3;
+  }
+  return nbuckets;
+}
+
+
+/* build_buckets copies the positions of the bottom levels of the
+ * balanced kd-tree into x, y and z arrays. Every node on the
+ * cut level roots a subtree of at most 15 photons; each level
+ * of that subtree is a contiguous range of the heap.
+*/
+//******************************
+void Photon_map :: build_buckets()
+//******************************
+{
+  free_buckets();
+
+  if (stored_photons<1)
+    return;
+
+  int slots;
+  bucket_base = bucket_shape( stored_photons, &slots );
+
+  size_t offsets[5];
+  bucket_data = (char*)malloc( bucket_layout( bucket_base, slots, offsets ) );
+  if (bucket_data == NULL) {
+    fprintf(stderr,"Out of memory building photon buckets\n");
+    exit(-1);
+  }
+  set_buckets( bucket_data, slots );
+
+  int slot = 0;
+  for (int root=bucket_base; root<2*bucket_base; root++) {
+    bucket_offset[ root-bucket_base ] = slot;
+
+    for (int first=root, last=root; first<=stored_photons; first*=2, last=2*last+1) {
+      const int end = last<stored_photons ? last : stored_photons;
+      for (int j=first; j<=end; j++, slot++) {
+        bucket_photon[slot] = j;
+        for (int i=0; i<3; i++)
+          bucket_pos[i][slot] = photons[j].pos[i];
+      }
+    }
+
+    // pad with photons that are never inside the search radius
+    for (; slot&3; slot++) {
+      bucket_photon[slot] = 0;
+      for (int i=0; i<3; i++)
+        bucket_pos[i][slot] = 1e30f;
+    }
+  }
+  bucket_offset[ bucket_base ] = slot;
+}
+
+
+/* This is the header of a photon map file. The photon,
+ * direction and bucket arrays follow at the given offsets
+ * in the same layout as in memory, so a loaded map can be
+ * searched directly in the file mapping.
+*/
+//******************************
+typedef struct Photon_map_header {
+//******************************
+  char magic[8];                   // "PHOTMAP"
+  unsigned int version;
+  unsigned int photon_size;        // sizeof(Photon)
+  unsigned int info_size;          // sizeof(Photon_info)
+  int stored_photons;
+  int bucket_base;
+  int bucket_slots;
+  unsigned long long scene_hash;
+  float bbox_min[3];
+  float bbox_max[3];
+  unsigned long long photons_offset;
+  unsigned long long info_offset;
+  unsigned long long buckets_offset;
+  unsigned long long file_size;
+} Photon_map_header;
+
+static const char photon_map_magic[8] = "PHOTMAP";
+static const unsigned int photon_map_version = 1;
+
+// sections of a photon map file start on this boundary
+static const size_t photon_map_alignment = 64;
+
+static size_t align_section( const size_t offset )
+{
+  return (offset+photon_map_alignment-1) & ~(photon_map_alignment-1);
+}
+
+/* file_layout sets the section offsets and the file size in
+ * a header from its photon and bucket counts. save writes
+ * them, load rejects files that do not match them.
+*/
+//******************************
+static void file_layout( Photon_map_header *header )
+//******************************
+{
+  header->photons_offset = align_section( sizeof(Photon_map_header) );
+  if (header->stored_photons>0) {
+    size_t offsets[5];
+    const size_t nphotons = (size_t)header->stored_photons+1;
+    header->info_offset = align_section( header->photons_offset + sizeof(Photon)*nphotons );
+    header->buckets_offset = align_section( header->info_offset + sizeof(Photon_info)*nphotons );
+    header->file_size = header->buckets_offset + bucket_layout( header->bucket_base, header->bucket_slots, offsets );
+  } else {
+    // an empty map is only the header
+    header->info_offset = header->buckets_offset = header->file_size = header->photons_offset;
+  }
+}
+
+
+/* save writes a balanced photon map to a file that load
+ * can map back into memory. It returns false if the map
+ * is not balanced or the file could not be written.
+*/
+//******************************
+bool Photon_map :: save(
+  const char *filename,
+  const unsigned long long scene_hash ) const
+//******************************
+{
+  if (stored_photons>0 && !bucket_offset)
+    return false;
+
+  Photon_map_header header;
+  memset( &header, 0, sizeof(header) );
+  memcpy( header.magic, photon_map_magic, sizeof(header.magic) );
+  header.version = photon_map_version;
+  header.photon_size = sizeof(Photon);
+  header.info_size = sizeof(Photon_info);
+  header.stored_photons = stored_photons;
+  header.bucket_base = bucket_base;
+  header.bucket_slots = bucket_slots;
+  header.scene_hash = scene_hash;
+  for (int i=0; i<3; i++) {
+    header.bbox_min[i] = bbox_min[i];
+    header.bbox_max[i] = bbox_max[i];
+  }
+  file_layout( &header );
+  const size_t buckets_size = header.file_size - header.buckets_offset;
+
+  FILE *f = fopen( filename, "wb" );
+  if (f == NULL)
+    return false;
+
+  static const char zeros[photon_map_alignment] = { 0 };
+  bool ok = fwrite( &header, sizeof(header), 1, f ) == 1;
+  ok = ok && fwrite( zeros, header.photons_offset-sizeof(header), 1, f ) == 1;
+  if (stored_photons>0) {
+    ok = ok && fwrite( photons, sizeof(Photon), stored_photons+1, f ) == (size_t)(stored_photons+1);
+    ok = ok && fseek( f, (long)header.info_offset, SEEK_SET ) == 0;
+    ok = ok && fwrite( info, sizeof(Photon_info), stored_photons+1, f ) == (size_t)(stored_photons+1);
+    ok = ok && fseek( f, (long)header.buckets_offset, SEEK_SET ) == 0;
+    ok = ok && fwrite( bucket_offset, 1, buckets_size, f ) == buckets_size;
+  }
+  ok = (fclose( f ) == 0) && ok;
+
+  if (!ok)
+    remove( filename );
+  return ok;
+}
+
+
+/* load maps a file written by save. The photons are
+ * searched in place without being copied. It returns false,
+ * and leaves the map unchanged, if the file is missing, was
+ * written by another version or belongs to another scene.
+*/
+//******************************
+bool Photon_map :: load(
+  const char *filename,
+  const unsigned long long scene_hash )
+//******************************
+{
+#ifndef WIN32
+  const int fd = open( filename, O_RDONLY );
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  Photon_map_header header;
+  if (fstat( fd, &st ) != 0 || (size_t)st.st_size < sizeof(header) ||
+      read( fd, &header, sizeof(header) ) != (ssize_t)sizeof(header)) {
+    close( fd );
+    return false;
+  }
+
+  // the buckets and the layout must be exactly the ones save
+  // writes for this many photons
+  bool valid =
+    memcmp( header.magic, photon_map_magic, sizeof(header.magic) ) == 0 &&
+    header.version == photon_map_version &&
+    header.photon_size == sizeof(Photon) &&
+    header.info_size == sizeof(Photon_info) &&
+    header.scene_hash == scene_hash &&
+    header.stored_photons >= 0 && header.stored_photons <= max_photons;
+  if (valid && header.stored_photons>0) {
+    int slots;
+    valid = bucket_shape( header.stored_photons, &slots ) == header.bucket_base &&
+      slots == header.bucket_slots;
+  }
+  if (valid) {
+    Photon_map_header expected = header;
+    file_layout( &expected );
+    valid =
+      header.photons_offset == expected.photons_offset &&
+      header.info_offset == expected.info_offset &&
+      header.buckets_offset == expected.buckets_offset &&
+      header.file_size == expected.file_size &&
+      header.file_size == (unsigned long long)st.st_size;
+  }
+  if (!valid) {
+    close( fd );
+    return false;
+  }
+
+  if (header.stored_photons == 0) {
+    close( fd );
+    empty();
+    return true;
+  }
+
+  void *data = mmap( 0, header.file_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if (data == MAP_FAILED)
+    return false;
+
+  // drop the current photons
+  empty();
+  free( photons );
+  free( info );
+
+  char *const base = (char*)data;
+  mapping = data;
+  mapping_size = header.file_size;
+
+  photons = (Photon*)(base + header.photons_offset);
+  info = (Photon_info*)(base + header.info_offset);
+  stored_photons = header.stored_photons;
+  allocated_photons = stored_photons;
+  half_stored_photons = stored_photons/2-1;
+  prev_scale = stored_photons+1;
+  for (int i=0; i<3; i++) {
+    bbox_min[i] = header.bbox_min[i];
+    bbox_max[i] = header.bbox_max[i];
+  }
+
+  bucket_base = header.bucket_base;
+  set_buckets( base + header.buckets_offset, header.bucket_slots );
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+/* release_mapping copies a loaded map into owned memory
+ * so it can be changed, and unmaps the file
+*/
+//******************************
+void Photon_map :: release_mapping()
+//******************************
+{
+  if (!mapping)
+    return;
+
+  const int n = stored_photons;
+  Photon *new_photons = (Photon*)malloc( sizeof( Photon ) * ( n+1 ) );
+  Photon_info *new_info = (Photon_info*)malloc( sizeof( Photon_info ) * ( n+1 ) );
+  if (new_photons == NULL || new_info == NULL) {
+    fprintf(stderr,"Out of memory copying photon map\n");
+    exit(-1);
+  }
+  memcpy( new_photons, photons, sizeof( Photon ) * ( n+1 ) );
+  memcpy( new_info, info, sizeof( Photon_info ) * ( n+1 ) );
+
+  if (bucket_offset) {
+    size_t offsets[5];
+    const size_t size = bucket_layout( bucket_base, bucket_slots, offsets );
+    bucket_data = (char*)malloc( size );
+    if (bucket_data == NULL) {
+      fprintf(stderr,"Out of memory copying photon buckets\n");
+      exit(-1);
+    }
+    memcpy( bucket_data, bucket_offset, size );
+    set_buckets( bucket_data, bucket_slots );
+  }
+
+#ifndef WIN32
+  munmap( mapping, mapping_size );
+#endif
+  mapping = 0;
+  mapping_size = 0;
+
+  photons = new_photons;
+  info = new_info;
+  allocated_photons = n;
+}
+
+
+#ifdef PHOTON_BENCHMARK
+/* benchmark_lookups times the recursive and the iterative
+ * nearest photon search on queries placed at stored photons
+*/
+//******************************
+void Photon_map :: benchmark_lookups(
+  const int nqueries,
+  const int nphotons,
+  const float max_dist ) const
+//******************************
+{
+  if (stored_photons<1 || nqueries<1)
+    return;
+
+  NearestPhotons np;
+  np.dist2 = (float*)alloca( sizeof(float)*(nphotons+1) );
+  np.index = (const Photon**)alloca( sizeof(Photon*)*(nphotons+1) );
+  np.max = nphotons;
+
+  double found[2] = { 0.0, 0.0 };
+  double time[2];
+
+  for (int method=0; method<2; method++) {
+    time[method] = -getTime();
+    for (int q=0; q<nqueries; q++) {
+      // spread the queries over the map and look from the photon's side
+      const Photon *p = &photons[ 1 + (int)((q*2654435761u) % (unsigned)stored_photons) ];
+      float normal[3];
+      photon_dir( normal, p );
+      normal[0] = -normal[0]; normal[1] = -normal[1]; normal[2] = -normal[2];
+
+      np.pos[0] = p->pos[0]; np.pos[1] = p->pos[1]; np.pos[2] = p->pos[2];
+      np.found = 0;
+      np.got_heap = 0;
+      np.dist2[0] = max_dist*max_dist;
+
+      if (method==0)
+        locate_photons( &np, 1, normal );
+      else
+        locate_nearest_photons( &np, normal );
+      found[method] += np.found;
+    }
+    time[method] += getTime();
+  }
+
+  printf( "Photon lookups (%d photons, %d per query): recursive %.0f queries/s, iterative %.0f queries/s\n",
+          stored_photons, nphotons, nqueries/time[0], nqueries/time[1] );
+  if (found[0] != found[1])
+    fprintf( stderr, "Photon lookups found %.0f and %.0f photons\n", found[0], found[1] );
+
+  // the same queries as irradiance estimates, one at a time and batched
+  std::vector<float> pos( 3*nqueries ), normal( 3*nqueries ), irrad( 3*nqueries );
+  for (int q=0; q<nqueries; q++) {
+    const Photon *p = &photons[ 1 + (int)((q*2654435761u) % (unsigned)stored_photons) ];
+    photon_dir( &normal[3*q], p );
+    for (int i=0; i<3; i++) {
+      pos[3*q+i] = p->pos[i];
+      normal[3*q+i] = -normal[3*q+i];
+    }
+  }
+
+  time[0] = -getTime();
+#ifdef OPENMP
+  #pragma omp parallel for schedule(dynamic, 256)
+#endif
+  for (int q=0; q<nqueries; q++)
+    irradiance_estimate( &irrad[3*q], &pos[3*q], &normal[3*q], max_dist, nphotons );
+  time[0] += getTime();
+
+  time[1] = -getTime();
+  irradiance_estimate_batch( nqueries, (float (*)[3])&irrad[0], (const float (*)[3])&pos[0],
+                             (const float (*)[3])&normal[0], max_dist, nphotons );
+  time[1] += getTime();
+
+  printf( "Irradiance estimates (%d photons, %d per query): single %.0f queries/s, batch %.0f queries/s\n",
+          stored_photons, nphotons, nqueries/time[0], nqueries/time[1] );
+}
+#endif
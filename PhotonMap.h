@@ -8,19 +8,38 @@
 #ifndef __PHOTON_MAP_H__
 #define __PHOTON_MAP_H__
 
+#include <vector>
+#include <stddef.h>
+
+#ifdef _MSC_VER
+#define PHOTON_ALIGN __declspec(align(16))
+#else
+#define PHOTON_ALIGN __attribute__((aligned(16)))
+#endif
+
 /* This is the photon
- * The power is not compressed so the
- * size is 28 bytes
+ * The power is compressed with a shared exponent (RGBE)
+ * so the size is 16 bytes. Photons are aligned to 16
+ * bytes so one never straddles a cache line. The
+ * direction and the splitting plane are kept in a
+ * separate Photon_info array since most photons visited
+ * in a search only need the position.
 */
 //**********************
-typedef struct Photon {
+typedef struct PHOTON_ALIGN Photon {
 //**********************
     float pos[3];                 // photon position
-    short plane;                  // splitting plane for kd-tree
-    unsigned char theta, phi;     // incoming direction
-    float power[3];               // photon power (uncompressed)
+    unsigned char power[4];       // photon power (RGBE)
 } Photon;
 
+//***************************
+typedef struct Photon_info {
+//***************************
+    unsigned char theta, phi;     // incoming direction
+    unsigned char plane;          // splitting plane for kd-tree
+    unsigned char pad;
+} Photon_info;
+
 /* This structure is used only to locate the
  * nearest photons
 */
@@ -36,6 +55,29 @@ typedef struct NearestPhotons {
 } NearestPhotons;
 
 
+/* This is a block of photons traced by one thread.
+ * Blocks are appended to the Photon_map in a fixed
+ * order so the map does not depend on the scheduling
+*/
+//********************
+class Photon_buffer {
+//********************
+public:
+  void store(
+    const float power[3],          // photon power
+    const float pos[3],            // photon position
+    const float dir[3] );          // photon direction
+
+  void clear() { photons.clear(); info.clear(); }
+  int size() const { return (int)photons.size(); }
+
+private:
+  friend class Photon_map;
+  std::vector<Photon> photons;
+  std::vector<Photon_info> info;
+};
+
+
 /* This is the Photon_map class
  */
 //*****************
@@ -50,13 +92,33 @@ public:
     const float pos[3],            // photon position
     const float dir[3] );          // photon direction
 
+  void store_block(
+    const Photon_buffer &buffer ); // photons traced by one thread
+
+  void reserve(
+    const int nphotons );          // total number of photons to make room for
+
+  void set_max_photons(
+    const int max_phot );          // maximum number of photons to store
+
   void empty();
 
+  int size() const { return stored_photons; }
+  int max_size() const { return max_photons; }
+
   void scale_photon_power(
     const float scale );           // 1/(number of emitted photons)
 
   void balance(void);              // balance the kd-tree (before use!)
 
+  bool save(
+    const char *filename,          // file to write the balanced map to
+    const unsigned long long scene_hash ) const; // identifies the scene
+
+  bool load(
+    const char *filename,          // file written by save
+    const unsigned long long scene_hash ); // must match the saved hash
+
   int irradiance_estimate(
     float irrad[3],                // returned irradiance
     const float pos[3],            // surface position
@@ -65,44 +127,124 @@ public:
     const int nphotons,			   // number of photons to use
 	const bool bNormalize = true) const; // if the flux should be normalized by density    
 
+  void irradiance_estimate_batch(
+    const int nqueries,            // number of shading points
+    float irrad[][3],              // returned irradiance for each point
+    const float pos[][3],          // surface positions
+    const float normal[][3],       // surface normals
+    const float max_dist,          // max distance to look for photons
+    const int nphotons,            // number of photons to use
+    const bool bNormalize = true,  // if the flux should be normalized by density
+    int *found = 0 ) const;        // optional: photons used for each point
+
+  void precompute_irradiance(
+    const int ratio,               // estimate at every ratio'th photon
+    const int nphotons,            // number of photons per estimate
+    const float max_dist );        // max distance to look for photons
+
+  bool has_precomputed_irradiance() const { return irradiance_map != 0; }
+
+  int irradiance_lookup(
+    float irrad[3],                // returned irradiance
+    const float pos[3],            // surface position
+    const float normal[3],         // surface normal at pos
+    const float max_dist ) const;  // max distance to the nearest estimate
+
   void locate_photons(
     NearestPhotons *const np,      // np is used to locate the photons
     const int index, const float normal[3] ) const;       // call with index = 1
 
+  void locate_nearest_photons(
+    NearestPhotons *const np,      // np is used to locate the photons
+    const float normal[3] ) const; // surface normal at np->pos
+
+  int locate_photons_radius(
+    const float pos[3],            // surface position
+    const float normal[3],         // surface normal at pos (0 to skip the test)
+    const float max_dist,          // radius to look for photons in
+    std::vector<const Photon*> &found ) const; // photons are appended here
+
+#ifdef PHOTON_BENCHMARK
+  void benchmark_lookups(
+    const int nqueries,            // number of lookups to time
+    const int nphotons,            // number of photons per lookup
+    const float max_dist ) const;  // max distance to look for photons
+#endif
+
   void photon_dir(
     float *dir,                    // direction of photon (returned)
     const Photon *p ) const;       // the photon
 
+  void photon_power(
+    float *power,                  // power of photon (returned)
+    const Photon *p ) const;       // the photon
+
 private:
 
   void balance_segment(
-    Photon **pbal,
-    Photon **porg,
+    int *pbal,
+    int *porg,
     const int index,
     const int start,
-    const int end );
-
-  void median_split(
-    Photon **p,
-    const int start,
     const int end,
-    const int median,
-    const int axis );
+    const float seg_min[3],
+    const float seg_max[3] );
+
+  void build_buckets();
+  void set_buckets( char *data, const int slots );
+  void free_buckets();
+  void release_mapping();
+
+  struct Irradiance_batch;
+  void estimate_group(
+    Irradiance_batch &batch,       // queries and scratch buffers
+    const int *queries,            // indices of the queries in the group
+    const int count ) const;
+
+  template <class Gather>
+  void traverse(
+    const float pos[3],            // query position
+    Gather &gather ) const;        // decides which photons are kept
   
   Photon *photons;
+  Photon_info *info;
 
   int stored_photons;
   int half_stored_photons;
   int max_photons;
+  int allocated_photons;
   int prev_scale;
 
   float costheta[256];
   float sintheta[256];
   float cosphi[256];
   float sinphi[256];
+  float rgbe_scale[256];         // 2^(e-136) for the RGBE exponent e
   
   float bbox_min[3];		// use bbox_min;
   float bbox_max[3];		// use bbox_max;
+
+  // The bottom levels of the kd-tree are grouped into buckets,
+  // one per subtree rooted at bucket_base..2*bucket_base-1.
+  // Bucket positions are kept as x, y and z arrays padded to a
+  // multiple of 4 so they can be tested with SSE. All bucket
+  // arrays live in one block so they can be saved and mapped.
+  int bucket_base;
+  int bucket_slots;
+  int *bucket_offset;              // first slot of each bucket
+  int *bucket_photon;              // photon index of each slot
+  float *bucket_pos[3];
+  char *bucket_data;               // owned block (0 if mapped)
+
+  // A loaded map points into a read only file mapping. It is
+  // copied into owned memory before it is changed.
+  void *mapping;
+  size_t mapping_size;
+
+  // Irradiance precomputed at a subset of the photons. The
+  // estimates are stored as the power of the photons in a
+  // second map so they can be found with one nearest search.
+  Photon_map *irradiance_map;
 };
 
 #endif
@@ -41,7 +41,7 @@ Plane::intersect(HitInfo& result, const Ray& r,float tMin, float tMax)
 
     result.P = r.o + t*r.d;
     result.t = t;
-    result.N = m_normal;
+    result.N = result.Ng = m_normal;
     result.material = m_material;
 
     return true;
@@ -12,6 +12,7 @@
 #include "Vector3.h"
 #include "PointMap.h"
 #include <iostream>
+#include <algorithm>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -21,7 +22,8 @@ using namespace std;
 
 /* This is the constructor for the photon map.
  * To create the photon map it is necessary to specify the
- * maximum number of photons that will be stored
+ * maximum number of photons that will be stored. Memory for
+ * the points is allocated a chunk at a time as they are stored.
  */
 //************************************************
 Point_map :: Point_map( const int max_point )
@@ -32,9 +34,10 @@ Point_map :: Point_map( const int max_point )
     prev_scale = 1;
     max_points = max_point;
 
-    points = (Point*)malloc( sizeof( Point ) * ( max_points+1 ) );
+    nchunks = (max_points+chunk_size)/chunk_size;
+    chunks = (Point**)calloc( nchunks, sizeof( Point* ) );
 
-    if (points == NULL) {
+    if (chunks == NULL) {
         fprintf(stderr,"Out of memory initializing point map\n");
         exit(-1);
     }
@@ -60,7 +63,9 @@ Point_map :: Point_map( const int max_point )
 Point_map :: ~Point_map()
     //*************************
 {
-    free( points );
+    for (int i=0; i<nchunks; i++)
+        free( chunks[i] );
+    free( chunks );
 }
 
 
@@ -95,7 +100,7 @@ void Point_map :: locate_points(
         const int index) const
 //******************************************
 {
-    Point *p = &points[index];
+    Point *p = &point(index);
     float dist1;
 
 //    for (int i = 0; i < stored_points; i++)
@@ -226,8 +231,18 @@ Point* Point_map :: store(
 //        printf("Invalid point created in point map");
 
     stored_points++;
+
+    Point *&chunk = chunks[ stored_points>>chunk_shift ];
+    if (chunk == NULL) {
+        chunk = (Point*)malloc( sizeof( Point ) * chunk_size );
+        if (chunk == NULL) {
+            fprintf(stderr,"Out of memory growing point map\n");
+            exit(-1);
+        }
+    }
+
     //Point *const node = &points[stored_points];
-    Point *node = &points[stored_points];
+    Point *node = &point(stored_points);
 
     node->position = pos;
     node->normal = normal;
@@ -291,48 +306,78 @@ void Point_map :: empty()
 
     bbox_min.x = bbox_min.y = bbox_min.z = 1e8f;
     bbox_max.x = bbox_max.y = bbox_max.z = -1e8f;
+
+    // the chunks are kept, so pointers to stored points stay valid
+}
+
+/* reserve raises the maximum number of points so the map can
+ * be created before the image resolution is known. Only the
+ * chunk table grows, the chunks are allocated as points are stored.
+ */
+//****************************************************
+void Point_map :: reserve( const int max_point )
+//****************************************************
+{
+    if (max_point <= max_points)
+        return;
+
+    int n = (max_point+chunk_size)/chunk_size;
+    if (n > nchunks) {
+        Point **grown = (Point**)realloc( chunks, n*sizeof( Point* ) );
+        if (grown == NULL) {
+            fprintf(stderr,"Out of memory growing point map\n");
+            exit(-1);
+        }
+        memset( grown+nchunks, 0, (n-nchunks)*sizeof( Point* ) );
+        chunks = grown;
+        nchunks = n;
+    }
+    max_points = max_point;
 }
 
 /* balance creates a left balanced kd-tree from the flat photon array.
  * This function should be called before the photon map
  * is used for rendering.
+ *
+ * The tree is built on point indices instead of Point pointers,
+ * and large subtrees are balanced as parallel tasks.
  */
 //******************************
 void Point_map :: balance(void)
     //******************************
 {
-    //  cout << "Balancing tree. Stored photons " << stored_photons << endl;
     if (stored_points>1) {
-        // allocate two temporary arrays for the balancing procedure
-        Point **pa1 = (Point**)malloc(sizeof(Point*)*(stored_points+1));
-        Point **pa2 = (Point**)malloc(sizeof(Point*)*(stored_points+1));
-
+        // allocate two temporary index arrays for the balancing procedure
+        int *pa1 = (int*)malloc(sizeof(int)*(stored_points+1));
+        int *pa2 = (int*)malloc(sizeof(int)*(stored_points+1));
 
         for (int i=0; i<=stored_points; i++)
-        {
-            pa2[i] = &points[i];
-        }
+            pa2[i] = i;
 
-        balance_segment( pa1, pa2, 1, 1, stored_points );
+#ifdef OPENMP
+        #pragma omp parallel
+        #pragma omp single nowait
+#endif
+        balance_segment( pa1, pa2, 1, 1, stored_points, bbox_min, bbox_max );
         free(pa2);
 
         // reorganize balanced kd-tree (make a heap)
         int d, j=1, foo=1;
-        Point foo_point = points[j];
+        Point foo_point = point(j);
 
         for (int i=1; i<=stored_points; i++) {
-            d=pa1[j]-points;
-            pa1[j] = NULL;
+            d=pa1[j];
+            pa1[j] = -1;
             if (d != foo)
-                points[j] = points[d];
+                point(j) = point(d);
             else {
-                points[j] = foo_point;
+                point(j) = foo_point;
 
                 if (i<stored_points) {
                     for (;foo<=stored_points; foo++)
-                        if (pa1[foo] != NULL)
+                        if (pa1[foo] != -1)
                             break;
-                    foo_point = points[foo];
+                    foo_point = point(foo);
                     j = foo;
                 }
                 continue;
@@ -346,77 +391,29 @@ void Point_map :: balance(void)
 }
 
 
-#define swap(ph,a,b) { Point *ph2=ph[a]; ph[a]=ph[b]; ph[b]=ph2; }
-float DetermineAxis(Point *p, const int axis)
-{
-    switch(axis)
-    {
-        case 0: return p->position.x; break;
-        case 1: return p->position.y; break;
-        case 2: default: return p->position.z; break;
-    }
-}
-
-float DetermineAxis(const Vector3& v, const int axis)
-{
-    switch(axis)
-    {
-        case 0: return v.x; break;
-        case 1: return v.y; break;
-        case 2: default: return v.z; break;
-    }
-}
+// Orders point indices by the point position along one axis
+struct Point_axis_less {
+    const Point_map *map;
+    int axis;
+    bool operator()( const int a, const int b ) const
+        { return map->point(a).position[axis] < map->point(b).position[axis]; }
+};
 
-// median_split splits the photon array into two separate
-// pieces around the median with all photons below the
-// the median in the lower half and all photons above
-// than the median in the upper half. The comparison
-// criteria is the axis (indicated by the axis parameter)
-// (inspired by routine in "Algorithms in C++" by Sedgewick)
-//*****************************************************************
-void Point_map :: median_split(
-        Point **p,
-        const int start,               // start of photon block in array
-        const int end,                 // end of photon block in array
-        const int median,              // desired median number
-        const int axis )               // axis to split along
-//*****************************************************************
-{
-    int left = start;
-    int right = end;
-
-    while ( right > left ) {
-        const float v = DetermineAxis(p[right], axis);
-        int i=left-1;
-        int j=right;
-        for (;;) {
-            while ( DetermineAxis(p[++i], axis) < v )
-                ;
-            while ( DetermineAxis(p[--j], axis) > v && j>left )
-                ;
-            if ( i >= j )
-                break;
-            swap(p,i,j);
-        }
-
-        swap(p,i,right);
-        if ( i >= median )
-            right=i-1;
-        if ( i <= median )
-            left=i+1;
-    }
-}
+// Segments smaller than this are balanced by the task that reaches them
+static const int parallel_balance_size = 8192;
 
 
 // See "Realistic image synthesis using Photon Mapping" chapter 6
 // for an explanation of this function
 //****************************
 void Point_map :: balance_segment(
-        Point **pbal,
-        Point **porg,
+        int *pbal,
+        int *porg,
         const int index,
         const int start,
-        const int end )
+        const int end,
+        const Vector3 seg_min,       // bounds of the segment
+        const Vector3 seg_max )
 //****************************
 {
     //--------------------
@@ -438,20 +435,24 @@ void Point_map :: balance_segment(
     //--------------------------
 
     int axis=2;
-    if ((bbox_max.x-bbox_min.x)>(bbox_max.y-bbox_min.y) &&
-            (bbox_max.x-bbox_min.x)>(bbox_max.z-bbox_min.z))
+    if ((seg_max.x-seg_min.x)>(seg_max.y-seg_min.y) &&
+            (seg_max.x-seg_min.x)>(seg_max.z-seg_min.z))
         axis=0;
-    else if ((bbox_max.y-bbox_min.y)>(bbox_max.z-bbox_min.z))
+    else if ((seg_max.y-seg_min.y)>(seg_max.z-seg_min.z))
         axis=1;
 
     //------------------------------------------
-    // partition photon block around the median
+    // partition point block around the median
     //------------------------------------------
 
-    median_split( porg, start, end, median, axis );
+    Point_axis_less less;
+    less.map = this;
+    less.axis = axis;
+    std::nth_element( porg+start, porg+median, porg+end+1, less );
 
     pbal[ index ] = porg[ median ];
-    pbal[ index ]->plane = axis;
+    point( porg[median] ).plane = axis;
+    const float split = point( porg[median] ).position[axis];
 
     //----------------------------------------------
     // recursively balance the left and right block
@@ -460,20 +461,15 @@ void Point_map :: balance_segment(
     if ( median > start ) {
         // balance left segment
         if ( start < median-1 ) {
-            const float tmp = DetermineAxis(bbox_max, axis);
-            switch(axis)
-            {
-                case 0: bbox_max.x = DetermineAxis(pbal[index], axis); break;
-                case 1: bbox_max.y = DetermineAxis(pbal[index], axis); break;
-                case 2: bbox_max.z = DetermineAxis(pbal[index], axis); break;
-            }
-            balance_segment( pbal, porg, 2*index, start, median-1 );
-            switch(axis)
-            {
-                case 0: bbox_max.x = tmp; break;
-                case 1: bbox_max.y = tmp; break;
-                case 2: bbox_max.z = tmp; break;
-            }
+            Vector3 left_max = seg_max;
+            left_max[axis] = split;
+#ifdef OPENMP
+            if ( median-start > parallel_balance_size ) {
+                #pragma omp task firstprivate(left_max)
+                balance_segment( pbal, porg, 2*index, start, median-1, seg_min, left_max );
+            } else
+#endif
+            balance_segment( pbal, porg, 2*index, start, median-1, seg_min, left_max );
         } else {
             pbal[ 2*index ] = porg[start];
         }
@@ -482,22 +478,18 @@ void Point_map :: balance_segment(
     if ( median < end ) {
         // balance right segment
         if ( median+1 < end ) {
-            const float tmp = DetermineAxis(bbox_min, axis);		
-            switch(axis)
-            {
-                case 0: bbox_min.x = DetermineAxis(pbal[index], axis); break;
-                case 1: bbox_min.y = DetermineAxis(pbal[index], axis); break;
-                case 2: bbox_min.z = DetermineAxis(pbal[index], axis); break;
-            }
-            balance_segment( pbal, porg, 2*index+1, median+1, end );
-            switch(axis)
-            {
-                case 0: bbox_min.x = tmp; break;
-                case 1: bbox_min.y = tmp; break;
-                case 2: bbox_min.z = tmp; break;
-            }
+            Vector3 right_min = seg_min;
+            right_min[axis] = split;
+            balance_segment( pbal, porg, 2*index+1, median+1, end, right_min, seg_max );
         } else {
             pbal[ 2*index+1 ] = porg[end];
         }
     }	
+
+#ifdef OPENMP
+    // wait for the left task before the segment is reported as balanced
+    if ( median-start > parallel_balance_size ) {
+        #pragma omp taskwait
+    }
+#endif
 }
@@ -74,6 +74,9 @@ public:
 
   void empty();
 
+  void reserve(
+    const int max_point );         // number of points that can be stored
+
   void balance(void);              // balance the kd-tree (before use!)
 
   void find_points(
@@ -86,23 +89,30 @@ public:
     NearestPoints *const np,      // np is used to locate the photons
     const int index) const;       // call with index = 1
 
+  int size() const { return stored_points; }
+
+  // point i of the flat array (1 <= i <= size())
+  Point& point( const int i ) const
+    { return chunks[ i>>chunk_shift ][ i&(chunk_size-1) ]; }
+
 private:
 
   void balance_segment(
-    Point **pbal,
-    Point **porg,
+    int *pbal,
+    int *porg,
     const int index,
     const int start,
-    const int end );
-
-  void median_split(
-    Point **p,
-    const int start,
     const int end,
-    const int median,
-    const int axis );
+    const Vector3 seg_min,
+    const Vector3 seg_max );
   
-  Point *points;
+  // Points are stored in fixed size chunks that are allocated
+  // as points are stored, so their addresses never change.
+  static const int chunk_shift = 12;
+  static const int chunk_size = 1<<chunk_shift;
+
+  Point **chunks;
+  int nchunks;
 
   int stored_points;
   int half_stored_points;
@@ -12,6 +12,19 @@
 #endif
 
 #include "SSE.h"
+
+//! Origin for a ray leaving the surface point p in direction d.
+/*!
+  Hit points lie on the surface, so rays starting there could hit the
+  surface again. The origin is moved off the surface along the normal n, to
+  the side the ray leaves on, which works for any direction. n must be the
+  geometric normal: near silhouettes an interpolated or bumped normal can
+  point to the other side of the surface than the direction does.
+ */
+inline Vector3 offsetRayOrigin(const Vector3& p, const Vector3& n, const Vector3& d)
+{
+    return dot(d, n) > 0 ? p + n*epsilon : p - n*epsilon;
+}
     
 //! Contains information about a ray hit with a surface.
 /*!
@@ -24,14 +37,16 @@ class HitInfo
         float t;                            //!< The hit distance
         Vector3 P;                          //!< The hit point
         Vector3 N;                          //!< Shading normal vector
+        Vector3 Ng;                         //!< Geometric normal, for offsetting ray origins
         const Material* material;           //!< Material of the intersected object
         Object  * object;             //!< Material of the intersected object
+        unsigned int primitive;       //!< Index of the intersected triangle if the object is a mesh
 
         //! Default constructor.
         explicit HitInfo(float t = 0.0f,
                 const Vector3& P = Vector3(),
                 const Vector3& N = Vector3(0.0f, 1.0f, 0.0f)) :
-            t(t), P(P), N(N), material (0)
+            t(t), P(P), N(N), Ng(N), material (0), primitive(0)
     {
         // empty
     }
@@ -55,7 +70,8 @@ class Ray
             float _d[4] = {d.x, d.y, d.z, d.x};
 
             d_SSE = _mm_sub_ps(_zero, _mm_loadu_ps(_d));
-            d_SSE_rcp = _mm_rcp_ps(_mm_loadu_ps(_d));
+            //Exact reciprocal, the box test must not miss boxes the ray only touches
+            d_SSE_rcp = _mm_div_ps(_mm_set1_ps(1.0f), _mm_loadu_ps(_d));
             o_SSE = _mm_loadu_ps(_o);
         }
 #endif
@@ -92,9 +108,9 @@ class Ray
             float phi = asin(sqrt(u1));
             float theta = 2.0f * PI * u2;
 
-            Ray random = alignToVector(hitInfo.N, hitInfo.P, theta, phi);
+            Vector3 dir = alignHemisphereToVector(hitInfo.N, theta, phi);
+            Ray random(offsetRayOrigin(hitInfo.P, hitInfo.Ng, dir), dir);
             random.isDiffuse = true;
-            random.o += random.d*epsilon;
 
             return random;
         }
@@ -105,7 +121,8 @@ class Ray
             float phi = asin(sqrt(frand()));
             float theta = 2.0f * PI * frand();
 
-            Ray random = alignToVector(hitInfo.N, hitInfo.P, theta, phi);
+            Vector3 dir = alignHemisphereToVector(hitInfo.N, theta, phi);
+            Ray random(offsetRayOrigin(hitInfo.P, hitInfo.Ng, dir), dir);
             random.isDiffuse = true;
 
             return random;
@@ -128,7 +145,7 @@ class Ray
 //#else
             Vector3 d_r = d - 2. * dot(hitInfo.N, d) * hitInfo.N;
 			d_r.normalize();
-            Ray reflect(hitInfo.P, d_r);
+            Ray reflect(offsetRayOrigin(hitInfo.P, hitInfo.Ng, d_r), d_r);
             return reflect;
 //#endif
         }
@@ -204,7 +221,7 @@ class Ray
 //
 //            return alignToVector(d_r, hitInfo.P, theta, phi);
 //            #else
-            return Ray(hitInfo.P, d_r);
+            return Ray(offsetRayOrigin(hitInfo.P, hitInfo.Ng, d_r), d_r);
 //            #endif
         }
 
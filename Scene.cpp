@@ -1,5 +1,3 @@
-
-#ifndef PHOTON_MAPPING
 #include "Utility.h"
 #include <cmath>
 #include <iostream>
@@ -10,7 +8,11 @@
 #include "Image.h"
 #include "Console.h"
 #include "Sphere.h"
+#include "Triangle.h"
+#include "Instance.h"
 #include "DirectionalAreaLight.h"
+#include <map>
+#include <climits>
 
 #ifdef STATS
 #include "Stats.h"
@@ -26,6 +28,33 @@ using namespace std;
 
 Scene * g_scene = 0;
 
+Scene::~Scene()
+{
+    std::map<std::string, SharedMesh*>::iterator it;
+    for (it = m_sharedMeshes.begin(); it != m_sharedMeshes.end(); it++)
+    {
+        TriangleMesh *mesh = it->second->getObject()->getMesh();
+        delete it->second;
+        delete mesh;
+    }
+}
+
+SharedMesh*
+Scene::sharedMesh(const std::string& filename)
+{
+    SharedMesh *&shared = m_sharedMeshes[filename];
+    if (shared == 0)
+    {
+        TriangleMesh * mesh = new TriangleMesh();
+        mesh->load(filename.c_str());
+        shared = new SharedMesh(mesh);
+        shared->setCacheFile(filename + ".bvh");
+    }
+    shared->setSpatialSplits(spatialSplits());
+    shared->setBuilder(bvhBuilder());
+    return shared;
+}
+
 void
 Scene::openGL(Camera *cam)
 {
@@ -69,6 +98,22 @@ Scene::preCalc()
     debug("Done building BVH. Time spent: %lf\n", t1);
 }
 
+void
+Scene::refit()
+{
+    debug("Refitting BVH...\n");
+    double t1 = -getTime();
+    Objects::iterator it;
+    for (it = m_objects.begin(); it != m_objects.end(); it++)
+    {
+        Object* pObject = *it;
+        pObject->preCalc();
+    }
+    int rebuilt = m_bvh.refit();
+    t1 += getTime();
+    debug("Done refitting BVH, %d subtrees rebuilt. Time spent: %lf\n", rebuilt, t1);
+}
+
 inline float tonemapValue(float value, float maxIntensity)
 {
 //    value = min(max(value,0.f), 1.f);
@@ -208,8 +253,6 @@ Scene::trace(HitInfo& minHit, const Ray& ray, float tMin, float tMax) const
         }
     }
 
-    minHit.P -= ray.d*epsilon;
-
     if (result)
     {
         //Bump mapping
@@ -219,7 +262,7 @@ Scene::trace(HitInfo& minHit, const Ray& ray, float tMin, float tMax) const
         if (minHit.material->GetLookupCoordinates() == UV)
         {
             //Take a few samples to calculate the derivative
-            tex_coord2d_t center = minHit.object->toUVCoordinates(minHit.P);
+            tex_coord2d_t center = minHit.object->primitiveUVCoordinates(minHit.primitive, minHit.P);
             float u = center.u, v = center.v;
             float u1 = minHit.material->bumpHeight2D(tex_coord2d_t(u-delta, v)), 
                   u2 = minHit.material->bumpHeight2D(tex_coord2d_t(u+delta, v)),
@@ -284,10 +327,18 @@ bool Scene::traceScene(const Ray& ray, Vector3& shadeResult, int depth)
             if (rnd < prob[0])
 			{
 				Vector3 diffuseResult;
-				Ray diffuseRay = ray.diffuse(hitInfo);
 
-				if (traceScene(diffuseRay, diffuseResult, depth))
-					shadeResult = diffuseResult * hitInfo.material->getDiffuse() / hitInfo.material->getDiffuse().average();
+				if (m_photonMap.size() > 0)
+				{
+					//Reflected radiance from the photon maps, E/PI for a white surface
+					shadeResult = photonIrradiance(hitInfo) / PI * hitInfo.material->getDiffuse() / hitInfo.material->getDiffuse().average();
+				}
+				else
+				{
+					Ray diffuseRay = ray.diffuse(hitInfo);
+					if (traceScene(diffuseRay, diffuseResult, depth))
+						shadeResult = diffuseResult * hitInfo.material->getDiffuse() / hitInfo.material->getDiffuse().average();
+				}
             }
             else if (rnd < prob[1])
             {
@@ -298,8 +349,6 @@ bool Scene::traceScene(const Ray& ray, Vector3& shadeResult, int depth)
             }
             else if (rnd < prob[2])
             {
-                //Push the hit point inside the refractive object (or outside if on the way out)
-                hitInfo.P += ray.d*epsilon*2.;
 			    float Rs = ray.getReflectionCoefficient(hitInfo); //Coefficient from fresnel
 
                 if (frand() < Rs)
@@ -335,6 +384,430 @@ bool Scene::traceScene(const Ray& ray, Vector3& shadeResult, int depth)
     return hit;
 }
 
+void Scene::generatePhotonMap()
+{
+    double t1;
+    const unsigned long long hash = photonMapHash();
+    const std::string globalFile = m_photonMapCache + ".global.pmap";
+    const std::string causticFile = m_photonMapCache + ".caustic.pmap";
+
+    if (!m_photonMapCache.empty())
+    {
+        t1 = -getTime();
+        if (m_photonMap.load(globalFile.c_str(), hash) && m_causticMap.load(causticFile.c_str(), hash))
+        {
+            m_photonsEmitted = (long int)m_lights.size() * m_photonsPerLight;
+            t1 += getTime();
+            debug("Loaded %d global and %d caustic photons from %s. Time spent: %lf\n",
+                  m_photonMap.size(), m_causticMap.size(), m_photonMapCache.c_str(), t1);
+            precomputeIrradiance();
+            return;
+        }
+    }
+
+    debug("Tracing photons...\n");
+    t1 = -getTime();
+    m_photonsEmitted = 0;
+    tracePhotons();
+    traceCausticPhotons();
+    t1 += getTime();
+    debug("Done tracing photons. Time spent: %lf\n", t1);
+    debug("Stored %d global and %d caustic photons. Peak memory: %.1f MB\n",
+          m_photonMap.size(), m_causticMap.size(), getPeakMemory());
+
+    debug("Balancing photon maps...\n");
+    t1 = -getTime();
+    m_photonMap.balance();
+    m_causticMap.balance();
+    t1 += getTime();
+    debug("Done balancing photon maps. Time spent: %lf\n", t1);
+
+    if (!m_photonMapCache.empty())
+    {
+        if (m_photonMap.save(globalFile.c_str(), hash) && m_causticMap.save(causticFile.c_str(), hash))
+            debug("Saved photon maps to %s\n", m_photonMapCache.c_str());
+        else
+            debug("Could not save photon maps to %s\n", m_photonMapCache.c_str());
+    }
+
+    precomputeIrradiance();
+
+#ifdef PHOTON_BENCHMARK
+    m_photonMap.benchmark_lookups(100000, (int)PHOTON_SAMPLES, PHOTON_MAX_DIST);
+    m_photonMap.benchmark_lookups(100000, 50, PHOTON_MAX_DIST);
+#endif
+}
+
+void Scene::precomputeIrradiance()
+{
+    if (m_irradianceRatio <= 0)
+        return;
+
+    debug("Precomputing irradiance...\n");
+    double t1 = -getTime();
+    m_photonMap.precompute_irradiance(m_irradianceRatio, m_irradiancePhotons, PHOTON_MAX_DIST);
+    t1 += getTime();
+    debug("Done precomputing irradiance. Time spent: %lf\n", t1);
+}
+
+Vector3 Scene::photonIrradiance(const HitInfo& hit) const
+{
+    const float pos[3] = { hit.P.x, hit.P.y, hit.P.z };
+    const float normal[3] = { hit.N.x, hit.N.y, hit.N.z };
+    float global[3], caustic[3] = { 0, 0, 0 };
+
+    //The precomputed irradiance at the nearest photon replaces the gather of the global map
+    if (!m_photonMap.has_precomputed_irradiance() ||
+        !m_photonMap.irradiance_lookup(global, pos, normal, PHOTON_MAX_DIST))
+        m_photonMap.irradiance_estimate(global, pos, normal, PHOTON_MAX_DIST, (int)PHOTON_SAMPLES);
+    if (m_causticMap.size() > 0)
+        m_causticMap.irradiance_estimate(caustic, pos, normal, PHOTON_MAX_DIST, (int)PHOTON_SAMPLES);
+
+    return Vector3(global[0]+caustic[0], global[1]+caustic[1], global[2]+caustic[2]);
+}
+
+//FNV-1a hash of everything that changes the traced photons: geometry, materials, lights and photon settings
+static void hashBytes(unsigned long long& hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+}
+
+static void hashVector(unsigned long long& hash, const Vector3& v)
+{
+    hashBytes(hash, &v.x, sizeof(float));
+    hashBytes(hash, &v.y, sizeof(float));
+    hashBytes(hash, &v.z, sizeof(float));
+}
+
+//The diffuse color of an object at p, looked up like the photon tracer does.
+//Textures can't be hashed directly, so they are sampled where it looks them up.
+static void hashDiffuse(unsigned long long& hash, const Object* object, unsigned int primitive, const Vector3& p)
+{
+    const Material* m = object->getMaterial();
+    if (m->GetLookupCoordinates() == UV)
+        hashVector(hash, m->diffuse2D(object->primitiveUVCoordinates(primitive, p)));
+    else
+        hashVector(hash, m->diffuse3D(tex_coord3d_t(p.x, p.y, p.z)));
+}
+
+//The vertex indices and vertices of triangles first to first+count-1 of a mesh
+static void hashTriangles(unsigned long long& hash, TriangleMesh* mesh, int first, int count)
+{
+    for (int t = first; t < first+count; t++)
+    {
+        const TriangleMesh::TupleI3 vInd = mesh->vIndices()[t];
+        hashBytes(hash, vInd.v, sizeof(vInd.v));
+        for (int k = 0; k < 3; k++)
+            hashVector(hash, mesh->vertices()[vInd.v[k]]);
+    }
+}
+
+//The diffuse color of the object at the corners and centers of the triangles,
+//which are moved by transform if the object is an instance of the mesh
+static void hashTriangleDiffuse(unsigned long long& hash, const Object* object, TriangleMesh* mesh, int first, int count, const Matrix4x4* transform = 0)
+{
+    for (int t = first; t < first+count; t++)
+    {
+        const TriangleMesh::TupleI3 vInd = mesh->vIndices()[t];
+        Vector3 center(0.f);
+        for (int k = 0; k < 3; k++)
+        {
+            Vector3 v = mesh->vertices()[vInd.v[k]];
+            if (transform) v = *transform * v;
+            hashDiffuse(hash, object, t, v);
+            center += v;
+        }
+        hashDiffuse(hash, object, t, center/3);
+    }
+}
+
+//The index of the first occurrence of key, or -1 if it is the first one
+template <class Key>
+static int firstOccurrence(std::map<Key, int>& occurrences, const Key& key, int index)
+{
+    typename std::map<Key, int>::iterator it = occurrences.find(key);
+    if (it != occurrences.end())
+        return it->second;
+    occurrences[key] = index;
+    return -1;
+}
+
+static void hashObjects(unsigned long long& hash, const Objects& objects)
+{
+    //Instances hash their mesh only at its first instance, and their diffuse
+    //color only at the first instance of the mesh with their material. Both
+    //are in object space unless the material is looked up in 3D.
+    std::map<SharedMesh*, int> sharedMeshes;
+    std::map<std::pair<SharedMesh*, const Material*>, int> sharedMaterials;
+
+    int n = objects.size();
+    hashBytes(hash, &n, sizeof(n));
+    for (int i = 0; i < n; i++)
+    {
+        hashVector(hash, objects[i]->coordsMin());
+        hashVector(hash, objects[i]->coordsMax());
+        hashVector(hash, objects[i]->center());
+
+        const Material* m = objects[i]->getMaterial();
+        hashVector(hash, m->getDiffuse());
+        hashVector(hash, m->getReflection());
+        hashVector(hash, m->getRefraction());
+        float ior = m->getRefractionIndex();
+        hashBytes(hash, &ior, sizeof(ior));
+
+        if (MeshObject *mesh = dynamic_cast<MeshObject*>(objects[i]))
+        {
+            hashTriangles(hash, mesh->getMesh(), 0, mesh->getMesh()->numTris());
+            hashTriangleDiffuse(hash, mesh, mesh->getMesh(), 0, mesh->getMesh()->numTris());
+        }
+        else if (Triangle *triangle = dynamic_cast<Triangle*>(objects[i]))
+        {
+            hashTriangles(hash, triangle->getMesh(), triangle->getIndex(), 1);
+            hashTriangleDiffuse(hash, triangle, triangle->getMesh(), triangle->getIndex(), 1);
+        }
+        else if (Instance *instance = dynamic_cast<Instance*>(objects[i]))
+        {
+            hashBytes(hash, &instance->getTransform(), sizeof(Matrix4x4));
+
+            SharedMesh *shared = instance->getMesh();
+            TriangleMesh *mesh = shared->getObject()->getMesh();
+            int first = firstOccurrence(sharedMeshes, shared, i);
+            hashBytes(hash, &first, sizeof(first));
+            if (first < 0)
+                hashTriangles(hash, mesh, 0, mesh->numTris());
+
+            if (m->GetLookupCoordinates() == UV)
+            {
+                first = firstOccurrence(sharedMaterials, std::make_pair(shared, m), i);
+                hashBytes(hash, &first, sizeof(first));
+                if (first < 0)
+                    hashTriangleDiffuse(hash, instance, mesh, 0, mesh->numTris(), &instance->getTransform());
+            }
+            else
+                hashTriangleDiffuse(hash, instance, mesh, 0, mesh->numTris(), &instance->getTransform());
+        }
+        else
+        {
+            hashDiffuse(hash, objects[i], 0, objects[i]->center());
+        }
+    }
+}
+
+unsigned long long Scene::photonMapHash() const
+{
+    unsigned long long hash = 14695981039346656037ULL;
+
+    hashObjects(hash, m_objects);
+    hashObjects(hash, m_unboundedObjects);
+
+    int n = m_lights.size();
+    hashBytes(hash, &n, sizeof(n));
+    for (int i = 0; i < n; i++)
+    {
+        hashVector(hash, m_lights[i]->position());
+        hashVector(hash, m_lights[i]->color());
+        float wattage = m_lights[i]->wattage();
+        hashBytes(hash, &wattage, sizeof(wattage));
+    }
+
+    int settings[4] = { m_photonsPerLight, m_causticPhotonsPerLight, PhotonBlockSize, TRACE_DEPTH_PHOTONS };
+    hashBytes(hash, settings, sizeof(settings));
+    hashBytes(hash, &m_photonSeed, sizeof(m_photonSeed));
+
+    return hash;
+}
+
+int Scene::maxStoredPhotons(int nPhotons)
+{
+    long long n = (long long)nPhotons*TRACE_DEPTH_PHOTONS*MaxLights + MaxLights*10000;
+    return (int)std::min(n, (long long)INT_MAX-1);
+}
+
+void Scene::setPhotonCount(int nPhotons, int nCausticPhotons)
+{
+    m_photonsPerLight = nPhotons;
+    m_causticPhotonsPerLight = nCausticPhotons;
+    m_photonMap.set_max_photons(maxStoredPhotons(nPhotons));
+    m_causticMap.set_max_photons(maxStoredPhotons(nCausticPhotons));
+}
+
+//Fill the global photon map. Photons are stored at every diffuse surface they hit.
+void Scene::tracePhotons()
+{
+    m_photonMap.empty();
+    for (int l = 0; l < (int)m_lights.size(); l++)
+    {
+        int emitted = emitPhotons(m_photonMap, l, m_photonsPerLight, false);
+        if (emitted > 0)
+            m_photonMap.scale_photon_power(1.f/(float)emitted);
+        m_photonsEmitted += emitted;
+    }
+}
+
+//Fill the caustic photon map. Photons are aimed at the specular objects and only stored after a specular bounce.
+void Scene::traceCausticPhotons()
+{
+    m_causticMap.empty();
+    if (m_specObjects.size() == 0) return;
+
+    for (int l = 0; l < (int)m_lights.size(); l++)
+    {
+        int emitted = emitPhotons(m_causticMap, l, m_causticPhotonsPerLight, true);
+        if (emitted > 0)
+            m_causticMap.scale_photon_power(1.f/(float)emitted);
+    }
+}
+
+//Emit nPhotons from a light source in parallel. The photons are split into fixed blocks that each get
+//their own buffer and random seed, and the buffers are appended in block order, so the result only
+//depends on the photon seed and not on how the blocks were scheduled. Returns the number of photons
+//emitted by the blocks that fit in the map.
+int Scene::emitPhotons(Photon_map& map, int lightIndex, int nPhotons, bool bCausticRay)
+{
+    PointLight *light = m_lights[lightIndex];
+    const Vector3 power = light->color() * light->wattage();
+    const int nBlocks = (nPhotons + PhotonBlockSize - 1) / PhotonBlockSize;
+    Photon_buffer *buffers = new Photon_buffer[nBlocks];
+
+    #ifdef OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int b = 0; b < nBlocks; b++)
+    {
+        //Every map, light and block gets its own seed
+        unsigned long long key = ((unsigned long long)bCausticRay << 62) | ((unsigned long long)lightIndex << 31) | (unsigned long long)b;
+        seedThreadRandom((long)((unsigned long long)m_photonSeed + key));
+
+        int end = std::min((b+1)*PhotonBlockSize, nPhotons);
+        for (int i = b*PhotonBlockSize; i < end; i++)
+        {
+            //Pushed off the light, which is itself an object of the scene
+            Vector3 origin = light->samplePhotonOrigin();
+            if (!bCausticRay)
+            {
+                Vector3 direction = light->samplePhotonDirection();
+                tracePhoton(buffers[b], Ray(origin+epsilon*direction, direction), power, 0, false);
+            }
+            else
+            {
+                //Aim at a random specular object and scale by the fraction of the light's photons that would have hit it
+                Object *target = m_specObjects[std::min((int)(frand()*m_specObjects.size()), (int)m_specObjects.size()-1)];
+                float ratio = light->getLightRatio(target) * m_specObjects.size();
+                Vector3 direction = light->samplePhotonDirection(target);
+                tracePhoton(buffers[b], Ray(origin+epsilon*direction, direction), power*ratio, 0, true);
+            }
+        }
+    }
+
+    //Grow the map once to the number of photons actually stored
+    int nStored = 0;
+    for (int b = 0; b < nBlocks; b++)
+        nStored += buffers[b].size();
+    map.reserve(map.size() + nStored);
+
+    //A block that does not fit is dropped whole, along with the blocks after it,
+    //so the photons that are kept are scaled by the number of photons they came from
+    int emitted = 0;
+    for (int b = 0; b < nBlocks; b++)
+    {
+        if (map.size() + buffers[b].size() > map.max_size())
+        {
+            warning("Photon map full, dropped %d of %d photons of light %d\n", nPhotons-emitted, nPhotons, lightIndex);
+            break;
+        }
+        map.store_block(buffers[b]);
+        emitted = std::min((b+1)*PhotonBlockSize, nPhotons);
+    }
+    delete[] buffers;
+
+    return emitted;
+}
+
+//Trace a single photon through the scene and store it in the buffer. Returns the number of photons stored.
+int Scene::tracePhoton(Photon_buffer& buffer, const Ray& ray, const Vector3& power, int depth, bool bCausticRay)
+{
+    if (depth >= TRACE_DEPTH_PHOTONS) return 0;
+
+    HitInfo hit;
+
+    if (!trace(hit, ray, 0.0f, MIRO_TMAX)) return 0;
+
+    //Photons that reach a light are absorbed
+    if (dynamic_cast<PointLight*>(hit.object) != 0) return 0;
+
+    //The walls are one sided, photons that hit the back of one would leak through it
+    if (dot(ray.d, hit.N) > 0) return 0;
+
+    Vector3 diffuseColor;
+    if (hit.material->GetLookupCoordinates() == UV)
+        diffuseColor = hit.material->diffuse2D(hit.object->primitiveUVCoordinates(hit.primitive, hit.P));
+    else
+        diffuseColor = hit.material->diffuse3D(tex_coord3d_t(hit.P.x, hit.P.y, hit.P.z));
+
+    int nPhotons = 0;
+    bool diffuse = diffuseColor.average() > 0;
+
+    if (diffuse)
+    {
+        //Caustic photons are only stored after at least one specular bounce, and end at the first diffuse surface
+        if (!bCausticRay || depth > 0)
+        {
+            float pos[3] = { hit.P.x, hit.P.y, hit.P.z };
+            float dir[3] = { ray.d.x, ray.d.y, ray.d.z };
+            float pwr[3] = { power.x, power.y, power.z };
+            buffer.store(pwr, pos, dir);
+            nPhotons++;
+        }
+        if (bCausticRay) return nPhotons;
+    }
+
+    //Russian roulette
+    //[ --diffuse-- | --specular (refl.)-- | --transmission-- | --absorb-- ]
+    float prob[3], rnd = frand();
+    prob[0] = bCausticRay ? 0 : diffuseColor.average();
+    prob[1] = prob[0] + hit.material->getReflection().average();
+    prob[2] = prob[1] + hit.material->getRefraction().average();
+
+    if (rnd > prob[2])
+    {
+        //Absorbed
+        return nPhotons;
+    }
+
+    if (rnd < prob[0])
+    {
+        Ray r = ray.diffuse(hit);
+        return nPhotons + tracePhoton(buffer, r, diffuseColor*power/prob[0], depth+1, bCausticRay);
+    }
+    else if (rnd < prob[1])
+    {
+        Ray refl = ray.reflect(hit);
+        return nPhotons + tracePhoton(buffer, refl, power*hit.material->getReflection()/(prob[1]-prob[0]), depth+1, bCausticRay);
+    }
+    else
+    {
+        Vector3 transmitted = power*hit.material->getRefraction()/(prob[2]-prob[1]);
+
+        float Rs = ray.getReflectionCoefficient(hit); //Coefficient from fresnel
+
+        if (frand() < Rs)
+        {
+            Ray refl = ray.reflect(hit);
+            return nPhotons + tracePhoton(buffer, refl, transmitted, depth+1, bCausticRay);
+        }
+        else
+        {
+            Ray refr = ray.refract(hit);
+            return nPhotons + tracePhoton(buffer, refr, transmitted, depth+1, bCausticRay);
+        }
+    }
+}
+
 Vector3 Scene::getEnvironmentMap(const Ray & ray)
 {
 	Vector3 envResult;
@@ -366,4 +839,3 @@ Vector3 Scene::getEnvironmentMap(const Ray & ray)
 	}
 	return envResult;
 }
-#endif
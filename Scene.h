@@ -1,4 +1,3 @@
-#ifndef PHOTON_MAPPING
 #ifndef CSE168_SCENE_H_INCLUDED
 #define CSE168_SCENE_H_INCLUDED
 
@@ -8,16 +7,21 @@
 #include "BVH.h"
 #include "Texture.h"
 #include "PhotonMap.h"
+#include <string>
+#include <map>
 
 class Camera;
 class Image;
+class SharedMesh;
 
 class Scene
 {
 public:
 	Scene() 
-		: m_photonMap(PhotonsPerLightSource*TRACE_DEPTH*MaxLights+MaxLights*10000), m_causticMap(CausticPhotonsPerLightSource*TRACE_DEPTH*MaxLights+MaxLights*10000), m_environment(0), m_bgColor(Vector3(0.0f)), m_photonsEmitted(0)
+		: m_photonMap(maxStoredPhotons(PhotonsPerLightSource)), m_causticMap(maxStoredPhotons(CausticPhotonsPerLightSource)), m_environment(0), m_bgColor(Vector3(0.0f)), m_photonsEmitted(0), m_photonsPerLight(PhotonsPerLightSource), m_causticPhotonsPerLight(CausticPhotonsPerLightSource), m_photonSeed(0), m_irradianceRatio(0), m_irradiancePhotons(0)
 	{}
+    virtual ~Scene();
+
     void addObject(Object* pObj)        
     { 
         if (pObj->isBounded()) m_objects.push_back(pObj);
@@ -27,15 +31,38 @@ public:
     const Objects* objects() const      {return &m_objects;}
     const Objects* specObjects() const      {return &m_specObjects;}
 
+    //The mesh of a model file, loaded the first time and shared by every
+    //instance of the model in this scene. The scene owns it.
+    SharedMesh* sharedMesh(const std::string& filename);
+
     void addLight(PointLight* pObj)     {m_lights.push_back(pObj);}
     const Lights* lights() const        {return &m_lights;}
 
+    //Trace the global and caustic photon maps. Once they hold photons,
+    //traceScene takes the light at diffuse hits from them instead of
+    //tracing further.
     void generatePhotonMap();
+    void precomputeIrradiance();
+    //Irradiance at a diffuse hit from the global and caustic photon maps
+    Vector3 photonIrradiance(const HitInfo& hit) const;
 
     void preCalc();
+    //Updates the BVH after objects or mesh vertices moved, for animations.
+    //Much faster than preCalc, but objects must not be added or removed.
+    void refit();
+    //Spatial splits in the BVH (see BVH::setSpatialSplits). Set it before
+    //adding models, whose meshes get their own BVH, and before preCalc.
+    void setSpatialSplits(bool enable) { m_bvh.setSpatialSplits(enable); }
+    bool spatialSplits() const { return m_bvh.spatialSplits(); }
+    //How the BVH is built (see BVH::Builder). Like the spatial splits, set
+    //it before adding models and before preCalc.
+    void setBVHBuilder(BVH::Builder builder) { m_bvh.setBuilder(builder); }
+    BVH::Builder bvhBuilder() const { return m_bvh.builder(); }
+    //Caches the scene BVH in a file (see BVH::setCacheFile), set before preCalc
+    void setBVHCacheFile(const std::string& file) { m_bvh.setCacheFile(file); }
     void openGL(Camera *cam);
 
-    void raytraceImage(Camera *cam, Image *img);
+    virtual void raytraceImage(Camera *cam, Image *img);
     void raytraceImage_Metropolis(Camera *cam, Image *img);
     bool trace(HitInfo& minHit, const Ray& ray,
                float tMin = 0.0f, float tMax = MIRO_TMAX) const;
@@ -43,9 +70,24 @@ public:
 
     void tracePhotons();
     void traceCausticPhotons();
-    int tracePhoton(const Vector3& position, const Vector3& direction, const Vector3& power, int depth, bool bCausticRay=false);
+    int emitPhotons(Photon_map& map, int lightIndex, int nPhotons, bool bCausticRay);
+    int tracePhoton(Photon_buffer& buffer, const Ray& ray, const Vector3& power, int depth, bool bCausticRay=false);
 	long int GetPhotonsEmitted() { return m_photonsEmitted; }
 
+    //Photons emitted per light source for the global and the caustic map
+    void setPhotonCount(int nPhotons, int nCausticPhotons);
+
+    //Photon emission is reproducible for a given seed, independent of the number of threads
+    void setPhotonSeed(long seed) { m_photonSeed = seed; }
+
+    //Precompute irradiance at every ratio'th global photon from its nPhotons nearest photons (0 disables)
+    void setIrradianceCache(int ratio, int nPhotons) { m_irradianceRatio = ratio; m_irradiancePhotons = nPhotons; }
+
+    //Load the photon maps from <name>.global.pmap and <name>.caustic.pmap if they were saved for this scene,
+    //otherwise trace them and save them there
+    void setPhotonMapCache(const std::string& name) { m_photonMapCache = name; }
+    unsigned long long photonMapHash() const;
+
 	void setEnvironment(Texture* environment) { m_environment = environment; }
 	Vector3 getEnvironmentMap(const Ray & ray);
 
@@ -69,11 +111,21 @@ protected:
 
     static const int PhotonsPerLightSource = 100000;
     static const int CausticPhotonsPerLightSource = 100000;
+    static const int PhotonBlockSize = 1024; //Photons emitted per parallel work block
+
+    //Size of a photon map for nPhotons per light source, enough for a photon stored at every bounce with up to MaxLights lights
+    static int maxStoredPhotons(int nPhotons);
 
 	long int m_photonsEmitted;
+	int m_photonsPerLight;
+	int m_causticPhotonsPerLight;
+	long m_photonSeed;
+	int m_irradianceRatio;
+	int m_irradiancePhotons;
+	std::string m_photonMapCache;
+    std::map<std::string, SharedMesh*> m_sharedMeshes;
 };
 
 extern Scene * g_scene;
 
 #endif // CSE168_SCENE_H_INCLUDED
-#endif
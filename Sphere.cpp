@@ -65,6 +65,7 @@ Sphere::intersect(HitInfo& result, const Ray& ray,
     result.P = ray.o + result.t*ray.d;
     result.N = (result.P-m_center);
     result.N.normalize();
+    result.Ng = result.N;
     result.material = this->m_material;
 
     return true;
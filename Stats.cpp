@@ -4,6 +4,8 @@
 
 int Stats::BVH_Nodes = 0;
 int Stats::BVH_LeafNodes = 0;
+int Stats::BVH_SpatialSplits = 0;
+int Stats::BVH_References = 0;
 int Stats::Rays = 0;
 int Stats::Primary_Rays = 0;
 int Stats::Secondary_Rays = 0;
@@ -17,6 +19,8 @@ void Stats::PrintStats()
 	printf("\n~~Ray Tracer Stats~~\n\n");
 	printf("BVH Nodes: %d\n", BVH_Nodes);
 	printf("BVH Leaf Nodes: %d\n", BVH_LeafNodes);
+	printf("BVH Spatial Splits: %d\n", BVH_SpatialSplits);
+	printf("BVH Leaf References: %d\n", BVH_References);
 	printf("Total Rays: %d\n", Primary_Rays + Secondary_Rays + Shadow_Rays);
 	printf("Primary Rays: %d\n", Primary_Rays);
 	printf("Secondary Rays: %d\n", Secondary_Rays);
@@ -7,6 +7,8 @@ public:
 
 	static int BVH_Nodes;
 	static int BVH_LeafNodes;
+	static int BVH_SpatialSplits;
+	static int BVH_References;
 	static int Rays;
 	static int Primary_Rays;
 	static int Secondary_Rays;
@@ -1,10 +1,11 @@
+#include <algorithm>
 #include "TriangleMesh.h"
-#include "Triangle.h"
-#ifdef PHOTON_MAPPING
-#include "PScene.h"
-#else
-#include "Scene.h"
+#include "MeshObject.h"
+#include "Ray.h"
+#ifndef WIN32
+#include <sys/mman.h>
 #endif
+#include "Scene.h"
 
 void 
 createTriangleMesh(const char* filename, Material *mat, Scene* scene, Vector3 position, float rotY, Vector3 scale)
@@ -14,14 +15,9 @@ createTriangleMesh(const char* filename, Material *mat, Scene* scene, Vector3 po
     Matrix4x4 m_trans(Vector4(1,0,0,0), Vector4(0,1,0,0), Vector4(0,0,1,0), Vector4(position.x, position.y, position.z, 1));
     Matrix4x4 m_scale(Vector4(scale.x,0,0,0), Vector4(0,scale.y,0,0), Vector4(0,0,scale.z,0), Vector4(0, 0, 0, 1));
 	mesh->load(filename, m_trans*m_rot*m_scale);
-    for (int i = 0; i < mesh->numTris(); i++)
-    {
-		Triangle *tri = new Triangle();
-		tri->setMesh(mesh);
-		tri->setIndex(i);
-		tri->setMaterial(mat);
-		g_scene->addObject(tri);
-    }
+    MeshObject *obj = new MeshObject(mesh);
+    obj->setMaterial(mat);
+    g_scene->addObject(obj);
 }
 
 
@@ -31,13 +27,27 @@ TriangleMesh::TriangleMesh() :
     m_texCoords(0),
     m_normalIndices(0),
     m_vertexIndices(0),
-    m_texCoordIndices(0)
+    m_texCoordIndices(0),
+    m_numVertices(0),
+    m_numNormals(0),
+    m_numTris(0),
+    m_numTextCoords(0),
+    m_mapping(0),
+    m_mappingSize(0),
+    m_sourceHash(0)
 {
 
 }
 
 TriangleMesh::~TriangleMesh()
 {
+#ifndef WIN32
+    if (m_mapping)
+    {
+        munmap(m_mapping, m_mappingSize);
+        return;
+    }
+#endif
     delete [] m_normals;
     delete [] m_vertices;
     delete [] m_texCoords;
@@ -49,17 +59,141 @@ TriangleMesh::~TriangleMesh()
 void TriangleMesh::setVertex(int index, const Vector3 &v)
 {
     m_vertices[index] = v;
-
-    #ifdef __SSE4_1__
-    m_SSEvertices[index] = _mm_set_ps(v.x, v.y, v.z, 0.0f);
-    #endif
+    m_sourceHash = 0;
 }
 
 void TriangleMesh::setNormal(int index, const Vector3 &n)
 {
     m_normals[index] = n;
+}
+
+Vector3 TriangleMesh::triangleMin(unsigned int i) const
+{
+    const TupleI3& ti3 = m_vertexIndices[i];
+    const Vector3& A = m_vertices[ti3.v[0]];
+    const Vector3& B = m_vertices[ti3.v[1]];
+    const Vector3& C = m_vertices[ti3.v[2]];
+
+    return Vector3(std::min(A.x, std::min(B.x, C.x)),
+                   std::min(A.y, std::min(B.y, C.y)),
+                   std::min(A.z, std::min(B.z, C.z)));
+}
+
+Vector3 TriangleMesh::triangleMax(unsigned int i) const
+{
+    const TupleI3& ti3 = m_vertexIndices[i];
+    const Vector3& A = m_vertices[ti3.v[0]];
+    const Vector3& B = m_vertices[ti3.v[1]];
+    const Vector3& C = m_vertices[ti3.v[2]];
+
+    return Vector3(std::max(A.x, std::max(B.x, C.x)),
+                   std::max(A.y, std::max(B.y, C.y)),
+                   std::max(A.z, std::max(B.z, C.z)));
+}
+
+Vector3 TriangleMesh::triangleCenter(unsigned int i) const
+{
+    const TupleI3& ti3 = m_vertexIndices[i];
+    const Vector3& A = m_vertices[ti3.v[0]];
+    Vector3 BmA = m_vertices[ti3.v[1]]-A, CmA = m_vertices[ti3.v[2]]-A;
+
+    return A + BmA/3 + CmA/3;
+}
+
+Vector3 TriangleMesh::triangleNormal(unsigned int i, float beta, float gamma) const
+{
+    const TupleI3& ni3 = m_normalIndices[i];
+
+    return (1-beta-gamma)*m_normals[ni3.v[0]] + beta*m_normals[ni3.v[1]] + gamma*m_normals[ni3.v[2]];
+}
+
+bool TriangleMesh::intersectTriangle(unsigned int i, HitInfo& result, const Ray& r, float tMin, float tMax) const
+{
+    const TupleI3& ti3 = m_vertexIndices[i];
+
+    const Vector3 & A = m_vertices[ti3.v[0]];
+    const Vector3 & B = m_vertices[ti3.v[1]];
+    const Vector3 & C = m_vertices[ti3.v[2]];
+
+    //Watertight test like in the BVH: permute the axes so that the ray
+    //direction is largest along z, and shear the triangle so that the ray
+    //is the z axis through the origin
+    int kz = 0;
+    for (int k = 1; k < 3; k++)
+        if (fabs(r.d[k]) > fabs(r.d[kz])) kz = k;
+    int kx = (kz+1)%3, ky = (kx+1)%3;
+    if (r.d[kz] < 0) std::swap(kx, ky);
+
+    float Sx = r.d[kx]/r.d[kz], Sy = r.d[ky]/r.d[kz], Sz = 1.0f/r.d[kz];
+    Vector3 a = A-r.o, b = B-r.o, c = C-r.o;
+    float Ax = a[kx] - Sx*a[kz], Ay = a[ky] - Sy*a[kz],
+          Bx = b[kx] - Sx*b[kz], By = b[ky] - Sy*b[kz],
+          Cx = c[kx] - Sx*c[kz], Cy = c[ky] - Sy*c[kz];
+
+    //Scaled barycentric coordinates, inside if all have the same sign
+    float U = Cx*By - Cy*Bx, V = Ax*Cy - Ay*Cx, W = Bx*Ay - By*Ax;
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return false;
+
+    float det = U + V + W;
+    if (det == 0) return false;
+
+    float t = Sz*(U*a[kz] + V*b[kz] + W*c[kz]) / det;
+    if (t < tMin || t > tMax) return false;
+
+    float beta = V / det, gamma = W / det;
+    result.P = (1-beta-gamma)*A + beta*B + gamma*C;
+    result.t = t;
+    result.N = triangleNormal(i, beta, gamma);
+    result.Ng = cross(B-A, C-A).normalize();
+
+    return true;
+}
+
+tex_coord2d_t TriangleMesh::triangleUVCoordinates(unsigned int i, const Vector3& xyz) const
+{
+    if (m_numTextCoords == 0)
+        return tex_coord2d_t();
+
+    const TupleI3& vi3 = m_vertexIndices[i];
+    const TupleI3& ti3 = m_texCoordIndices[i];
+
+    const Vector3 & vA = m_vertices[vi3.v[0]];
+    const Vector3 & vB = m_vertices[vi3.v[1]];
+    const Vector3 & vC = m_vertices[vi3.v[2]];
+    const VectorR2 & tA = m_texCoords[ti3.v[0]];
+    const VectorR2 & tB = m_texCoords[ti3.v[1]];
+    const VectorR2 & tC = m_texCoords[ti3.v[2]];
+
+    //discard largest normal component
+    Vector3 BmA = vB-vA, CmA = vC-vA;
+    Vector3 normal = cross(BmA, CmA);
+    int u = 0;
+    int v = 1;
+
+    if (normal.x > normal.z)
+        u = 2;
+    else if (normal.y > normal.z)
+        v = 2;
+
+    // convert to float arrays to alleviate calculations
+    float p[3] = {xyz.x-vA.x, xyz.y-vA.y, xyz.z-vA.z};
+    float b[3] = {vB.x-vA.x, vB.y-vA.y, vB.z-vA.z};
+    float c[3] = {vC.x-vA.x, vC.y-vA.y, vC.z-vA.z};
+
+    //Cramer's rule to determine barycentric coords
+    float detPC = p[u]*c[v] - c[u]*p[v];
+    float detBP = b[u]*p[v] - p[u]*b[v];
+    float detBC = b[u]*c[v] - c[u]*b[v];
+
+    float beta = std::max(detPC / detBC, 0.f);
+    float gamma = std::max(detBP / detBC, 0.f);
+    //this shouldn't happen...but just in case
+    float alpha = std::max(1 - (beta + gamma), 0.f);
+
+    //interpolate vertices texture coords
+    tex_coord2d_t UV;
+    UV.u = alpha * tA.x + beta * tB.x + gamma * tC.x;
+    UV.v = alpha * tA.y + beta * tB.y + gamma * tC.y;
 
-    #ifdef __SSE4_1__
-    m_SSEnormals[index] = _mm_set_ps(n.x, n.y, n.z, 0.0f);
-    #endif
+    return UV;
 }
@@ -1,10 +1,8 @@
 #ifndef CSE168_TRIANGLE_MESH_H_INCLUDED
 #define CSE168_TRIANGLE_MESH_H_INCLUDED
 
-#ifdef __SSE4_1__
-#include <smmintrin.h>
-#endif
 #include "Matrix4x4.h"
+#include "Miro.h"
 
 class TriangleMesh
 {
@@ -12,7 +10,9 @@ public:
     TriangleMesh();
     ~TriangleMesh();
 
-    // load from an OBJ file
+    // load from an OBJ file. The loaded mesh is cached in <file>.mesh,
+    // which is mapped instead of parsing the OBJ file again as long as
+    // the OBJ file and the transform are the same.
     bool load(const char* file, const Matrix4x4& ctm = Matrix4x4());
 
     // for single triangles
@@ -36,38 +36,58 @@ public:
     Vector3* normals()      {return m_normals;}
     VectorR2* texCoords()   {return m_texCoords;}
     
-    #ifdef __SSE4_1__
-    __m128* SSEvertices()     {return m_SSEvertices;}
-    __m128* SSEnormals()      {return m_SSEnormals;}
-    #endif
-    
     TupleI3* vIndices()     {return m_vertexIndices;}
     TupleI3* nIndices()     {return m_normalIndices;}
 	TupleI3* tIndices()		{return m_texCoordIndices;}
     int numTris()           {return m_numTris;}
     int numTextCoords()		{return m_numTextCoords;}
 
-protected:
+    // geometry of triangle i, used by the BVH and by the objects
+    // that reference triangles of this mesh
+    Vector3 triangleMin(unsigned int i) const;
+    Vector3 triangleMax(unsigned int i) const;
+    Vector3 triangleCenter(unsigned int i) const;
+    Vector3 triangleNormal(unsigned int i, float beta, float gamma) const;
+    bool intersectTriangle(unsigned int i, HitInfo& result, const Ray& ray,
+                           float tMin = 0.0f, float tMax = MIRO_TMAX) const;
+    tex_coord2d_t triangleUVCoordinates(unsigned int i, const Vector3& xyz) const;
+
+    // move vertex or normal i, e.g. to animate the mesh. The BVH is
+    // updated by Scene::refit (or SharedMesh::refit for instanced meshes).
     void setVertex(int index, const Vector3 &v);
     void setNormal(int index, const Vector3 &n);
+    int numVertices()       {return m_numVertices;}
+    int numNormals()        {return m_numNormals;}
 
-    void loadObj(FILE* fp, const Matrix4x4& ctm);
+    // identifies the file and transform the mesh was loaded from, so a
+    // cache can be keyed without reading the vertices. It is 0 for meshes
+    // that weren't loaded from a file or had a vertex moved by setVertex.
+    unsigned long long sourceHash() const {return m_sourceHash;}
+
+protected:
+    void loadObj(const char* data, size_t size, const Matrix4x4& ctm);
+    bool loadCache(const char* file, unsigned long long hash);
+    bool saveCache(const char* file, unsigned long long hash) const;
 
     Vector3* m_normals;
     Vector3* m_vertices;
-    #ifdef __SSE4_1__
-    //We use these with the SSE intersection code since _mm_set_ps is terribly slow to do for each test.
-    __m128* m_SSEnormals;
-    __m128* m_SSEvertices;
-    #endif
     VectorR2* m_texCoords;
     
     TupleI3* m_normalIndices;
     TupleI3* m_vertexIndices;
     TupleI3* m_texCoordIndices;
     unsigned int m_numVertices;
+    unsigned int m_numNormals;
     unsigned int m_numTris;
 	unsigned int m_numTextCoords;
+
+    // A mesh loaded from a cache file points into a private mapping
+    // of it, the arrays must not be deleted. Changes to them are
+    // copied on write and never go back to the file.
+    void* m_mapping;
+    size_t m_mappingSize;
+
+    unsigned long long m_sourceHash;
 };
 
 
@@ -1,9 +1,22 @@
 #include <iostream>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include "TriangleMesh.h"
 #include "Console.h"
+#include "Utility.h"
 #include <vector>
+#include <string>
+#include <algorithm>
+#ifdef OPENMP
+#include <omp.h>
+#endif
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #ifndef __GNUC__
 // disable useless warnings
@@ -42,27 +55,79 @@ TriangleMesh::createSingleTriangle()
     m_texCoordIndices[0].v[1] = 1;
     m_texCoordIndices[0].v[2] = 2;
 
-    #ifdef __SSE4_1__
-#ifdef WIN32
-    m_SSEvertices = (__m128*)_aligned_malloc(3 * sizeof(__m128), 16);
-    m_SSEnormals = (__m128*)_aligned_malloc(3 * sizeof(__m128), 16);
-#else
-    m_SSEvertices = new __m128[3];
-    m_SSEnormals = new __m128[3];
-#endif
-	#endif    
-
+    m_numVertices = 3;
+    m_numNormals = 3;
     m_numTris = 1;
+    m_sourceHash = 0;
 }
 
 //************************************************************************
-// You probably don't want to modify the following functions
-// They are for loading .obj files
+// Loading of .obj files
+//
+// The file is mapped and split into chunks of whole lines. The chunks
+// are counted and parsed in parallel, each one writing to its own range
+// of the vertex, normal and face arrays, so the mesh does not depend on
+// the number of threads.
 //************************************************************************
 
+#ifndef WIN32
+static unsigned long long fileHash(const struct stat& st, const Matrix4x4& ctm);
+#endif
+
 bool
 TriangleMesh::load(const char* file, const Matrix4x4& ctm)
 {
+    double t = -getTime();
+
+#ifndef WIN32
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0) close(fd);
+        error("Cannot open \"%s\" for reading\n",file);
+        return false;
+    }
+
+    //The cache is keyed by the OBJ file and the transform
+    const string cacheFile = string(file) + ".mesh";
+    const unsigned long long hash = fileHash(st, ctm);
+
+    //The file name tells apart files with the same inode on other devices
+    m_sourceHash = hash;
+    for (const char* c = file; *c; c++)
+    {
+        m_sourceHash ^= (unsigned char)*c;
+        m_sourceHash *= 1099511628211ULL;
+    }
+
+    if (loadCache(cacheFile.c_str(), hash))
+    {
+        close(fd);
+        t += getTime();
+        debug("Loaded \"%s\" with %d triangles from %s in %lf seconds\n",file,m_numTris,cacheFile.c_str(),t);
+        return true;
+    }
+    debug("Loading \"%s\"...\n", file);
+
+    size_t size = st.st_size;
+    void* data = size > 0 ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        error("Cannot map \"%s\"\n",file);
+        return false;
+    }
+    if (data)
+        madvise(data, size, MADV_SEQUENTIAL);
+
+    loadObj((const char*)data, size, ctm);
+    if (data)
+        munmap(data, size);
+
+    if (!saveCache(cacheFile.c_str(), hash))
+        debug("Could not write the mesh cache %s\n", cacheFile.c_str());
+#else
     FILE *fp = fopen(file, "rb");
     if (!fp)
     {
@@ -71,242 +136,589 @@ TriangleMesh::load(const char* file, const Matrix4x4& ctm)
     }
     debug("Loading \"%s\"...\n", file);
 
-    loadObj(fp, ctm);
-    debug("Loaded \"%s\" with %d triangles\n",file,m_numTris);
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    vector<char> data(size+1);
+    size = fread(&data[0], 1, size, fp);
     fclose(fp);
 
+    loadObj(&data[0], size, ctm);
+#endif
+
+    t += getTime();
+    debug("Loaded \"%s\" with %d triangles in %lf seconds\n",file,m_numTris,t);
+
     return true;
 }
 
-void
-getIndices(char *word, int *vindex, int *tindex, int *nindex)
+namespace
+{
+
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+inline const char* skipSpace(const char* p, const char* end)
 {
-    char *null = (char*)" ";
-    char *ptr;
-    char *tp;
-    char *np;
-
-    // by default, the texture and normal pointers are set to the null string
-    tp = null;
-    np = null;
-
-    // replace slashes with null characters and cause tp and np to point
-    // to character immediately following the first or second slash
-    for (ptr = word; *ptr != '\0'; ptr++)
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    return p;
+}
+
+//Parse a decimal number like strtof. Up to 19 significant digits are
+//kept in an integer that is scaled by a power of ten at the end.
+const char* parseFloat(const char* p, const char* end, float& out)
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    p = skipSpace(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    unsigned long long mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; p < end && isDigit(*p); p++)
     {
-        if (*ptr == '/')
+        if (digits < 19)
         {
-            if (tp == null)
-                tp = ptr + 1;
-            else
-                np = ptr + 1;
-
-            *ptr = '\0';
+            mantissa = mantissa*10 + (*p - '0');
+            if (mantissa) digits++;
+        }
+        else
+            exponent++;
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && isDigit(*p); p++)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa*10 + (*p - '0');
+                if (mantissa) digits++;
+                exponent--;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char* q = p+1;
+        bool negativeExponent = false;
+        if (q < end && (*q == '-' || *q == '+'))
+            negativeExponent = *q++ == '-';
+        if (q < end && isDigit(*q))
+        {
+            int e = 0;
+            for (; q < end && isDigit(*q); q++)
+                if (e < 10000) e = e*10 + (*q - '0');
+            exponent += negativeExponent ? -e : e;
+            p = q;
         }
     }
 
-    *vindex = atoi (word);
-    *tindex = atoi (tp);
-    *nindex = atoi (np);
+    double value = (double)mantissa;
+    if (mantissa != 0 && exponent != 0)
+    {
+        if (exponent > 0)
+            value *= exponent <= 22 ? powers[exponent] : pow(10., exponent);
+        else
+            value /= -exponent <= 22 ? powers[-exponent] : pow(10., -exponent);
+    }
+    out = (float)(negative ? -value : value);
+    return p;
 }
 
+const char* parseInt(const char* p, const char* end, int& out)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    int value = 0;
+    for (; p < end && isDigit(*p); p++)
+        value = value*10 + (*p - '0');
+    out = negative ? -value : value;
+    return p;
+}
 
-void
-TriangleMesh::loadObj(FILE* fp, const Matrix4x4& ctm)
+//Parse a face corner v, v/t, v//n or v/t/n. Missing indices are 0.
+const char* parseCorner(const char* p, const char* end, int& v, int& t, int& n)
 {
-    int nv=0, nt=0, nn=0, nf=0;
-    char line[81];
-    while (fgets(line, 80, fp) != 0)
+    p = parseInt(skipSpace(p, end), end, v);
+    t = n = 0;
+    if (p < end && *p == '/')
     {
-        if (line[0] == 'v')
-        {
-            if (line[1] == 'n')
-                nn++;
-            else if (line[1] == 't')
-                nt++;
-            else
-                nv++;
-        }
-        else if (line[0] == 'f')
+        p++;
+        if (p < end && *p != '/')
+            p = parseInt(p, end, t);
+        if (p < end && *p == '/')
+            p = parseInt(p+1, end, n);
+    }
+    return p;
+}
+
+//OBJ indices start at 1, negative indices count back from the
+//last element read so far
+inline int resolveIndex(int i, int count)
+{
+    return i > 0 ? i-1 : count+i;
+}
+
+struct ObjChunk
+{
+    const char* begin;
+    const char* end;
+    int nv, nt, nn, nf;    //counts, then the first index of each kind
+};
+
+inline const char* lineEnd(const char* p, const char* end)
+{
+    const char* e = (const char*)memchr(p, '\n', end-p);
+    return e ? e : end;
+}
+
+enum ObjLine { ObjVertex, ObjTexCoord, ObjNormal, ObjFace, ObjOther };
+
+inline ObjLine lineType(const char* p, const char* end)
+{
+    if (end-p < 2) return ObjOther;
+    if (p[0] == 'v')
+    {
+        if (p[1] == ' ' || p[1] == '\t') return ObjVertex;
+        if (p[1] == 't') return ObjTexCoord;
+        if (p[1] == 'n') return ObjNormal;
+    }
+    else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        return ObjFace;
+    return ObjOther;
+}
+
+void countChunk(ObjChunk& c)
+{
+    c.nv = c.nt = c.nn = c.nf = 0;
+    for (const char* p = c.begin; p < c.end; )
+    {
+        const char* e = lineEnd(p, c.end);
+        switch (lineType(p, e))
         {
-            nf++;
+            case ObjVertex:   c.nv++; break;
+            case ObjTexCoord: c.nt++; break;
+            case ObjNormal:   c.nn++; break;
+            case ObjFace:     c.nf++; break;
+            default: break;
         }
+        p = e + 1;
     }
-    fseek(fp, 0, 0);
+}
 
+}
 
-    m_normals = new Vector3[std::max(nv,nf*3)];
-    m_vertices = new Vector3[nv];
-    m_numVertices = nv;    
-    #ifdef __SSE4_1__
+void
+TriangleMesh::loadObj(const char* data, size_t size, const Matrix4x4& ctm)
+{
+    //Split at line ends. The chunking only depends on the file size.
+    const size_t chunkSize = 1 << 20;
+    vector<ObjChunk> chunks;
+    const char* end = data + size;
+    for (const char* p = data; p < end; )
+    {
+        ObjChunk c;
+        c.begin = p;
+        c.end = (size_t)(end-p) > chunkSize ? lineEnd(p + chunkSize, end) : end;
+        if (c.end < end) c.end++;
+        chunks.push_back(c);
+        p = c.end;
+    }
+    const int nchunks = (int)chunks.size();
 
-#ifdef WIN32
-    m_SSEvertices = (__m128*)_aligned_malloc(nv * sizeof(__m128), 16);
-    m_SSEnormals = (__m128*)_aligned_malloc(std::max(nv,nf*3) * sizeof(__m128), 16);
-#else
-    m_SSEnormals = new __m128[std::max(nv,nf*3)];
-    m_SSEvertices = new __m128[nv];
-#endif
+    #ifdef OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int i = 0; i < nchunks; i++)
+        countChunk(chunks[i]);
 
-    #endif   
+    //Turn the counts into the first index of every chunk
+    int nv=0, nt=0, nn=0, nf=0;
+    for (int i = 0; i < nchunks; i++)
+    {
+        ObjChunk& c = chunks[i];
+        int cv = c.nv, ct = c.nt, cn = c.nn, cf = c.nf;
+        c.nv = nv; c.nt = nt; c.nn = nn; c.nf = nf;
+        nv += cv; nt += ct; nn += cn; nf += cf;
+    }
 
+    m_vertices = new Vector3[nv];
+    m_numVertices = nv;
+    vector<Vector3> fileNormals(nn);
+    m_normalIndices = new TupleI3[nf]; // always make normals
+    m_vertexIndices = new TupleI3[nf]; // always have vertices
     if (nt)
     {   // got texture coordinates
         m_texCoords = new VectorR2[nt];
         m_texCoordIndices = new TupleI3[nf];
     }
-	m_numTextCoords = nt;
-    
-    //For normal averaging.
-    //Index i contains a list of all normals that are neighbors to vertex i.
-    vector<int>* neighboringNormals = new vector<int>[nv];
-    
-    // For indicating wether or not the normal must be "fixed" (averaged).
-    // For instance, if no normal is specified in the .obj file, it must be averaged.
-    bool * fixNormal = new bool[std::max(nv,nf*3)];
-   
-    m_normalIndices = new TupleI3[nf]; // always make normals
-    m_vertexIndices = new TupleI3[nf]; // always have vertices
+    m_numTextCoords = nt;
+    m_numTris = nf;
 
-    m_numTris = 0;
-    int nvertices = 0;
-    int nnormals = 0;
-    int ntextures = 0;
+    //Faces where a corner has no normal get the face normal
+    vector<unsigned char> faceNormal(nf, 0);
 
     Matrix4x4 nctm = ctm;
     nctm.invert();
     nctm.transpose();
-    
-    while (fgets(line, 80, fp) != 0)
+
+    #ifdef OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int i = 0; i < nchunks; i++)
     {
-        if (line[0] == 'v')
+        const ObjChunk& c = chunks[i];
+        int iv = c.nv, it = c.nt, in = c.nn, f = c.nf;
+        for (const char* p = c.begin; p < c.end; )
         {
-            if (line[1] == 'n')
-            {
-                float x, y, z;
-                sscanf(&line[2], "%f %f %f\n", &x, &y, &z);
-                Vector3 n(x, y, z);
-                m_normals[nnormals] = nctm*n;
-                m_normals[nnormals].normalize();
-                fixNormal[nnormals] = false;
-                
-                #ifdef __SSE4_1__
-                m_SSEnormals[nnormals]  = _mm_set_ps(m_normals[nnormals].x, m_normals[nnormals].y, m_normals[nnormals].z, 0.0f);
-                #endif   
-                nnormals++;
-            }
-            else if (line[1] == 't')
+            const char* e = lineEnd(p, c.end);
+            switch (lineType(p, e))
             {
-                float x, y;
-                sscanf(&line[2], "%f %f\n", &x, &y);
-                m_texCoords[ntextures].x = x;
-                m_texCoords[ntextures].y = y;
-                ntextures++;
-            }
-            else
-            {
-                float x, y, z;
-                sscanf(&line[1], "%f %f %f\n", &x, &y, &z);
-                Vector3 v(x, y, z);
-                m_vertices[nvertices] = ctm*v;
-                #ifdef __SSE4_1__
-                m_SSEvertices[nvertices]  = _mm_set_ps(m_vertices[nvertices].x, m_vertices[nvertices].y, m_vertices[nvertices].z, 0.0f);
-                #endif   
-                nvertices++;
+                case ObjVertex:
+                {
+                    float x, y, z;
+                    p = parseFloat(p+1, e, x);
+                    p = parseFloat(p, e, y);
+                    parseFloat(p, e, z);
+                    m_vertices[iv++] = ctm*Vector3(x, y, z);
+                    break;
+                }
+                case ObjTexCoord:
+                {
+                    float x, y;
+                    p = parseFloat(p+2, e, x);
+                    parseFloat(p, e, y);
+                    m_texCoords[it].x = x;
+                    m_texCoords[it].y = y;
+                    it++;
+                    break;
+                }
+                case ObjNormal:
+                {
+                    float x, y, z;
+                    p = parseFloat(p+2, e, x);
+                    p = parseFloat(p, e, y);
+                    parseFloat(p, e, z);
+                    Vector3 n = nctm*Vector3(x, y, z);
+                    n.normalize();
+                    fileNormals[in++] = n;
+                    break;
+                }
+                case ObjFace:
+                {
+                    p++;
+                    for (int k = 0; k < 3; k++)
+                    {
+                        int v, t, n;
+                        p = parseCorner(p, e, v, t, n);
+                        m_vertexIndices[f].v[k] = resolveIndex(v, iv);
+                        if (n)
+                            m_normalIndices[f].v[k] = resolveIndex(n, in);
+                        else
+                            faceNormal[f] = 1;
+                        if (nt)
+                            m_texCoordIndices[f].v[k] = t ? resolveIndex(t, it) : 0;
+                    }
+                    f++;
+                    break;
+                }
+                default:
+                    break;
             }
+            p = e + 1;
         }
-        else if (line[0] == 'f')
+    }
+
+    //Faces without normals use the average of the face normals around
+    //each vertex. Every such corner at a vertex gets the same normal, so
+    //one normal per vertex is stored after the normals from the file.
+    int ngenerated = 0;
+    for (int i = 0; i < nf && !ngenerated; i++)
+        if (faceNormal[i]) ngenerated = nv;
+
+    const int nnormals = nn + ngenerated;
+    m_normals = new Vector3[std::max(nnormals, 1)];
+    m_numNormals = nnormals;
+    std::copy(fileNormals.begin(), fileNormals.end(), m_normals);
+
+    if (ngenerated)
+    {
+        vector<Vector3> faceNormals(nf);
+        #ifdef OPENMP
+        #pragma omp parallel for schedule(static)
+        #endif
+        for (int i = 0; i < nf; i++)
         {
-            char s1[32], s2[32], s3[32];
-            int v, t, n;
-            sscanf(&line[1], "%s %s %s\n", s1, s2, s3);
+            if (!faceNormal[i]) continue;
+            const TupleI3& v = m_vertexIndices[i];
+            Vector3 n = cross(m_vertices[v.v[1]] - m_vertices[v.v[0]], m_vertices[v.v[2]] - m_vertices[v.v[0]]);
+            n.normalize();
+            faceNormals[i] = n;
+        }
 
-            getIndices(s1, &v, &t, &n);
-            m_vertexIndices[m_numTris].v[0] = v-1;
-            if (n)
-            {
-                m_normalIndices[m_numTris].v[0] = n-1;
-                neighboringNormals[v-1].push_back(n-1);
-            }
-            if (t)
-                m_texCoordIndices[m_numTris].v[0] = t-1;
-            getIndices(s2, &v, &t, &n);
-            m_vertexIndices[m_numTris].v[1] = v-1;
-            if (n)
+        //Sum the normals around each vertex in file order. This is
+        //a few additions per face, so it is not worth splitting up.
+        vector<Vector3> sum(nv, Vector3(0));
+        vector<int> count(nv, 0);
+        for (int i = 0; i < nf; i++)
+        {
+            const TupleI3& v = m_vertexIndices[i];
+            const TupleI3& n = m_normalIndices[i];
+            for (int k = 0; k < 3; k++)
             {
-                m_normalIndices[m_numTris].v[1] = n-1;
-                neighboringNormals[v-1].push_back(n-1);
+                sum[v.v[k]] += faceNormal[i] ? faceNormals[i] : m_normals[n.v[k]];
+                count[v.v[k]]++;
             }
-            if (t)
-                m_texCoordIndices[m_numTris].v[1] = t-1;
-            getIndices(s3, &v, &t, &n);
-            m_vertexIndices[m_numTris].v[2] = v-1;
-            if (n)
+        }
+
+        #ifdef OPENMP
+        #pragma omp parallel for schedule(static)
+        #endif
+        for (int i = 0; i < nv; i++)
+        {
+            Vector3 avg = sum[i];
+            if (count[i])
             {
-                m_normalIndices[m_numTris].v[2] = n-1;
-                neighboringNormals[v-1].push_back(n-1);
+                avg /= count[i];
+                avg.normalize();
             }
-            if (t)
-                m_texCoordIndices[m_numTris].v[2] = t-1;
+            m_normals[nn + i] = avg;
+        }
 
-            if (!n)
-            {   // if no normal was supplied
-                Vector3 e1 = m_vertices[m_vertexIndices[m_numTris].v[1]] -
-                             m_vertices[m_vertexIndices[m_numTris].v[0]];
-                Vector3 e2 = m_vertices[m_vertexIndices[m_numTris].v[2]] -
-                             m_vertices[m_vertexIndices[m_numTris].v[0]];
+        #ifdef OPENMP
+        #pragma omp parallel for schedule(static)
+        #endif
+        for (int i = 0; i < nf; i++)
+        {
+            if (!faceNormal[i]) continue;
+            for (int k = 0; k < 3; k++)
+                m_normalIndices[i].v[k] = nn + m_vertexIndices[i].v[k];
+        }
+    }
+}
 
-                for (int i = 0; i < 3; i++)
-                {
-                    m_normals[nnormals] = cross(e1, e2);
-                    m_normals[nnormals].normalize();
-                    fixNormal[nnormals] = true;
-
-                    #ifdef __SSE4_1__
-                    m_SSEnormals[nnormals]  = _mm_set_ps(m_normals[nnormals].x, m_normals[nnormals].y, m_normals[nnormals].z, 0.0f);
-                    #endif   
-                    
-                    nnormals++;
-                }
-                
-                m_normalIndices[m_numTris].v[0] = nnormals-3;
-                m_normalIndices[m_numTris].v[1] = nnormals-2;
-                m_normalIndices[m_numTris].v[2] = nnormals-1;
-                nn++;
-                
-                //Add the normals as neighbors to the vertices
-                neighboringNormals[m_vertexIndices[m_numTris].v[0]].push_back(m_normalIndices[m_numTris].v[0]);
-                neighboringNormals[m_vertexIndices[m_numTris].v[1]].push_back(m_normalIndices[m_numTris].v[1]);
-                neighboringNormals[m_vertexIndices[m_numTris].v[2]].push_back(m_normalIndices[m_numTris].v[2]);
-            }
+//************************************************************************
+// Mesh cache files
+//
+// A cache file holds the arrays of a loaded mesh, each one starting on a
+// 64 byte boundary, so a mesh can point straight into a mapping of the
+// file. The layout depends on sizeof(Vector3), which differs with SSE,
+// so files written by the other kind of build are rejected.
+//************************************************************************
 
-            m_numTris++;
-        } //  else ignore line
+namespace
+{
+
+struct MeshFileHeader
+{
+    char magic[8];                   // "MIROMSH"
+    unsigned int version;
+    unsigned int vector3_size;       // sizeof(Vector3)
+    unsigned int texcoord_size;      // sizeof(VectorR2)
+    unsigned int tuple_size;         // sizeof(TupleI3)
+    unsigned int num_vertices;
+    unsigned int num_normals;
+    unsigned int num_texcoords;
+    unsigned int num_tris;
+    unsigned long long source_hash;  // OBJ file and transform
+    float bbox_min[3];
+    float bbox_max[3];
+    unsigned long long file_size;
+};
+
+const char mesh_magic[8] = "MIROMSH";
+const unsigned int mesh_version = 2;
+const size_t mesh_alignment = 64;
+
+enum MeshSection { SecVertices, SecNormals, SecTexCoords, SecVertexIndices,
+                   SecNormalIndices, SecTexCoordIndices, NumSections };
+
+inline size_t alignSection(size_t offset)
+{
+    return (offset+mesh_alignment-1) & ~(mesh_alignment-1);
+}
+
+//Offsets and sizes of the sections, returns the file size
+size_t meshLayout(const MeshFileHeader& h, size_t offsets[NumSections], size_t sizes[NumSections])
+{
+    sizes[SecVertices] = (size_t)h.num_vertices*h.vector3_size;
+    sizes[SecNormals] = (size_t)h.num_normals*h.vector3_size;
+    sizes[SecTexCoords] = (size_t)h.num_texcoords*h.texcoord_size;
+    sizes[SecVertexIndices] = (size_t)h.num_tris*h.tuple_size;
+    sizes[SecNormalIndices] = (size_t)h.num_tris*h.tuple_size;
+    sizes[SecTexCoordIndices] = h.num_texcoords ? (size_t)h.num_tris*h.tuple_size : 0;
+
+    size_t offset = sizeof(MeshFileHeader);
+    for (int i = 0; i < NumSections; i++)
+    {
+        offset = alignSection(offset);
+        offsets[i] = offset;
+        offset += sizes[i];
     }
+    return offset;
+}
+
+}
 
-    //Average normals that needs to be averaged 
-    for (int i = 0; i < nvertices; i++)
+#ifndef WIN32
+static unsigned long long fileHash(const struct stat& st, const Matrix4x4& ctm)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    //The inode and the nanoseconds catch a file replaced within the same second
+#ifdef LINUX
+    const unsigned long long mtimeNsec = st.st_mtim.tv_nsec;
+#else
+    const unsigned long long mtimeNsec = 0;
+#endif
+    unsigned long long source[4] = { (unsigned long long)st.st_size, (unsigned long long)st.st_mtime,
+                                     mtimeNsec, (unsigned long long)st.st_ino };
+    const unsigned char* bytes[2] = { (const unsigned char*)source, (const unsigned char*)&ctm.m11 };
+    const size_t sizes[2] = { sizeof(source), 16*sizeof(float) };
+    for (int k = 0; k < 2; k++)
     {
-        if (neighboringNormals[i].size() == 0) continue;
-        
-        Vector3 avg;
-        for (int j = 0; j < neighboringNormals[i].size(); j++)
+        for (size_t i = 0; i < sizes[k]; i++)
         {
-            avg += m_normals[neighboringNormals[i][j]];
+            hash ^= bytes[k][i];
+            hash *= 1099511628211ULL;
         }
-        avg /= neighboringNormals[i].size();
-        avg.normalize();
+    }
+    return hash;
+}
+#endif
+
+bool
+TriangleMesh::loadCache(const char* file, unsigned long long hash)
+{
+#ifndef WIN32
+    const int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    MeshFileHeader header;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header) ||
+        read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t offsets[NumSections], sizes[NumSections];
+    const bool valid =
+        memcmp(header.magic, mesh_magic, sizeof(header.magic)) == 0 &&
+        header.version == mesh_version &&
+        header.vector3_size == sizeof(Vector3) &&
+        header.texcoord_size == sizeof(VectorR2) &&
+        header.tuple_size == sizeof(TupleI3) &&
+        header.source_hash == hash &&
+        header.file_size == (unsigned long long)st.st_size &&
+        meshLayout(header, offsets, sizes) == header.file_size;
+    if (!valid)
+    {
+        close(fd);
+        return false;
+    }
+
+    //Writable, so the mesh can be animated. Only changed pages are copied.
+    void* data = mmap(0, header.file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    char* const base = (char*)data;
+    m_mapping = data;
+    m_mappingSize = header.file_size;
+
+    m_numVertices = header.num_vertices;
+    m_numNormals = header.num_normals;
+    m_numTextCoords = header.num_texcoords;
+    m_numTris = header.num_tris;
+
+    m_vertices = (Vector3*)(base + offsets[SecVertices]);
+    m_normals = (Vector3*)(base + offsets[SecNormals]);
+    m_vertexIndices = (TupleI3*)(base + offsets[SecVertexIndices]);
+    m_normalIndices = (TupleI3*)(base + offsets[SecNormalIndices]);
+    if (m_numTextCoords)
+    {
+        m_texCoords = (VectorR2*)(base + offsets[SecTexCoords]);
+        m_texCoordIndices = (TupleI3*)(base + offsets[SecTexCoordIndices]);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
 
-        for (int j = 0; j < neighboringNormals[i].size(); j++)
+bool
+TriangleMesh::saveCache(const char* file, unsigned long long hash) const
+{
+#ifndef WIN32
+    MeshFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, mesh_magic, sizeof(header.magic));
+    header.version = mesh_version;
+    header.vector3_size = sizeof(Vector3);
+    header.texcoord_size = sizeof(VectorR2);
+    header.tuple_size = sizeof(TupleI3);
+    header.num_vertices = m_numVertices;
+    header.num_normals = m_numNormals;
+    header.num_texcoords = m_numTextCoords;
+    header.num_tris = m_numTris;
+    header.source_hash = hash;
+
+    for (int k = 0; k < 3; k++)
+    {
+        header.bbox_min[k] = 1e30f;
+        header.bbox_max[k] = -1e30f;
+    }
+    for (unsigned int i = 0; i < m_numVertices; i++)
+    {
+        const float v[3] = { m_vertices[i].x, m_vertices[i].y, m_vertices[i].z };
+        for (int k = 0; k < 3; k++)
         {
-            if (!fixNormal[neighboringNormals[i][j]]) continue;
-            m_normals[neighboringNormals[i][j]] = avg;
-            #ifdef __SSE4_1__
-            m_SSEnormals[neighboringNormals[i][j]]  = _mm_set_ps(m_normals[neighboringNormals[i][j]].x, m_normals[neighboringNormals[i][j]].y, m_normals[neighboringNormals[i][j]].z, 0.0f);
-            #endif
+            header.bbox_min[k] = std::min(header.bbox_min[k], v[k]);
+            header.bbox_max[k] = std::max(header.bbox_max[k], v[k]);
         }
     }
-    
-    delete [] neighboringNormals;
-}
 
+    size_t offsets[NumSections], sizes[NumSections];
+    header.file_size = meshLayout(header, offsets, sizes);
+
+    const void* sections[NumSections] = { m_vertices, m_normals, m_texCoords, m_vertexIndices,
+                                          m_normalIndices, m_texCoordIndices };
+
+    //Written under another name and renamed, so a run that reads the
+    //cache never sees a partly written file
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+    FILE* f = fopen(tmp, "wb");
+    if (!f)
+        return false;
+
+    static const char zeros[mesh_alignment] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    size_t offset = sizeof(header);
+    for (int i = 0; i < NumSections && ok; i++)
+    {
+        const size_t padding = offsets[i] - offset;
+        ok = fwrite(zeros, 1, padding, f) == padding;
+        if (ok && sizes[i] > 0)
+            ok = fwrite(sections[i], 1, sizes[i], f) == sizes[i];
+        offset = offsets[i] + sizes[i];
+    }
+    ok = (fclose(f) == 0) && ok;
+
+    if (ok)
+        ok = rename(tmp, file) == 0;
+    if (!ok)
+        remove(tmp);
+    return ok;
+#else
+    return false;
+#endif
+}
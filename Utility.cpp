@@ -1,5 +1,6 @@
 #ifndef WIN32
 #include <sys/time.h>
+#include <sys/resource.h>
 #else
 #include <windows.h>
 #endif
@@ -13,34 +14,106 @@ using namespace std;
 
 void addMeshTrianglesToScene(TriangleMesh * mesh, Material * material)
 {
-    // create all the triangles in the bunny mesh and add to the scene
-    for (int i = 0; i < mesh->numTris(); ++i)
-    {
-        Triangle* t = new Triangle;
-        t->setIndex(i);
-        t->setMesh(mesh);
-        t->setMaterial(material); 
-        g_scene->addObject(t);
-    }
+    // add the mesh to the scene, the BVH indexes its triangles directly
+    MeshObject* obj = new MeshObject(mesh);
+    obj->setMaterial(material);
+    g_scene->addObject(obj);
 }
 
 void addModel(const char* filename, Material *mat, Scene* scene, Vector3 position, float rotY, Vector3 scale)
 {
-	TriangleMesh * mesh = new TriangleMesh();
+    //Meshes are loaded untransformed, the transform goes to the instance
+    SharedMesh *shared = scene->sharedMesh(filename);
+
     Matrix4x4 m_rot(Vector4(cos(rotY),0,-sin(rotY),0), Vector4(0,1,0,0), Vector4(sin(rotY),0,cos(rotY),0), Vector4(0, 0, 0, 1));
     Matrix4x4 m_trans(Vector4(1,0,0,0), Vector4(0,1,0,0), Vector4(0,0,1,0), Vector4(position.x, position.y, position.z, 1));
     Matrix4x4 m_scale(Vector4(scale.x,0,0,0), Vector4(0,scale.y,0,0), Vector4(0,0,scale.z,0), Vector4(0, 0, 0, 1));
-	mesh->load(filename, m_trans*m_rot*m_scale);
-    for (int i = 0; i < mesh->numTris(); i++)
+    Instance* obj = new Instance(shared, m_trans*m_rot*m_scale);
+    obj->setMaterial(mat);
+    scene->addObject(obj);
+}
+
+float getProjectedBoxArea(const Vector3& min, const Vector3& max, const Vector3& from)
+{
+    //Same approximation as for a single triangle, but with the corners of the box
+    Vector3 l_dir = (from - (min + max) / 2).normalize();
+    Vector3 ut, vt;
+    getTangents(l_dir, ut, vt);
+
+    float minBase = infinity;
+    float minHeight = infinity;
+    float maxBase = -infinity;
+    float maxHeight = -infinity;
+
+    for (int i = 0; i < 8; ++i)
     {
-		Triangle *tri = new Triangle();
-		tri->setMesh(mesh);
-		tri->setIndex(i);
-		tri->setMaterial(mat);
-		g_scene->addObject(tri);
+        Vector3 corner((i & 1) ? max.x : min.x,
+                       (i & 2) ? max.y : min.y,
+                       (i & 4) ? max.z : min.z);
+        float projU = dot(ut, corner);
+        float projV = dot(vt, corner);
+
+        if (projU < minBase)
+            minBase = projU;
+        if (projU > maxBase)
+            maxBase = projU;
+
+        if (projV < minHeight)
+            minHeight = projV;
+        if (projV > maxHeight)
+            maxHeight = projV;
     }
+
+    return (0.5f * (maxHeight-minHeight) * (maxBase-minBase));
+}
+
+#ifdef LINUX
+__thread RandomState g_randomState = {{0, 0, 0}, false};
+static long g_randomBaseSeed = 0;
+static int g_randomThreadCount = 0;
+
+//Scrambles the seed so that consecutive seeds (block numbers, thread numbers) give unrelated streams
+static unsigned long long mixSeed(unsigned long long z)
+{
+    z += 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void seedThreadRandom(long seed)
+{
+    unsigned long long z = mixSeed((unsigned long long)seed);
+    g_randomState.xsubi[0] = (unsigned short)(z & 0xFFFF);
+    g_randomState.xsubi[1] = (unsigned short)((z >> 16) & 0xFFFF);
+    g_randomState.xsubi[2] = (unsigned short)((z >> 32) & 0xFFFF);
+    g_randomState.seeded = true;
+}
+
+void seedNewThreadRandom()
+{
+    int n = __sync_add_and_fetch(&g_randomThreadCount, 1);
+    seedThreadRandom(g_randomBaseSeed + n);
+}
+
+void seedRandom(long seed)
+{
+    g_randomBaseSeed = seed;
+    g_randomThreadCount = 0;
+    seedThreadRandom(seed);
+}
+#else
+void seedThreadRandom(long seed)
+{
+    srand((unsigned int)seed);
 }
 
+void seedRandom(long seed)
+{
+    srand((unsigned int)seed);
+}
+#endif
+
 //Returns the time in seconds
 double getTime()
 {
@@ -60,6 +133,23 @@ double getTime()
 	#endif
 }
 
+double getPeakMemory()
+{
+    #ifndef WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1)
+        return 0;
+    #ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0*1024.0); //bytes
+    #else
+    return usage.ru_maxrss / 1024.0;          //kilobytes
+    #endif
+
+    #else
+    return 0;
+    #endif
+}
+
 void printMat(float A[3][3] )
 {
     for (int i = 0; i < 3; i++)
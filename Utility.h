@@ -8,15 +8,39 @@
 #include "Matrix4x4.h"
 
 double getTime();
+//Returns the peak resident set size of the process in megabytes (0 if unknown)
+double getPeakMemory();
 void getEigenVector(const float (&A)[3][3], float (&outV)[3], float lambda);
 void addMeshTrianglesToScene(TriangleMesh * mesh, Material * material);
+//Adds an instance of the model in filename. Every file is loaded only once,
+//further models of it share the mesh and its BVH.
 void addModel(const char* filename, Material *mat, Scene* scene, Vector3 position, float rotY=0, Vector3 scale=Vector3(1,1,1));
+//Approximate area of the box between min and max as seen from a point
+float getProjectedBoxArea(const Vector3& min, const Vector3& max, const Vector3& from);
+
+#ifdef LINUX
+//Each thread draws from its own erand48 stream, so parallel loops don't race on the drand48 state
+//and a block of work can be made reproducible by reseeding the thread before running it.
+struct RandomState
+{
+    unsigned short xsubi[3];
+    bool seeded;
+};
+extern __thread RandomState g_randomState;
+void seedNewThreadRandom();
+#endif
+
+//Seeds the calling thread. Threads that have not been seeded derive their seed from this one.
+void seedRandom(long seed);
+//Seeds only the calling thread, e.g. before tracing a fixed block of photons.
+void seedThreadRandom(long seed);
 
 //Returns random number between 0 and 1
 inline float frand()
 {
 #ifdef LINUX
-    return drand48();
+    if (!g_randomState.seeded) seedNewThreadRandom();
+    return erand48(g_randomState.xsubi);
 #else
     return (float)rand() / (float)RAND_MAX;
 #endif
@@ -223,7 +223,7 @@ public:
     }
 
     //Return the average intensity of the components
-    float average()
+    float average() const
     {
         return (x+y+z)/3.0f;
     }
@@ -9,8 +9,15 @@
 #include <map>
 #include "Miro.h"
 #include "includes.h"
+#include "PScene.h"
 #include "Emissive.h"
 #include "Utility.h"
+#include "ErrorTracker.h"
+#include "Bidirectional.h"
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
 
 SquareLight* g_l;
 
@@ -70,9 +77,9 @@ void BuildSquare(const Vector3& min, const Vector3& max, const Vector3& normal,
 }
 
 void 
-makeTask3Scene()
+makeTask3Scene(int width, int height)
 {
-    g_image->resize(W, H);
+    g_image->resize(width, height);
 
     // set up the camera
     g_camera->setBGColor(Vector3(0.0f, 0.0f, 0.0f));
@@ -95,11 +102,9 @@ makeTask3Scene()
     g_scene->addObject(l);
 	g_scene->addLight(l);
     
-    double e = 0.0005;
+    //Progressive photon mapping needs the walls to meet exactly
+    double e = dynamic_cast<ProgressiveScene*>(g_scene) ? 0 : 0.0005;
     Material* gray = new Phong(Vector3(0.75));
-#ifdef PHOTON_MAPPING
-    e = 0;
-#endif
 
 	// Floor
 	BuildSquare(Vector3(-1,-1,-1), Vector3(1,-1,1), Vector3(0,1,0), gray);
@@ -134,15 +139,11 @@ makeTask3Scene()
 
 sample sampleBidirectionalPath(const path& eyepath, const path& lightpath, int w, int h)
 {
-    //Debug
-    static int nrays = 0;
-    nrays++;
-
     sample out;
     out.value = Vector3(0);
     out.hit = true;
 
-    Ray eye_ray = g_camera->eyeRay((int)(eyepath.u[0]*(double)W), (int)(eyepath.u[1]*(double)H), W, H, false);
+    Ray eye_ray = g_camera->eyeRay((int)(eyepath.u[0]*(double)w), (int)(eyepath.u[1]*(double)h), w, h, false);
     
     Ray light_ray(g_l->getPhotonOrigin(lightpath.u[0], lightpath.u[1]), g_l->samplePhotonDirection(lightpath.u[2], lightpath.u[3]));
 
@@ -163,7 +164,7 @@ sample sampleBidirectionalPath(const path& eyepath, const path& lightpath, int w
 
     //First point is at the light source
     lighthits[0].x = light_ray.o;
-    lighthits[0].N = g_l->getNormal();
+    lighthits[0].N = lighthits[0].Ng = g_l->getNormal();
 //    lighthits[0].contrib = flux/g_l->area();
 //    lighthits[0].contrib = g_l->radiance(Vector3(0), Vector3(0));
     lighthits[0].contrib = flux;
@@ -192,8 +193,6 @@ sample sampleBidirectionalPath(const path& eyepath, const path& lightpath, int w
             //Hit a refractive surface?
             else if (hitInfo.material->isRefractive())
             {
-                //Push the hit point inside (or outside if on the way out) the refractive object
-                hitInfo.P += light_ray.d*epsilon*2.;
                 light_ray = light_ray.refract(hitInfo);
                 flux = flux * hitInfo.material->getRefraction();
             }
@@ -207,6 +206,7 @@ sample sampleBidirectionalPath(const path& eyepath, const path& lightpath, int w
                     lighthits[light_points].x = hitInfo.P;
                     lighthits[light_points].contrib = flux;
                     lighthits[light_points].N = hitInfo.N;
+                    lighthits[light_points].Ng = hitInfo.Ng;
                     lighthits[light_points].reflectance = hitInfo.material->getDiffuse();
                     lighthits[light_points].theta_out = light_ray.d;
                     light_points++;
@@ -256,8 +256,6 @@ sample sampleBidirectionalPath(const path& eyepath, const path& lightpath, int w
             //Hit a refractive surface?
             else if (hitInfo.material->isRefractive())
             {
-                //Push the hit point inside (or outside if on the way out) the refractive object
-                hitInfo.P += eye_ray.d*epsilon*2.;
                 eye_ray = eye_ray.refract(hitInfo);
                 contribution = contribution * hitInfo.material->getRefraction();
             }
@@ -271,6 +269,7 @@ sample sampleBidirectionalPath(const path& eyepath, const path& lightpath, int w
 
                 eyehits[eye_points].x = hitInfo.P;
                 eyehits[eye_points].N = hitInfo.N;
+                eyehits[eye_points].Ng = hitInfo.Ng;
                 eyehits[eye_points].contrib = contribution;
                 eyehits[eye_points].theta_out = eye_ray.d;
                 eye_points++;
@@ -412,7 +411,7 @@ sample sampleBidirectionalPath(const path& eyepath, const path& lightpath, int w
                 weights[i+j+1] += weight;
 
                 l /= length;
-                Ray shadow(eyehits[j].x, l);
+                Ray shadow(offsetRayOrigin(eyehits[j].x, eyehits[j].Ng, l), l);
                 if (!g_scene->trace(hitTmp, shadow, 0, length-epsilon))
                 {
                     double G = abs(dot(l, eyehits[j].N)) * abs(dot(l, lighthits[i].N)) / (eyehits[j].x-lighthits[i].x).length2();
@@ -446,10 +445,12 @@ sample sampleBidirectionalPath(const path& eyepath, const path& lightpath, int w
     return out;
 }
 
-sample samplePath(const path& p, int w, int h)
+//Trace the path given by the random numbers of p (a path or a primary_sampler)
+template <class Primary>
+sample samplePath(Primary& p, int w, int h)
 {
     sample out;
-    Ray ray = g_camera->eyeRay((int)(p.u[0]*(double)W), (int)(p.u[1]*(double)H), W, H, false);
+    Ray ray = g_camera->eyeRay((int)(p.get(0)*(double)w), (int)(p.get(1)*(double)h), w, h, false);
 
     int depth = PATH_LENGTH;
 
@@ -480,9 +481,6 @@ sample samplePath(const path& p, int w, int h)
             //Hit a refractive surface?
             else if (hitInfo.material->isRefractive())
             {
-                //Push the hit point inside (or outside if on the way out) the refractive object
-                hitInfo.P += ray.d*epsilon*2.;
-
 			    float Rs = ray.getReflectionCoefficient(hitInfo); //Coefficient from fresnel
 
                 if (frand() < Rs)
@@ -501,7 +499,7 @@ sample samplePath(const path& p, int w, int h)
             else
             {
                 contribution = contribution * hitInfo.material->getDiffuse();
-                ray = ray.diffuse(hitInfo, p.u[pathpos], p.u[pathpos+1]);
+                ray = ray.diffuse(hitInfo, p.get(pathpos), p.get(pathpos+1));
                 pathpos += 2;
             }
             depth--;
@@ -527,43 +525,212 @@ double mutate_value(double s1, double s2)
         return dv;
 }
 
-void mutate_path(const path &p0, path &p1)
+//Mutate random number i of a path by n small steps
+double mutate_primary(double u, int i, long n = 1)
 {
     //Mutation magnitudes
 //    double dpos = 1, dtheta = .125, dphi = .125;
     double dpos = 1, dtheta = .5, dphi = .5;
     double max_mutation = 1./64.;
     double min_mutation = 1./1024.;
+    double scale = (i < 2 ? dpos : dtheta);
 
+    if (n <= 16)
+    {
+        for (long k = 0; k < n; k++)
+        {
+            u += mutate_value(min_mutation, max_mutation) * scale;
+            if (u >= 1.) u -= 1;
+            else if (u < 0) u += 1;
+        }
+    }
+    else
+    {
+        //The sum of many steps is close to normal. Its variance is n times
+        //the mean of mutate_value^2 = (s2^2 - s1^2) / (2 log(s2/s1)).
+        double var = (max_mutation*max_mutation - min_mutation*min_mutation) / (2.*log(max_mutation/min_mutation));
+        double r = sqrt(-2.*log(1. - frand())), phi = 2.*PI*frand();
+        u += r*cos(phi) * sqrt(n*var) * scale;
+        u -= floor(u);
+        if (u >= 1.) u = 0;
+    }
+    return u;
+}
+
+void mutate_path(const path &p0, path &p1)
+{
     if (frand() < p_large)
     {
         p1.init_random();
     }
     else
     {
-        //Mutate position
-        p1.u[0] = p0.u[0] + mutate_value(min_mutation, max_mutation) * dpos;
-        if (p1.u[0] >= 1.) p1.u[0] -= 1;
-        else if (p1.u[0] < 0) p1.u[0] += 1;
+        //Mutate position and directions
+        for (int i = 0; i < 2+PATH_LENGTH*2; i++)
+        {
+            p1.u[i] = mutate_primary(p0.u[i], i);
+        }
+    }
+}
+
+void primary_sampler::start(const path& p)
+{
+    for (int i = 0; i < Dimensions; i++)
+    {
+        X[i].value = p.u[i];
+        X[i].modified = 0;
+    }
+    I = p.I;
+    F = p.F;
+    iteration = 0;
+    last_large_step = 0;
+    ntouched = 0;
+}
+
+void primary_sampler::start_iteration()
+{
+    iteration++;
+    large_step = frand() < p_large;
+    ntouched = 0;
+}
+
+double primary_sampler::get(int i)
+{
+    primary_sample &x = X[i];
+    if (x.modified == iteration)
+        return x.value;
 
-        p1.u[1] = p0.u[1] + mutate_value(min_mutation, max_mutation) * dpos;
-        if (p1.u[1] > 1) p1.u[1] -= 1;
-        else if (p1.u[1] < 0) p1.u[1] += 1;
+    touched[ntouched++] = i;
 
-        //Mutate directions
-        for (int i = 0; i < PATH_LENGTH; i++)
+    if (large_step)
+    {
+        x.backup = x.value;
+        x.modified_backup = x.modified;
+        x.value = frand();
+    }
+    else
+    {
+        //A large step was accepted since this value was last used
+        if (x.modified < last_large_step)
         {
-            int j = 2+i*2;
-            p1.u[j] = p0.u[j] + mutate_value(min_mutation, max_mutation)*dtheta;
-            if (p1.u[j] < 0) p1.u[j] += 1;
-            else if (p1.u[j] > 1) p1.u[j] -= 1;
-
-            p1.u[j+1] = p0.u[j+1] + mutate_value(min_mutation, max_mutation)*dtheta;
-            if (p1.u[j+1] < 0) p1.u[j+1] += 1;
-            else if (p1.u[j+1] > 1) p1.u[j+1] -= 1;
+            x.value = frand();
+            x.modified = last_large_step;
         }
 
+        //Catch up on the small steps of the current path. They are kept
+        //on rejection, drawing them again would bias the chain towards
+        //values that have already been rejected.
+        x.value = mutate_primary(x.value, i, iteration-1 - x.modified);
+        x.backup = x.value;
+        x.modified_backup = iteration-1;
+
+        x.value = mutate_primary(x.value, i);
     }
+    x.modified = iteration;
+    return x.value;
+}
+
+void primary_sampler::accept()
+{
+    if (large_step)
+        last_large_step = iteration;
+}
+
+void primary_sampler::reject()
+{
+    for (int k = 0; k < ntouched; k++)
+    {
+        primary_sample &x = X[touched[k]];
+        x.value = x.backup;
+        x.modified = x.modified_backup;
+    }
+    ntouched = 0;
+    //The rejected proposal does not count as a mutation
+    iteration--;
+}
+
+//Sample a seed path and store its contribution in it
+static sample sampleSeed(path& p)
+{
+    sample s = samplePath(p, g_image->width(), g_image->height());
+    p.I = s.value.average();
+    p.F = s.value;
+    return s;
+}
+
+static sample sampleSeed(bidirectional_path& p)
+{
+    sample s = sampleBidirectionalPath(p.eye, p.light, g_image->width(), g_image->height());
+    p.eye.I = s.value.average();
+    p.eye.F = s.value;
+    return s;
+}
+
+//Generate Nseeds random paths, estimate b from them and pick a starting path for each chain with
+//probability proportional to I. Every seed path gets its own random seed, so the chosen paths can be
+//traced again instead of being kept, and b is summed in fixed blocks that are added up in order. The
+//result only depends on seed and not on the number of threads.
+template <class Path>
+long double generateSeeds(const int Nseeds, vector<Path>& chains, long seed)
+{
+    const int nBlocks = (Nseeds + SeedBlockSize - 1) / SeedBlockSize;
+    vector<long double> block_b(nBlocks, 0);
+    vector<double> weight(Nseeds);
+
+#ifdef OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for (int blk = 0; blk < nBlocks; blk++)
+    {
+        Path p_tmp;
+        int end = std::min((blk+1)*SeedBlockSize, Nseeds);
+        for (int i = blk*SeedBlockSize; i < end; i++)
+        {
+            seedThreadRandom(seed + i);
+            p_tmp.init_random();
+
+            sample s = sampleSeed(p_tmp);
+
+            weight[i] = 0;
+            if (s.hit)
+            {
+                long double I = s.value.average();
+                block_b[blk] += I*PI;
+                weight[i] = I;
+            }
+        }
+    }
+
+    long double b = 0;
+    for (int blk = 0; blk < nBlocks; blk++)
+        b += block_b[blk];
+
+    //Resample the starting paths proportional to I
+    for (int i = 1; i < Nseeds; i++)
+        weight[i] += weight[i-1];
+
+    if (Nseeds > 0 && weight[Nseeds-1] > 0)
+    {
+        seedThreadRandom(seed + Nseeds);
+        for (int c = 0; c < (int)chains.size(); c++)
+        {
+            //Find the first seed whose cumulative weight is above u
+            double u = frand()*weight[Nseeds-1];
+            int i = 0, j = Nseeds-1;
+            while (i < j)
+            {
+                int m = (i+j)/2;
+                if (weight[m] <= u) i = m+1;
+                else j = m;
+            }
+
+            seedThreadRandom(seed + i);
+            chains[c].init_random();
+            sampleSeed(chains[c]);
+        }
+    }
+
+    return b / Nseeds;
 }
 
 void a3task3()
@@ -573,11 +740,11 @@ void a3task3()
     //Record the error after every this many samples
     const int error_interval = 100000;
 
-    Vector3 img[W][H];
-    memset(img, 0, W*H*sizeof(Vector3));
+    const int width = g_image->width(), height = g_image->height();
+    const long npixels = (long)width*height;
 
     cout << "Metropolis sampling" << endl;
-    cout << Nsamples / (W*H) << " samples per pixel." << endl;
+    cout << Nsamples / npixels << " samples per pixel." << endl;
 
 #ifdef HACKER2
     const char* version = "sphere";
@@ -587,182 +754,189 @@ void a3task3()
     const char* version = "gray";
 #endif
 
-    vector<vector<Vector3> > ptracing_results;
-
+    //Load image from task 1
+    vector<Vector3> ptracing_results(npixels);
     {
-        //Load image from task 1
-        ifstream ptracing;
         char filename[100];
-        sprintf(filename, "pathtracing_%s.raw\0", version);
-        ptracing.open(filename, ios::binary);
-
-        int w_pt, h_pt;
-        long double b_pt = 0;
-        if (!ptracing.is_open())
-        {
-            w_pt = W; h_pt = H;
-        }
-        ptracing.read((char*)&w_pt, 4);
-        ptracing.read((char*)&h_pt, 4);
-        cout << "Loading path tracing results [width=" << w_pt << ", height " << h_pt << "]" << endl;
-        for (int i = 0; i < h_pt; i++)
-        {
-            ptracing_results.push_back(vector<Vector3>());
-            for (int j = 0; j < w_pt; j++)
-            {
-                Vector3 pix(0);
-                if (ptracing.is_open())
-                {
-                    ptracing.read((char*)&pix.x, sizeof(float));
-                    ptracing.read((char*)&pix.y, sizeof(float));
-                    ptracing.read((char*)&pix.z, sizeof(float));
-                }
-                b_pt += pix.average();
-                ptracing_results[i].push_back(pix);
-            }
-        }
-        b_pt /= (long double)(w_pt*h_pt);
-        cout << "Done reading path tracing results. b = " << b_pt << endl;
+        sprintf(filename, "pathtracing_%s.raw", version);
+        loadReferenceImage(filename, width, height, &ptracing_results[0]);
     }
     cout << "Generating path seeds..." << endl;
 
     long double b = 0;
 
-    path p_init;
-    p_init.I = 0;
-
-    stringstream msq_out;
-
-    //Generate path seeds
-    for (int i = 1; i <= Nseeds; i++)
-    {
-        path p_tmp;
-
-        p_tmp.init_random();
-
-        sample s = samplePath(p_tmp, W, H);
+    //Number of independent Markov chains, one per thread
+#ifdef OPENMP
+    const int nChains = omp_get_max_threads();
+#else
+    const int nChains = 1;
+#endif
 
-        if (s.hit)
-        {
-            long double I = s.value.average();
-            b += I*PI;
+    //Starting path of each chain, picked from the seeds proportional to I
+    vector<path> seeds(nChains);
 
-            //is it a better path?
-            if (p_init.I < I)
-                path_copy(p_init, p_tmp);
-        }
-    }
+    stringstream msq_out;
 
-    b /= Nseeds;
+    const long seedBase = (long)(frand()*2147483647.);
+    double t0 = -getTime();
+    b = generateSeeds(Nseeds, seeds, seedBase);
+    t0 += getTime();
+    cout << "Generated " << Nseeds << " seeds in " << t0 << "s." << endl;
 
     cout << "b=" << b << endl;
+    cout << nChains << " Markov chains." << endl;
 
     double b_result = 0;
     double msq = 0;
     //Initialize msq
-    for (int y = 0; y < H; y++)
+    ErrorTracker error(width, height);
+    for (int y = 0; y < height; y++)
     {
-        for (int x = 0; x < W; x++)
+        for (int x = 0; x < width; x++)
         {
-            double res = ptracing_results[y][x].average();
-            msq += res*res;
+            error.setReference(x, y, ptracing_results[x + y*width]);
         }
     }
-    msq /= (double)(H*W);
+    msq = error.error(0);
 
+    //Each chain splats into its own buffer, the buffers are
+    //added to img every error_interval samples
+    vector<Vector3> img(npixels, Vector3(0));
+    vector<vector<float> > splats(nChains, vector<float>(npixels*3, 0.f));
+    debug("Framebuffers: %.1f MB\n", (double)npixels*(sizeof(Vector3) + nChains*3*sizeof(float))/(1024.*1024.));
 
-    path p0;
-    p0.I = 0;
-    path_copy(p0, p_init);
+    vector<primary_sampler> chains(nChains);
+    for (int c = 0; c < nChains; c++)
+        chains[c].start(seeds[c]);
+    const long chainSeed = seedBase + Nseeds + 1;
 
-    for (long i = 1; i <= Nsamples; i++)
+    for (long i = error_interval; i <= Nsamples; i += error_interval)
     {
-        if (i % (Nsamples/1000) == 0)
-        {
-            printf("\rProgress: %f%% MSQ: %lf", (float)(100.*(double)i/(double)Nsamples), msq);
-            fflush(stdout);
-        }
+        const long interval = i / error_interval;
 
-        //Compute error vs. reference
-        if (i % error_interval == 0)
+#ifdef OPENMP
+        #pragma omp parallel for schedule(static, 1)
+#endif
+        for (int c = 0; c < nChains; c++)
         {
-            msq = 0;
-            bool writeImage = false;
-            if (i == 100000 || i == 1000000 || i == 10000000 || i == 100000000)
-                writeImage = true;
+            //Seeded by chain and interval so the result does not depend on the scheduling
+            seedThreadRandom(chainSeed + interval*nChains + c);
+
+            primary_sampler &chain = chains[c];
+            float *splat = &splats[c][0];
+            const int n = error_interval/nChains + (c < error_interval%nChains ? 1 : 0);
 
-            for (int y = 0; y < H; y++)
+            for (int k = 0; k < n; k++)
             {
-                for (int x = 0; x < W; x++)
+                int x0 = (int)(chain.current(0)*(double)width), y0 = (int)(chain.current(1)*(double)height);
+
+                //Mutate path. The random numbers are mutated as samplePath asks for them.
+                chain.start_iteration();
+
+                sample s = samplePath(chain, width, height);
+
+                double I1 = s.value.average();
+                Vector3 F1 = s.value;
+
+                double accept;
+
+                int x1 = (int)(chain.get(0)*(double)width), y1 = (int)(chain.get(1)*(double)height);
+                if (x0 == width) x0--;
+                if (y0 == height) y0--;
+                if (x1 == width) x1--;
+                if (y1 == height) y1--;
+
+                //Add contribution to pixels
+                accept = std::min(I1 / chain.I, 1.);
+                if (chain.I > 0)
                 {
-                    //Compute pixel value
-                    Vector3 result = img[x][y]*b*(double)W*(double)H/(double)i;
-                    msq += pow((ptracing_results[y][x] - result).average(), 2);
+                    Vector3 v = (1.-accept)*(chain.F / chain.I);
+                    float *px = splat + (x0 + y0*width)*3;
+                    px[0] += v.x; px[1] += v.y; px[2] += v.z;
+                }
+                if (I1 > 0)
+                {
+                    Vector3 v = accept * (F1 / I1);
+                    float *px = splat + (x1 + y1*width)*3;
+                    px[0] += v.x; px[1] += v.y; px[2] += v.z;
+                }
 
-                    if (writeImage)
-                    {
-                        //Gamma correct
-                        for (int i = 0; i < 3; i++)
-                        {
-                            result[i] = pow(result[i], 1.f/2.2f);
-                        }
-                        g_image->setPixel(x,y,result);
-                    }
+                if (frand() < accept)
+                {
+                    chain.accept();
+                    chain.I = I1;
+                    chain.F = F1;
+                }
+                else
+                {
+                    chain.reject();
                 }
             }
+        }
 
-            msq /= (double)(W*H);
-            msq_out << msq << endl;
-
-            if (writeImage)
+        //Merge the chains
+        for (int c = 0; c < nChains; c++)
+        {
+            float *splat = &splats[c][0];
+            for (int y = 0; y < height; y++)
             {
-                char filename[100];
-
-                sprintf(filename, "metropolis_%s_%ld.ppm\0", version, i);
-                cout << "\nWriting " << filename << "..." << endl;
-                g_image->writePPM(filename);
+                for (int x = 0; x < width; x++)
+                {
+                    float *px = splat + (x + y*width)*3;
+                    if (px[0] == 0.f && px[1] == 0.f && px[2] == 0.f)
+                        continue;
+
+                    Vector3 v(px[0], px[1], px[2]);
+                    img[x + y*width] += v;
+                    error.add(x, y, v);
+                    px[0] = px[1] = px[2] = 0.f;
+                }
             }
         }
 
-        //Mutate path. 
-        path p1;
-        mutate_path(p0, p1);
-
-        sample s = samplePath(p1, W, H);
+        if (i % (Nsamples/1000) == 0)
+        {
+            printf("\rProgress: %f%% MSQ: %lf", (float)(100.*(double)i/(double)Nsamples), msq);
+            fflush(stdout);
+        }
 
-        p1.I = s.value.average();
-        p1.F = s.value;
+        //Compute error vs. reference
+        msq = error.error(b*(double)npixels/(double)i);
+        msq_out << msq << endl;
 
-        double accept;
+        if (i == 100000 || i == 1000000 || i == 10000000 || i == 100000000)
+        {
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    //Compute pixel value
+                    Vector3 result = img[x + y*width]*b*(double)npixels/(double)i;
 
-        int x0 = (int)(p0.u[0]*(double)W), y0 = (int)(p0.u[1]*(double)H);
-        int x1 = (int)(p1.u[0]*(double)W), y1 = (int)(p1.u[1]*(double)H);
-        if (x0 == W) x0--;
-        if (y0 == H) y0--;
-        if (x1 == W) x1--;
-        if (y1 == H) y1--;
+                    //Gamma correct
+                    for (int i = 0; i < 3; i++)
+                    {
+                        result[i] = pow(result[i], 1.f/2.2f);
+                    }
+                    g_image->setPixel(x,y,result);
+                }
+            }
 
-        //Add contribution to pixels
-        accept = std::min(p1.I / p0.I, 1.);
-        if (p0.I > 0)
-            img[x0][y0] += (1.-accept)*(p0.F / p0.I);
-        if (p1.I > 0)
-            img[x1][y1] += accept * (p1.F / p1.I);
+            char filename[100];
 
-        if (frand() < accept)
-        {
-            path_copy(p0, p1);
+            sprintf(filename, "metropolis_%s_%ld.ppm\0", version, i);
+            cout << "\nWriting " << filename << "..." << endl;
+            g_image->writePPM(filename);
         }
-
     }
 
     printf("\n");
-    for (int x = 0; x < W; x++)
+    for (int y = 0; y < height; y++)
     {
-        for (int y = 0; y < H; y++)
+        for (int x = 0; x < width; x++)
         {
             //Compute pixel value
-            Vector3 result = img[x][y]*b*(double)W*(double)H/(double)Nsamples;
+            Vector3 result = img[x + y*width]*b*(double)npixels/(double)Nsamples;
             b_result += result.average();
 
             //Gamma correct
@@ -774,7 +948,7 @@ void a3task3()
         }
     }
 
-    cout << "Resulting b: " << b_result/(double)W/(double)H << endl;
+    cout << "Resulting b: " << b_result/(double)npixels << endl;
 
     //write msq
     {
@@ -796,13 +970,15 @@ void a3hacker1()
     //Record the error after every this many samples
     const int error_interval = 100000;
 
-    Vector3 img[W][H];
-    Vector3 direct_img[W][H]; //Gather eye-light paths here
-    memset(img, 0, W*H*sizeof(Vector3));
-    memset(direct_img, 0, W*H*sizeof(Vector3));
+    const int width = g_image->width(), height = g_image->height();
+    const long npixels = (long)width*height;
+
+    vector<Vector3> img(npixels, Vector3(0));
+    vector<Vector3> direct_img(npixels, Vector3(0)); //Gather eye-light paths here
+    debug("Framebuffers: %.1f MB\n", (double)npixels*2*sizeof(Vector3)/(1024.*1024.));
 
     cout << "Bidirectional metropolis path tracing" << endl;
-    cout << Nsamples / (W*H) << " samples per pixel." << endl;
+    cout << Nsamples / npixels << " samples per pixel." << endl;
 
 #ifdef HACKER2
     const char* version = "sphere";
@@ -812,61 +988,29 @@ void a3hacker1()
     const char* version = "gray";
 #endif
 
-    vector<vector<Vector3> > ptracing_results;
-
+    //Load image from task 1
+    vector<Vector3> ptracing_results(npixels);
     {
-        //Load image from task 1
-        ifstream ptracing;
         char filename[100];
-        sprintf(filename, "pathtracing_%s.raw\0", version);
-        ptracing.open(filename, ios::binary);
-
-        int w_pt, h_pt;
-        long double b_pt = 0;
-        if (!ptracing.is_open())
-        {
-            w_pt = W; h_pt = H;
-        }
-        ptracing.read((char*)&w_pt, 4);
-        ptracing.read((char*)&h_pt, 4);
-        cout << "Loading path tracing results [width=" << w_pt << ", height " << h_pt << "]" << endl;
-        for (int i = 0; i < h_pt; i++)
-        {
-            ptracing_results.push_back(vector<Vector3>());
-            for (int j = 0; j < w_pt; j++)
-            {
-                Vector3 pix(0);
-                if (ptracing.is_open())
-                {
-                    ptracing.read((char*)&pix.x, sizeof(float));
-                    ptracing.read((char*)&pix.y, sizeof(float));
-                    ptracing.read((char*)&pix.z, sizeof(float));
-                }
-                b_pt += pix.average();
-                ptracing_results[i].push_back(pix);
-            }
-        }
-        b_pt /= (long double)(w_pt*h_pt);
-        cout << "Done reading path tracing results. b = " << b_pt << endl;
+        sprintf(filename, "pathtracing_%s.raw", version);
+        loadReferenceImage(filename, width, height, &ptracing_results[0]);
     }
 
     long double b = 0;
 
-    path p_init_eye, p_init_light;
-    p_init_eye.I = 0;
-    p_init_light.I = 0;
+    vector<bidirectional_path> p_init(1);
 
     stringstream msq_out;
 
     double direct_b = 0;
     //Explore L-S*-E paths
     cout << "Computing direct Eye-Light hits.." << endl;
-    for (int y = 0; y < H; y++)
+    for (int y = 0; y < height; y++)
     {
-        for (int x = 0; x < W; x++)
+        for (int x = 0; x < width; x++)
         {
             HitInfo hitInfo;
-            Ray ray = g_camera->eyeRay(x, y, W, H, false);
+            Ray ray = g_camera->eyeRay(x, y, width, height, false);
             int depth = PATH_LENGTH;
             Vector3 contrib = Vector3(1);
             while (depth > 0)
@@ -876,7 +1020,7 @@ void a3hacker1()
                     PointLight *l = dynamic_cast<PointLight*>(hitInfo.object);
                     if (l != 0)
                     {
-                        direct_img[x][y] = l->radiance(hitInfo.P, ray.d)*contrib;
+                        direct_img[x + y*width] = l->radiance(hitInfo.P, ray.d)*contrib;
 //                        cout << l->radiance(hitInfo.P, ray.d) << endl;
                         depth = -1;
                     }
@@ -888,60 +1032,38 @@ void a3hacker1()
                 }
                 depth--;
             }
-            direct_b += direct_img[x][y].average();
+            direct_b += direct_img[x + y*width].average();
         }
     }
-    direct_b /= (double)(W*H);
+    direct_b /= (double)npixels;
 
     cout << "Generating path seeds..." << endl;
-    //Generate path seeds
-    for (int i = 1; i <= Nseeds; i++)
-    {
-        path p_tmp_eye, p_tmp_light;
+    double t0 = -getTime();
+    b = generateSeeds(Nseeds, p_init, (long)(frand()*2147483647.));
+    t0 += getTime();
+    cout << "Generated " << Nseeds << " seeds in " << t0 << "s." << endl;
 
-        p_tmp_eye.init_random();
-        p_tmp_light.init_random();
-
-        sample s = sampleBidirectionalPath(p_tmp_eye, p_tmp_light, W, H);
-
-        if (s.hit)
-        {
-            long double I = s.value.average();
-            b += I*PI;
-
-            //is it a better path?
-            if (p_init_eye.I < I)
-            {
-                path_copy(p_init_eye, p_tmp_eye);
-                path_copy(p_init_light, p_tmp_light);
-                p_init_eye.I = I;
-                cout << "Best: " << I << endl;
-            }
-        }
-    }
-
-    b /= Nseeds;
     cout << "b=" << b+direct_b << endl;
 
     double b_result = 0;
     double msq = 0;
-    //Initialize msq
-    for (int y = 0; y < H; y++)
+    //Initialize msq. The direct hits are part of every image, so
+    //they are taken out of the reference.
+    ErrorTracker error(width, height);
+    for (int y = 0; y < height; y++)
     {
-        for (int x = 0; x < W; x++)
+        for (int x = 0; x < width; x++)
         {
-            double res = (ptracing_results[y][x] - direct_img[x][y]).average();
-            msq += res*res;
+            error.setReference(x, y, ptracing_results[x + y*width] - direct_img[x + y*width]);
         }
     }
-    msq /= (double)(H*W);
+    msq = error.error(0);
 
 
     path p0_eye, p0_light;
 
-    p0_eye.I = 0;
-    path_copy(p0_eye, p_init_eye);
-    path_copy(p0_light, p_init_light);
+    path_copy(p0_eye, p_init[0].eye);
+    path_copy(p0_light, p_init[0].light);
 
     for (long i = 1; i <= Nsamples; i++)
     {
@@ -954,21 +1076,18 @@ void a3hacker1()
         //Compute error vs. reference
         if (i % error_interval == 0)
         {
-            msq = 0;
-            bool writeImage = false;
-            if (i == 100000 || i == 1000000 || i % 10000000 == 0 || i == 100000000)
-                writeImage = true;
+            msq = error.error(b*(double)npixels/(double)i);
+            msq_out << msq << endl;
 
-            for (int y = 0; y < H; y++)
+            if (i == 100000 || i == 1000000 || i % 10000000 == 0 || i == 100000000)
             {
-                for (int x = 0; x < W; x++)
+                for (int y = 0; y < height; y++)
                 {
-                    //Compute pixel value
-                    Vector3 result = img[x][y]*b*(double)W*(double)H/(double)i + direct_img[x][y];
-                    msq += pow((ptracing_results[y][x] - result).average(), 2);
-
-                    if (writeImage)
+                    for (int x = 0; x < width; x++)
                     {
+                        //Compute pixel value
+                        Vector3 result = img[x + y*width]*b*(double)npixels/(double)i + direct_img[x + y*width];
+
                         //Gamma correct
                         for (int i = 0; i < 3; i++)
                         {
@@ -977,13 +1096,7 @@ void a3hacker1()
                         g_image->setPixel(x,y,result);
                     }
                 }
-            }
-
-            msq /= (double)(W*H);
-            msq_out << msq << endl;
 
-            if (writeImage)
-            {
                 char filename[100];
 
                 sprintf(filename, "bidirectional_%s_%ld.ppm\0", version, i);
@@ -997,26 +1110,34 @@ void a3hacker1()
         mutate_path(p0_eye, p1_eye);
         mutate_path(p0_light, p1_light);
 
-        sample s = sampleBidirectionalPath(p1_eye, p1_light, W, H);
+        sample s = sampleBidirectionalPath(p1_eye, p1_light, width, height);
 
         p1_eye.I = s.value.average();
         p1_eye.F = s.value;
 
         double accept;
 
-        int x0 = (int)(p0_eye.u[0]*(double)W), y0 = (int)(p0_eye.u[1]*(double)H);
-        int x1 = (int)(p1_eye.u[0]*(double)W), y1 = (int)(p1_eye.u[1]*(double)H);
-        if (x0 == W) x0--;
-        if (y0 == H) y0--;
-        if (x1 == W) x1--;
-        if (y1 == H) y1--;
+        int x0 = (int)(p0_eye.u[0]*(double)width), y0 = (int)(p0_eye.u[1]*(double)height);
+        int x1 = (int)(p1_eye.u[0]*(double)width), y1 = (int)(p1_eye.u[1]*(double)height);
+        if (x0 == width) x0--;
+        if (y0 == height) y0--;
+        if (x1 == width) x1--;
+        if (y1 == height) y1--;
 
         //Add contribution to pixels
         accept = std::min(p1_eye.I / p0_eye.I, 1.);
         if (p0_eye.I > 0)
-            img[x0][y0] += (1.-accept)*(p0_eye.F / p0_eye.I);
+        {
+            Vector3 v = (1.-accept)*(p0_eye.F / p0_eye.I);
+            img[x0 + y0*width] += v;
+            error.add(x0, y0, v);
+        }
         if (p1_eye.I > 0)
-            img[x1][y1] += accept * (p1_eye.F / p1_eye.I);
+        {
+            Vector3 v = accept * (p1_eye.F / p1_eye.I);
+            img[x1 + y1*width] += v;
+            error.add(x1, y1, v);
+        }
 
         if (frand() < accept)
         {
@@ -1026,12 +1147,12 @@ void a3hacker1()
     }
 
     printf("\n");
-    for (int x = 0; x < W; x++)
+    for (int y = 0; y < height; y++)
     {
-        for (int y = 0; y < H; y++)
+        for (int x = 0; x < width; x++)
         {
             //Compute pixel value
-            Vector3 result = img[x][y]*b*(double)W*(double)H/(double)Nsamples + direct_img[x][y];
+            Vector3 result = img[x + y*width]*b*(double)npixels/(double)Nsamples + direct_img[x + y*width];
             b_result += result.average();
 
             //Gamma correct
@@ -1043,7 +1164,7 @@ void a3hacker1()
         }
     }
 
-    cout << "Resulting b: " << (b_result+direct_b)/(double)W/(double)H << endl;
+    cout << "Resulting b: " << (b_result+direct_b)/(double)npixels << endl;
 
     //write msq
     {
@@ -1055,3 +1176,34 @@ void a3hacker1()
     }
 
 }
+
+//Progressive bidirectional path tracing with all connection strategies
+void a3bdpt()
+{
+    const int Npasses = 1024;
+
+#ifdef HACKER2
+    const char* version = "sphere";
+#elif defined (HACKER3)
+    const char* version = "red";
+#else
+    const char* version = "gray";
+#endif
+
+    cout << "Bidirectional path tracing" << endl;
+    cout << Npasses << " samples per pixel." << endl;
+
+    const int width = g_image->width(), height = g_image->height();
+
+    //Load image from task 1
+    vector<Vector3> ptracing_results((long)width*height);
+    bool reference;
+    {
+        char filename[100];
+        sprintf(filename, "pathtracing_%s.raw", version);
+        reference = loadReferenceImage(filename, width, height, &ptracing_results[0]);
+    }
+
+    BidirectionalTracer bdpt(g_l);
+    bdpt.renderProgressive(reference ? &ptracing_results[0] : 0, width, height, Npasses, (long)(frand()*2147483647.), version);
+}
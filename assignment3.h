@@ -6,11 +6,12 @@
 #include "Utility.h"
 #include "Miro.h"
 
-void makeTask3Scene();
+void makeTask3Scene(int width = DEFAULT_WIDTH, int height = DEFAULT_HEIGHT);
 void a3task1();
 void a3task2();
 void a3task3();
 void a3hacker1();
+void a3bdpt();
 void BuildSquare(const Vector3& min, const Vector3& max, const Vector3& normal, const Material* mat);
 
 //for bidirectional path tracing
@@ -20,9 +21,10 @@ struct hit_point
     Vector3 theta_out; //outgoing direction
     Vector3 contrib;
     Vector3 N;
+    Vector3 Ng;           //geometric normal, for offsetting shadow rays
     Vector3 reflectance;  //reflectance at this point
 
-    hit_point() : contrib(0), x(0), N(0)
+    hit_point() : contrib(0), x(0), N(0), Ng(0)
     {}
 };
 
@@ -64,6 +66,8 @@ public:
     double I;
     Vector3 F;
 
+    double get(int i) const { return u[i]; }
+
     void init_random()
     {
         for (int i = 0; i < (PATH_LENGTH+1)*2+2; i++)
@@ -87,6 +91,61 @@ inline void path_copy(path& to, path& from)
     memcpy(&to, &from, sizeof(path));
 }
 
+//Primary sample space sampler for Metropolis (Kelemen et al. 2002).
+//The random numbers of the current path are only mutated when they
+//are requested with get(), so the dimensions a short path never uses
+//are not touched. A rejected mutation restores only the touched ones.
+class primary_sampler
+{
+public:
+    static const int Dimensions = (PATH_LENGTH+1)*2+2;
+
+    primary_sampler() : F(0) { I = 0; iteration = 0; last_large_step = 0; large_step = false; ntouched = 0; }
+
+    void start(const path& p);     //continue from a seed path
+    void start_iteration();        //propose a new path
+    double get(int i);             //random number i of the proposed path
+    void accept();
+    void reject();
+
+    //Random number i of the current path. Only valid for
+    //dimensions every path uses, like the pixel position.
+    double current(int i) const { return X[i].value; }
+
+    double I;
+    Vector3 F;
+
+private:
+    struct primary_sample
+    {
+        double value, backup;
+        long modified, modified_backup; //iteration the value was last mutated in
+    };
+
+    primary_sample X[Dimensions];
+    int touched[Dimensions];       //dimensions mutated in this iteration
+    int ntouched;
+    long iteration;
+    long last_large_step;
+    bool large_step;
+};
+
+//Eye and light subpaths of a bidirectional path
+struct bidirectional_path
+{
+    path eye;
+    path light;
+
+    void init_random()
+    {
+        eye.init_random();
+        light.init_random();
+    }
+};
+
+//Seed paths traced per parallel work block
+static const int SeedBlockSize = 4096;
+
 //static const double p_large = 1;
 static const double p_large = 0.005;
 #endif
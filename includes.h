@@ -1,10 +1,6 @@
 //Includes from project
 //Core
-#ifdef PHOTON_MAPPING
-#include "PScene.h"
-#else
 #include "Scene.h"
-#endif
 
 #include "Camera.h"
 #include "Image.h"
@@ -19,6 +15,8 @@
 #include "SquareLight.h"
 #include "TriangleMesh.h"
 #include "Triangle.h"
+#include "MeshObject.h"
+#include "Instance.h"
 #include "Plane.h"
 
 //Shading
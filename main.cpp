@@ -1,26 +1,23 @@
 #include <math.h>
 #include <string>
+#include <cstring>
 #ifdef OPENMP
 #include <omp.h>
 #endif
 #include "Miro.h"
 #include "MiroWindow.h"
 #include "assignment3.h"
+#include "Integrator.h"
 #include <FreeImage.h>
 #include "Camera.h"
 #include "Image.h"
-#ifdef PHOTON_MAPPING
-#include "PScene.h"
-#else
 #include "Scene.h"
-#endif
 
 using namespace std;
 
 void setup()
 {
     g_camera = new Camera;
-    g_scene = new Scene;
     g_image = new Image;
 }
 
@@ -43,7 +40,7 @@ main(int argc, char*argv[])
     cout << "Using OpenMP with up to " << omp_get_max_threads() << " threads." << endl;
 #endif
 #ifdef LINUX
-    srand48(time(0));
+    seedRandom(time(0));
 #endif
 //    srand(time(0));
 //mode = 0: Create opengl window and everything
@@ -58,25 +55,139 @@ int mode = 0;
     mode = 2;
 #endif
 
-bool metropolis = false;
-bool bidirectional = false;
-bool photonmapping = false;
+//The integrator used without a window. The macros only choose the default,
+//-integrator <name> picks any of them at run time.
+const char* integratorName = "pathtrace";
+
+#ifdef PHOTON_MAPPING
+integratorName = "photonmap";
+#endif
 
 #ifdef METROPOLIS
-metropolis = true;
+integratorName = "metropolis";
 #endif
 
 #ifdef BIDIRECTIONAL
-bidirectional = true;
+integratorName = "bidirectional-metropolis";
+#endif
+
+#ifdef BDPT
+integratorName = "bdpt";
 #endif
 
-//#ifdef PHOTON_MAPPING
-//photonmapping = true;
-//#endif
+//-res <width>x<height> sets the image resolution. The scene options are
+//kept until the integrator has made the scene.
+int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT;
+bool spatialSplits = false;
+BVH::Builder builder = BVH::SAH_BUILDER;
+long photonSeed = 0;
+int nPhotons = 0, irradianceRatio = 0, irradianceK = 0;
+string photonCache, bvhCache;
+for (int i = 1; i < argc; i++)
+{
+    if (strcmp(argv[i], "-res") == 0 && i+1 < argc)
+    {
+        if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+        {
+            cerr << "Invalid resolution " << argv[i] << ", expected <width>x<height>" << endl;
+            return 1;
+        }
+    }
+    else if (strcmp(argv[i], "-integrator") == 0 && i+1 < argc)
+    {
+        integratorName = argv[++i];
+        mode = 1;
+    }
+    else if (strcmp(argv[i], "-sbvh") == 0)
+    {
+        //Spatial splits in the BVH, for scenes with big overlapping triangles
+        spatialSplits = true;
+    }
+    else if (strcmp(argv[i], "-builder") == 0 && i+1 < argc)
+    {
+        //How the BVH is built: sah (the default), lbvh, or lbvh-treelets
+        const char* name = argv[++i];
+        if (strcmp(name, "sah") == 0)
+            builder = BVH::SAH_BUILDER;
+        else if (strcmp(name, "lbvh") == 0)
+            builder = BVH::LINEAR_BUILDER;
+        else if (strcmp(name, "lbvh-treelets") == 0)
+            builder = BVH::LINEAR_TREELET_BUILDER;
+        else
+        {
+            cerr << "Unknown BVH builder " << name << ", expected sah, lbvh or lbvh-treelets" << endl;
+            return 1;
+        }
+    }
+    else if (strcmp(argv[i], "-bvh-cache") == 0 && i+1 < argc)
+    {
+        //Load the BVH of the scene from <file> if it was saved for the same
+        //geometry and builder, otherwise save it there
+        bvhCache = argv[++i];
+    }
+    else if (strcmp(argv[i], "-photon-seed") == 0 && i+1 < argc)
+    {
+        //Seed of the photons of photonmap-global, the maps only depend on it
+        photonSeed = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-photons") == 0 && i+1 < argc)
+    {
+        //Photons per light source for each photon map of photonmap-global
+        nPhotons = atoi(argv[++i]);
+        if (nPhotons <= 0)
+        {
+            cerr << "Invalid photon count " << argv[i] << endl;
+            return 1;
+        }
+    }
+    else if (strcmp(argv[i], "-photon-cache") == 0 && i+1 < argc)
+    {
+        //Load the photon maps of photonmap-global from <name>.global.pmap and
+        //<name>.caustic.pmap if they were saved for this scene, otherwise save them there
+        photonCache = argv[++i];
+    }
+    else if (strcmp(argv[i], "-irradiance-cache") == 0 && i+2 < argc)
+    {
+        //Precompute the irradiance at every <ratio>'th global photon from its <k> nearest photons
+        irradianceRatio = atoi(argv[++i]);
+        irradianceK = atoi(argv[++i]);
+        if (irradianceRatio <= 0 || irradianceK <= 0)
+        {
+            cerr << "Invalid irradiance cache " << argv[i-1] << " " << argv[i] << ", expected <ratio> <k>" << endl;
+            return 1;
+        }
+    }
+    else if (strcmp(argv[i], "-integrators") == 0)
+    {
+        cout << "Integrators:" << endl;
+        Integrator::list(cout);
+        return 0;
+    }
+}
+
+Integrator* integrator = Integrator::create(integratorName);
+if (integrator == 0)
+{
+    cerr << "Unknown integrator " << integratorName << ", available are:" << endl;
+    Integrator::list(cerr);
+    return 1;
+}
+
+g_scene = integrator->createScene();
+g_scene->setSpatialSplits(spatialSplits);
+g_scene->setBVHBuilder(builder);
+if (!bvhCache.empty())
+    g_scene->setBVHCacheFile(bvhCache);
+g_scene->setPhotonSeed(photonSeed);
+if (nPhotons > 0)
+    g_scene->setPhotonCount(nPhotons, nPhotons);
+g_scene->setPhotonMapCache(photonCache);
+g_scene->setIrradianceCache(irradianceRatio, irradianceK);
 
 cout << "Mode: " << mode << endl;
+cout << "Resolution: " << width << "x" << height << endl;
 
-makeTask3Scene();
+makeTask3Scene(width, height);
 
 if (mode == 0)
 {
@@ -87,14 +198,8 @@ if (mode == 0)
 else if (mode == 1)
 {
     //A1makeTeapotScene();
-    cout << "Rendering without display" << endl;
-    g_camera->setRenderer(Camera::RENDER_RAYTRACE);
-    if (bidirectional)
-        a3hacker1();
-    else if(metropolis)
-        a3task3();
-    else
-        g_camera->click(g_scene, g_image);
+    cout << "Rendering without display using " << integratorName << endl;
+    integrator->render();
 
     g_image->writePPM();
 }
@@ -106,6 +211,8 @@ else
 //    a3task3();
 }
 
+delete integrator;
+
 #ifndef NO_FREEIMAGE
 	FreeImage_DeInitialise();
 #endif